@@ -8,11 +8,36 @@ Version 0.1 / March 2017
 --- Functions ---
 - Required Function Calls -
 gsmInit() - call at startup.
+void gsmInstanceInit(TGsmContext *ctx, UART_HandleTypeDef *uart,
+  const TGsmPins *pins) - call at startup for each further module (see
+  "Instances" below).
 gsm_MS_Init() - call at startup (required for some functionality / modules).
+void gsm_MS_InstanceInit(TGsmContext *ctx) - as gsm_MS_Init(), for each further
+  instance.
 gsm_GPRS_Init() - call at startup (TBD, requires GSM_GPRS module - not done yet).
 gsm1msPing() - call at 1ms intervals (from an interrupt). This is used to
-  update the timers used in this module.
+  update the timers used in this module (not needed if gsm_tickless is
+  defined, unless characters are received by polling - gsm_async_uart_rx
+  without gsm_dma_uart_rx).
 gsmPoll() - call as often as possible.
+unsigned long gsmNextDeadline() - time (ms) until gsmPoll() next has work to
+  do, 0 if it has work now (see "Timers" below).
+char gsmPollFor(unsigned long max_us) - (if gsm_poll_budget is defined) calls
+  gsmPoll() while there is work to do and its worst case fits in max_us;
+  returns 1 if there is still work to do (see "Poll Budget" below).
+- UART DMA (if gsm_dma_uart_rx is defined) -
+gsmUartRxPublish(huart) - call from the GSM UART interrupt on an idle line, and
+  from HAL_UART_RxHalfCpltCallback() / HAL_UART_RxCpltCallback().
+gsmUartRxDmaError(huart) - call from HAL_UART_ErrorCallback().
+- UART DMA (if gsm_dma_uart_tx is defined) -
+gsmUartTxDmaDone(huart) - call from HAL_UART_TxCpltCallback().
+- UART Raw Receive - (binary payloads, e.g. AT+QIRD / AT+QHTTPREAD data)
+void gsmUartRxRawExpect(char *header) - halt line framing after the next line
+  starting with header (e.g. "CONNECT"), leaving the payload unframed
+void gsmUartRxRawStart(unsigned int length, char *dest, consumer) - hand the
+  next length characters to consumer(char *data, unsigned int length) in
+  blocks (or, if consumer is 0, copy them to dest), then return to line mode
+unsigned int gsmUartRxRawPending() - number of raw characters still expected
 - Power -
 void gsmPowerSetOnOff(char power_on) - instructs the library to
   turn the module on or off (on by default)
@@ -29,11 +54,51 @@ void gsmGprsHttpGet(char* url) - initiate a HTTP GET operation
 void gsmGprsHttpPost(char* url, char* postdata) - initiate a HTTP POST operation
 char gsmGprsPending() - indicates if a GPRS operation is pending
 gsmGprsCancel() - cancels a pending GPRS operation
+- Requests - (see "Request Queue" below)
+char gsmRequestAdd(kind, priority, timeout, text, dest) - queue a request
+  (gsmreqXxx) with a priority (gsmprioXxx) and a deadline (timeout ms, 0 for
+  none); returns 0 if the queue is full
+char gsmRequestPending(char kind) - indicates if a request of a kind is qued
+void gsmRequestCancel(char kind) - removes the requests of a kind
+char gsmRequestPreempt() - indicates if a more urgent job has been qued
+TGsmHandle gsmRequestSubmit(kind, priority, timeout, text, dest, done, user)
+  - queue a request with a completion callback (see "Request Handles"
+  below); returns its handle, 0 if the queue is full
+TGsmHandle gsmMsgSendEx(Message, DestinationID, done, user),
+  gsmGprsHttpGetEx(url, done, user), gsmGprsHttpPostEx(url, postdata, done,
+  user), gsmDateTimeReadEx(done, user) - as the functions above, with a
+  completion callback; return the request's handle, 0 if the queue is full
+char gsmRequestAbort(TGsmHandle handle) - removes a qued request
+char gsmRequestActive(TGsmHandle handle) - indicates if a request is qued or
+  in progress
+TGsmResult *gsmRequestResult(), void gsmRequestData(data, length),
+  void gsmRequestDone(char status) - (for the SMS / GPRS modules) report on
+  the job in progress
+- RTOS - (if gsm_rtos is defined, GSM_RTOS.c, see "RTOS" below)
+char gsmRtosStart(UBaseType_t priority) - creates the GSM task (call once
+  the instances have been set up, instead of calling gsmPoll())
+TGsmHandle gsmRtosMsgSend(ctx, Message, DestinationID, done, user),
+  gsmRtosHttpGet(ctx, url, done, user), gsmRtosHttpPost(ctx, url, postdata,
+  done, user), gsmRtosRequest(ctx, kind, priority, timeout, text, dest, done,
+  user, wait) - que a request from another task (ctx 0 for the default
+  instance), returning 0 if it could not be qued (or before gsmRtosStart());
+  the strings are not copied: they must stay valid until done has been
+  called, from the GSM task (the first three require done)
+char gsmRtosEventPost(char GsmEventType) - (from gsmEvent()) passes a copy
+  of the event to the other tasks
+char gsmRtosEventGet(TGsmRtosEvent *event, TickType_t wait) - takes the
+  oldest event passed on (from another task)
+- Flows - (see "Flows" below)
+char gsmFlowStart(TGsmFlow *flow, char (*run)(TGsmFlow *flow)) - starts a
+  flow; returns 0 if it is already running
+void gsmFlowAbort(TGsmFlow *flow) - stops a flow
+char gsmFlowRunning(TGsmFlow *flow) - indicates if a flow is running
 - External Functions -
 extern void gsmEvent(char GsmEventType)
   Event data is available through the following event-specific variables:
     char* pstrGsmEventOriginatorID
     char* pstrGsmEventData
+    unsigned int wrdGsmEventDataLen
     TDateTime dtmGsmEvent
   GsmEventType can be:
     gsmevntDateTimeRead
@@ -44,9 +109,13 @@ extern void gsmEvent(char GsmEventType)
       Date/Time about to be written to the GSM module
         (initiated by gsmDateTimeWrite())
       dtmGsmEvent should be loaded with the date/time to be written
+    gsmevntUartBaud (if gsm_uart_baud_high is defined)
+      Baud rate settled after power-on; dwdGsmUartBaud holds it, and may be
+      saved and restored (before UART_GSM_Init()) on the next power cycle
     gsmevntIMEI_Read
       IMEI read from the GSM module
-      pstrGsmEventData points to the read IMEI
+      pstrGsmEventData points to the read IMEI (wrdGsmEventDataLen characters)
+      (valid until the event returns)
     gsmevntPIN_Request
       GSM module is requesting the SIM PIN code
         (ignore event if no pin needed)
@@ -61,10 +130,12 @@ extern void gsmEvent(char GsmEventType)
     gsmevntGprsHttpResultErr (requires GSM_GPRS module)
       HTTP operation returned a result code other than 200
         (e.g. 404 - page not found)
-      pstrGsmEventData points to the result code
+      pstrGsmEventData points to the result code (wrdGsmEventDataLen
+      characters)
     gsmevntGprsHttpResponseLine (requires GSM_GPRS module to be completed)
       HTTP operation result (fired for each line received)
-      pstrGsmEventData points to the result data
+      pstrGsmEventData points to the result data (wrdGsmEventDataLen
+      characters)
 *** Debugging Features ***
 #ifdef gsm_echo_int_rx
 extern gsmUartRxEcho(char *UartRxLine) - echoes UART line received
@@ -80,11 +151,287 @@ bitGSM_Stat_On_State can be used to determine which state on the GSM_Stat pin
 
 *** Operation ***
 --- UART RX ---
-Characters are received and added to a string buffer. When "new line" characters
-are received a flag is set to indicate that a line of communication has been
-received and is ready to be inspected / processed.
-A timer exists which will clear (reset) the string if a "new line" is not
-received within 100ms.
+Characters are received and added to a ring buffer (from gsm1msPing() when
+gsm_async_uart_rx is defined, otherwise from gsmPoll()). When gsm_dma_uart_rx
+is defined (GSM.h) the ring is filled by circular DMA instead, and new
+characters are published from the UART idle line interrupt and the DMA half /
+full transfer callbacks (see stm32l4xx_it.c). gsmPoll() moves them
+into a line buffer, and when "new line" characters are received a flag is set
+to indicate that a line of communication has been received and is ready to be
+inspected / processed. Up to 8 completed lines are queued (as descriptors
+holding the offset and length of each line), and pstrGsmUartRxLine /
+wrdGsmUartRxLineLen always refer to the oldest one. Lines stay in place until
+released with gsmUartRxLineProcessed(), and gsmUartRxLinePeek() gives access
+to the lines which follow it.
+Each line is classified once, as it is completed, against the response table
+in GSM.h (gsm_rsp_table); bytGsmUartRxLineRsp holds the response type
+(gsmrspXxx) of the oldest line, so states switch on it instead of comparing
+strings. gsmRspClassify() can be used for other text (e.g. peeked lines).
+If no character is received for gsm_uart_rx_line_gap ms (GSM.h) while a line
+is only partly received, that partial line is discarded; lines which have
+already been completed are kept until they are released, however long the
+main loop takes to get to them.
+--- UART TX ---
+Commands are queued (gsmUART_Write_Text() / gsmUART_Write()) by copying them
+into a 256 byte ring (cGsmUartTxRingSize), and sent from gsmPoll(). A write
+which does not fit is refused as a whole (returning 0) so that the caller can
+try again later; wrdGsmUartTxFullCtr counts such refusals and
+wrdGsmUartTxPeak holds the highest fill level seen, for sizing the ring.
+When gsm_dma_uart_tx is defined (GSM.h) everything queued is streamed
+straight out of the ring by a single DMA transfer (two if it wraps around),
+so a command built from several pieces goes out in one go rather than one
+piece per call to gsmPoll(). gsmUartTxSend() ques a caller's list of
+segments, with a callback once they have been sent.
+Commands are normally formatted with the command composer, straight into the
+UART Tx ring: gsmCmdBegin() (0 if there is no room for a command of up to
+126 characters, in which case the state tries again on the next call), then
+any of gsmCmdText(),
+gsmCmdChar(), gsmCmdQuoted(), gsmCmdInt() and gsmCmdDigits2(), and finally
+gsmCmdCommit() which appends Cr Lf and sends the command as one frame (or
+nothing at all, returning 0, if it did not fit).
+Sending carries on in the background (DMA, or one character per call to
+gsmPoll()) while the states keep being processed, so responses to earlier
+commands, URCs and timeouts are not held up by a long command. The state
+timeout and delay timers are paused until everything queued has been sent
+(gsmUartTxComplete()), so a response window starts once the command is out;
+states which need to know that a command has actually been sent should wait
+on gsmUartTxComplete() (gsmstDelay does).
+
+--- UART Flow Control ---
+When gsm_uart_hw_flow_ctl is defined (GSM.h) the module is set up for RTS/CTS
+flow control (AT+IFC=2,2, straight after ATE0). The module's CTS output gates
+our transmitter in hardware, while RTS is a plain output which tells the module
+to stop sending once the receive ring is half full, and to carry on once
+gsmPoll() has framed it down to a quarter. This allows the link to run at high
+baud rates without losing characters when gsmPoll() is held up.
+
+--- Baud Rate ---
+The module starts at USART_GSM_BAUDRATE (GSM.h), which is slow for large
+responses. When gsm_uart_baud_high is defined, the module is first found
+(AT, at the last working rate, then USART_GSM_BAUDRATE, then
+gsm_uart_baud_high), then moved up with AT+IPR=<rate>, after which the UART
+is reconfigured and the new rate checked with AT. Only once the module answers
+at the new rate is it saved in the module's profile (AT&W), so a rate which
+does not work is never kept by the module. If the module does not accept it
+or does not answer at the new rate, the previous rate is used (and the rate is
+not changed again until gsmInit()). The instance remembers the rate saved in
+the module (dwdGsmUartBaudSaved, kept over gsmInstanceInit()) and looks for
+the module there first after it restarts. gsmevntUartBaud reports the working
+rate; an application may save it and set it (dwdGsmUartBaud of the context)
+before UART_GSM_Init() after a reset, to skip the search.
+
+--- Command Echo ---
+Echo is turned off (ATE0) as part of the setup, straight after power-on.
+Until then (or if the module has been reset behind our back) the echo of the
+last command line queued for transmission is dropped as it is received, so
+it never reaches the state machine.
+
+--- State Table ---
+States which send a command and wait for its response are defined in a table
+(TGsmStateDef, GSM.h) rather than as cases of the state machine switch:
+the command (or a routine which composes it), the response which completes
+the state, the timeout, the number of tries, and the next state on success,
+on an error response and on failure. gsmPoll() looks the current state up
+directly (bytGsmStateDefIdx) and runs it before the module hooks and the
+switch. The core states are defined by gsmInit(); modules add their own with
+gsmStateDefine() from their Init routines. gsmSetStateCmdOK() remains for
+one-off commands.
+Queries (IMEI, PIN status, date/time, network registration) are transactions
+in the same table: each response line of the expected class (gsmrspXxx, or
+gsmrspNone for unprefixed lines such as the IMEI) is handed to a Parse
+routine, which returns the state to go to once the final "OK" has been
+received (or 0 if the line is not the one expected), and the retries and
+timeouts are handled by the engine. The time from each command being queued
+to its response is recorded (gsmStateLatency()).
+The rest stay cases of the switch: the power sequence, the baud rate search,
+PIN entry, standby and the call / message / GPRS hooks wait on pins, timers
+or a module rather than on the response to one command, and do not fit the
+table. Every state (table or switch) is numbered and named once, in
+gsm_state_table (GSM.h), as the events are in gsm_event_table.
+
+--- Timers ---
+The state machine timers (wrdGsmGPTmr, dwdGsmGPTmr, the delay and timeout
+timers, ...) count ms. By default gsm1msPing() advances them by 1 every ms.
+When gsm_tickless is defined, gsmPoll() instead advances them by the time
+elapsed since its last call, read from gsm_tick() (HAL_GetTick() by default,
+or e.g. an LPTIM count), so no 1ms interrupt is needed. The delay and timeout
+timers still only run once everything qued has been sent (from the end of
+the last DMA transfer).
+gsmNextDeadline() returns how long the state machine can be left alone: the
+time until the earliest delay, timeout, network registration check, ring
+timeout, partial line gap or request deadline, or 0 if it has work to do now
+(e.g. a request qued in standby). It has no side effects: requests are only
+dropped by gsmPoll().
+The main loop (or RTOS task) can sleep for that long, or until a GSM UART /
+DMA interrupt, before calling gsmPoll() again. GSM_Stat is not an interrupt,
+so the time is capped at cGsmSleepMax.
+
+--- Poll Budget ---
+When gsm_poll_budget is defined, gsmInit() enables the DWT cycle counter and
+every gsmPoll() call is timed: dwdGsmPollCycles holds the duration of the
+last call and dwdGsmPollCyclesMax the worst case seen (write 0 to reset it).
+gsmPollFor(max_us) calls gsmPoll() for as long as gsmNextDeadline() reports
+work to do and another call, at its worst case so far, still fits within
+max_us (at least one call is always made), so a super-loop can give the
+library a fixed slice of time. Each gsmPoll() call does a bounded amount of
+work: the lines framed are limited by cGsmUartRxLinesMax, one state machine
+step is run, and with polled reception (neither gsm_async_uart_rx nor
+gsm_dma_uart_rx) at most cGsmUartRxPollMax characters are read per call and
+gsmUartRxBuffClear() no longer dumps the discarded lines (it only reports
+them, as with the other reception modes).
+
+--- Request Queue ---
+Work asked for through the API (date/time read/write, SMS send, GPRS) is qued
+as requests (GsmRequests), each with a priority and an optional deadline, so
+that several SMS and GPRS operations can be outstanding at once.
+gsmDateTimeRead() / gsmDateTimeWrite() que at gsmprioNormal, gsmMsgSend() at
+gsmprioUrgent and gsmGprsHttpGet() / gsmGprsHttpPost() at gsmprioBulk; other
+priorities and deadlines can be given with gsmRequestAdd(). The most urgent
+request is run first, then the one with the earliest deadline, otherwise in
+the order qued. Requests which pass their deadline are dropped by gsmPoll(),
+before the state machine is run (gsmevntMsgDiscarded / gsmevntGprsFailed).
+Date/time requests are diversions (gsmCheckStateDivert()), run whenever the
+state machine allows one and removed once successful (a date/time write which
+the module does not acknowledge is qued again, behind the others, and given up
+on after 3 tries). Jobs (SMS, GPRS) are taken off the queue when the module is
+free (gsmstStandbyPre, gsmstStandby) and loaded into the variables the modules
+already use (pstrGsmMsgSendTxt, bitGsmMsgWritePending, pstrGsmGprsURL,
+bitGsmGprsPending, ...) before their hook state. When a job returns to
+gsmstStandbyPre the next one is started straight away. A job in progress is not
+interrupted: a module running a long job (e.g. GPRS) can check
+gsmRequestPreempt() at a safe point, re-que the rest of its work and return to
+gsmstStandbyPre to let the urgent job run. Pointers given with a request must
+stay valid until it has been run.
+
+--- Request Handles ---
+gsmEvent() cannot tell which request an event is about, so each request also
+has a handle (TGsmHandle, returned by gsmRequestSubmit() and the ...Ex()
+functions) and may carry a completion callback and a user pointer. The
+callback is called once, from gsmPoll() with the instance selected, with a
+TGsmResult: the handle, kind, status (gsmresXxx), user pointer and the
+request's typed data (Data.DateTime, Data.Msg or Data.Gprs). A request is
+finished with gsmresExpired when it passes its deadline, gsmresCancelled by
+gsmRequestAbort() / gsmRequestCancel(), and gsmresOK / gsmresFailed once a
+date/time request has been run (date/time reads qued together all get the
+one reading; a write is finished once the module has answered "OK", or after
+3 tries). The job in progress (SMS, GPRS) is finished by the module running it
+with gsmRequestDone(status), after filling in gsmRequestResult()
+(e.g. Data.Gprs.HttpStatus); a GPRS module passes the response on, a part at
+a time, with gsmRequestData() (gsmresData). A job which gets back to
+gsmstStandbyPre without the module having reported it ends with gsmresEnded
+(the outcome is then only known through gsmEvent()), and one which no module
+hooks in ends with gsmresFailed. The gsmEvent() events are raised as before.
+The callback may que further requests; a handle is only meaningful for the
+instance it was given by (TGsmResult.Ctx).
+
+--- Instances ---
+Everything kept for a module (UART rings and lines, state machine, timers,
+state table, URCs, requests, ...) is held in an instance context
+(TGsmContext, GSM.h), so that one MCU can drive several modules, e.g. on
+UART4, UART5 and LPUART1.
+gsmInit() sets up the default instance (GsmContextDefault, on UartGSMHandle
+with the pins in GSM.h). Further instances are set up with
+gsmInstanceInit(ctx, uart, pins), on a UART which has already been
+initialised (HAL_UART_Init(), with its DMA channels linked), followed by the
+modules' instance Init routines (gsm_MS_InstanceInit(ctx), ...), which
+register their states and URCs with it. gsmInstanceInit() on an instance
+already set up restarts its module, keeping what the modules registered.
+Each instance is run through the routines taking its context (GSM.h,
+"Instance API"): gsmInstanceXxx(ctx, ...) for gsmPoll(), gsmNextDeadline(),
+gsmPollFor(), gsmReady(), gsmPowerSetOnOff(), gsmDateTimeRead() /
+gsmDateTimeWrite(), gsmMsgSend(), gsmGprsHttpGet() / gsmGprsHttpPost(), their
+...Ex() forms, gsmRequestSubmit() / gsmRequestAbort() / gsmRequestActive()
+and gsmFlowStart() / gsmFlowAbort(), e.g.
+  gsmInstancePoll(&GsmModem2);
+  deadline = gsmInstanceNextDeadline(&GsmModem2);
+  handle = gsmInstanceMsgSendEx(&GsmModem2, text, number, done, 0);
+The routines without a context (gsmPoll(), gsmRequestSubmit(), ...) are thin
+wrappers acting on the default instance; called from a gsmEvent() or
+request callback, or from a module, they act on the instance being run,
+which gsmEventInstance() returns. gsm1msPing() runs for every instance, and
+the interrupt entry points take the UART handle of the interrupt (UARTs which
+no instance uses are ignored); neither changes the instance the main loop is
+running, so an interrupt may arrive in the middle of a gsmInstancePoll() of
+another instance. gsmUartTxSend() callbacks are passed the context.
+Inside the library the variables (bytGsmState, bitGSM_Ready, ...) are names
+for the members of the context being run (GSM_Ctx.h, which is private to the
+library and its modules); the application reads an instance through its
+context, or from the default instance with the routines above.
+As a context only refers to the hardware through its UART handle and pins,
+instances can be run side by side on a host build (Host/).
+
+--- RTOS ---
+When gsm_rtos is defined (GSM.h), GSM_RTOS.c runs the library from a FreeRTOS
+task (gsmRtosStart()) instead of the main loop. The task polls every
+instance, then blocks on a task notification until the earliest
+gsmNextDeadline() (at most cGsmRtosSleepMax), so there is no fixed polling
+interval: the GSM UART / DMA interrupt entry points (and gsm1msPing(), with
+polled reception) wake it as soon as there is something to do. As they call
+FreeRTOS (gsmRtosNotifyFromISR()), those interrupts must be no more urgent
+than configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY (numerically no lower):
+under gsm_rtos stm32l4xx_hal_msp.c gives the GSM UART and DMA interrupts that
+priority (2 otherwise). gsm_tickless should be defined, so that the timers
+follow gsm_tick() rather than a 1ms interrupt. Should the state machine report
+work to do for cGsmRtosBusyMax passes in a row, the task blocks for a tick to
+let lower priority tasks run. Once the task has been started only the task
+calls into the library. Other tasks que requests through a FreeRTOS queue
+(gsmRtosMsgSend(), gsmRtosHttpGet(), gsmRtosHttpPost(), gsmRtosRequest()),
+which wakes the task to move them onto the instance's request queue. They
+return the request's handle at once (with cGsmRtosHandle set, so that it can
+not clash with those given out by the task), and the callback is called from
+the task, with gsmresFailed if the instance's queue was full. gsmEvent() is
+called from the task; it can hand events to the other tasks with
+gsmRtosEventPost(), which copies the event data (which is only valid during the
+call) into a queue read with gsmRtosEventGet(): the caller ID of
+gsmevntMissedCall, and the wrdGsmEventDataLen characters of pstrGsmEventData
+for the events which carry data (gsmevntIMEI_Read, gsmevntGprsHttpResultErr,
+gsmevntGprsHttpResponseLine). Events which need an answer (gsmevntPIN_Request,
+gsmevntDateTimeWrite) must still be answered within gsmEvent().
+
+--- Flows ---
+A sequence of commands which would otherwise need a state per step (and a
+range of state numbers) can be written as one routine, a flow, using the
+gsmFlowXxx() macros in GSM.h (send; await "OK" or a timeout; send; await
+"+CSQ"). The macros turn the routine into a stackless coroutine: each wait
+returns from it, recording the source line to resume from in the TGsmFlow,
+so a flow costs a TGsmFlow rather than a stack. Flows are started with
+gsmFlowStart() and run, in turn, from gsmstFlow, which standby enters while
+any are running. Any number of flows interleave: once a flow has sent a
+command (gsmFlowSend()) the module is its own until the final response (OK,
+ERROR, +CME / +CMS ERROR) or the timeout of its gsmFlowAwait(), so the other
+flows' commands wait, while flows in a gsmFlowDelay() or gsmFlowWaitUntil()
+carry on. A flow which sends again straight after its final response keeps
+the module. The line awaited stays first (gsmUartRxLinePeek(0, ...)) until the
+flow's next wait; lines no flow awaits are discarded (after the URC table has
+seen them). A gsmFlowAwait() which gets the final response instead of the
+line it awaits (e.g. "OK" or "ERROR" without "+CSQ") returns with it, and any
+later gsmFlowAwait() before the next command returns at once with that same
+final response (TGsmFlow.Final), rather than waiting out its timeout.
+Between a final response and the flow's next command, calls, messages, qued
+jobs and diversions are dealt with first (through gsmstStandbyPre), after
+which the flows resume.
+
+--- Module Setup ---
+When gsm_setup_batch is defined (GSM.h) the setup commands (AT+CLIP=1,
+AT+CMGF=1, AT+CNMI=2,1) are sent as one semicolon-chained command line,
+together with any module-specific setup commands which the module adds with
+gsmSetupBatchAdd() from its gsmstSetup_MSHI hook (e.g. +CTZU=2), so that setup
+takes one round trip rather than one per command. Should the batch fail
+("ERROR", or no "OK" after 3 tries) the setup is run again one command at a
+time (gsmSetupBatchAdd() returning 0 tells the module to send its own), and
+stays that way until gsmInit().
+
+--- URC Dispatch ---
+Before the current state is processed, gsmPoll() checks each new line against
+a table of unsolicited result code prefixes (RING, +CLIP, NO CARRIER, +CMTI
+and +CREG are registered by gsmInit()). A matching handler may consume the
+line, in which case it is released and the state never sees it; otherwise the
+line is left for the current state. Incoming calls and messages are therefore
+noticed in any state, and acted upon once the state machine is back in standby.
+Modules register further prefixes (from their Init routines) with
+char gsmUrcRegister(char *prefix, char (*handler)(char *line,
+unsigned int length)), where handler returns 1 if it has consumed the line.
+Up to 12 prefixes can be registered.
 
 --- State Machine ---
 Most of the software works on a state machine.
@@ -95,6 +442,27 @@ before moving to the next state.
 Provision is also made for a timeout condition, which will default to
 a desired state if it is not cancelled within a certain amount of time.
 
+--- Host Build ---
+Host/ builds the library on a Linux host (make), against a stand-in for the
+STM32L4 HAL (Host/stm32l4xx_hal.h), with the options set in GSM.h. The host
+program plays the line and the interrupts: HostUartRx() delivers characters
+through the circular DMA (half / full transfer callbacks, then the idle line
+interrupt) or for polled reception, and HostTickAdd() lets time pass
+(SysTick_Handler(), which ends the DMA transmissions under way).
+gsm_host_it.c routes the interrupts to the library as stm32l4xx_it.c does.
+bench_rx feeds a captured M95 trace (Host/trace_m95.h) through the DMA / idle
+line receive path and gsmPoll(), and reports the time per character and line.
+bench_scan times strScanChar() against the per-character scan and memchr()
+on the same trace (the host's timings, which need not rank them as a
+Cortex-M4 does). str_scan_swar (GSM.h) is off, as the word-at-a-time scan
+showed no gain there; to time it, build with CFLAGS="-O2 -Dstr_scan_swar".
+bench_rsp compares the per-line cost of gsmRspClassify() with a chain of
+memcmp() calls over the same tokens, on the trace's lines.
+test_instances runs two instances side by side, with the interrupts of one
+arriving in the middle of the other's gsmInstancePoll().
+test_flows feeds a RING between a command's response lines, in one burst,
+while a flow awaits the "OK", and checks that the URC table still sees it.
+
 *** Version History ***
 --- v0.1    (2017/03/22) ---
 Original release
@@ -102,12 +470,12 @@ Original release
 
 #define gsm_async_uart_rx // Enable asynchronous RX from the GSM module
                           // (using gsm1msPing())
-                          // This can result in occasional delays of up to 1ms
-                          // when gsmPoll() is called,
-                          // but is preferrable if it is not possible to call
-                          // gsmPoll() frequently
+                          // Characters are handed to gsmPoll() through a
+                          // lock-free ring buffer, which is preferrable if it
+                          // is not possible to call gsmPoll() frequently
 
 #include "GSM.h"
+#include "GSM_Ctx.h"
 
 //<String_Functions>
 #include "Str.h"
@@ -123,33 +491,58 @@ extern void gsmDebugStateStrReady();
 #endif
 //</Debugging>
 
-// ---------- UART Tx (Optionally Non-Blocking) ----------
-volatile GPIO_TypeDef *GSM_Pwr_Key = (GPIO_TypeDef *)(GSM_Pwr_Key_Port);
-#ifdef gsm_reset_en
-volatile GPIO_TypeDef *GSM_Reset = (GPIO_TypeDef *)(GSM_Reset_Port);
-#endif
-volatile GPIO_TypeDef *GSM_Stat = (GPIO_TypeDef *)(GSM_Stat_Port);
+// ---------- Instances ----------
 //Define the UART used in the project 
 UART_HandleTypeDef UartGSMHandle;
+const TGsmPins GsmPinsDefault = {
+  GSM_Pwr_Key_Port, GSM_Pwr_Key_Pin,
+  #ifdef gsm_reset_en
+  GSM_Reset_Port, GSM_Reset_Pin,
+  #else
+  0, 0,
+  #endif
+  GSM_Stat_Port, GSM_Stat_Pin,
+  #ifdef gsm_uart_hw_flow_ctl
+  USART_GSM_RTS_GPIO_PORT, USART_GSM_RTS_PIN
+  #else
+  0, 0
+  #endif
+};
+TGsmContext GsmContextDefault = {.pUart = &UartGSMHandle}; // (gsmInit())
+TGsmContext *pGsm = &GsmContextDefault; // Instance being run (GSM_Ctx.h)
+TGsmContext *pGsmFirst = 0; // Instances set up (linked through pNext)
+
+static TGsmContext *gsmInstanceOfUart(UART_HandleTypeDef *uart) {
+  // Returns the instance using uart (from the UART / DMA interrupts), 0 if
+  // none
+  TGsmContext *ctx;
+  for (ctx = pGsmFirst; ctx; ctx = ctx->pNext) {
+    if (ctx->pUart == uart) {
+      return ctx;
+    }
+  }
+  return 0;
+}
 
+TGsmContext *gsmEventInstance() {
+  // Returns the instance being run (from gsmEvent() and the callbacks)
+  return pGsm;
+}
+
+// ---------- UART Tx (Optionally Non-Blocking) ----------
 // UART Communication
-//#define gsm_blocking_uart_tx //Remove for Non-blocking UART Tx
 #ifndef gsm_blocking_uart_tx
-#define cGsmUartTxQueMaxSize  8
-unsigned int wrdGsmUartTxStrCharQueSw; // Bitfield indicating whether the next
-                                       // qued item is a string or a char
-                                       // (1 indicates a string, 0 a char)
-char bytGsmUartTxStrCharQueSwPos = 0;
-char *pcharGsmUartTxStrQue[cGsmUartTxQueMaxSize];
-char bytGsmUartTxStrQueSize = 0;
-char bytGsmUartTxStrQuePos = 0;
-char charGsmUartTxCharQue[cGsmUartTxQueMaxSize];
-char bytGsmUartTxCharQueSize = 0;
-char bytGsmUartTxCharQuePos = 0;
+// Everything queued is copied into the UART Tx ring (so callers can reuse
+// their buffers straight away); a write which does not fit is refused whole
+#define cGsmUartTxRingMask  (cGsmUartTxRingSize - 1)
+#ifdef gsm_dma_uart_tx
+// The ring is streamed by DMA transfers, each up to its head (or its end)
+DMA_HandleTypeDef hdmaGsmTx;
+#endif
 #endif
 
 char UART_Tx_Idle(void){
-  if(UART_CheckIdleState(&UartGSMHandle) == HAL_OK)
+  if(UART_CheckIdleState(pGsm->pUart) == HAL_OK)
   {
     return 1;
   }
@@ -157,99 +550,232 @@ char UART_Tx_Idle(void){
 }
 
 void UART_Write(char *pData){
-  HAL_UART_Transmit(&UartGSMHandle,(uint8_t *) pData, sizeof(pData), TimeOut_TX);
+  HAL_UART_Transmit(pGsm->pUart,(uint8_t *) pData, strlen(pData), TimeOut_TX);
+}
+
+void UART_Write_Char(char data_){
+  HAL_UART_Transmit(pGsm->pUart,(uint8_t *) &data_, 1, TimeOut_TX);
 }
 
 char UART_Read(void){
   char pData[2];
-  HAL_UART_Receive(&UartGSMHandle,(uint8_t *) pData,1,TimeOut_RX);
+  HAL_UART_Receive(pGsm->pUart,(uint8_t *) pData,1,TimeOut_RX);
   return pData[0];
 }
 
 bit UART_Data_Ready(void){
-  if(__HAL_UART_GET_FLAG(&UartGSMHandle, UART_FLAG_RXNE) == SET) {
+  if(__HAL_UART_GET_FLAG(pGsm->pUart, UART_FLAG_RXNE) == SET) {
     return 1;
   }
   return 0;
 }
 
 void UART_GSM_Init(void){
-  
+  // Sets up UartGSMHandle for the default instance
+  gsmCtxEnter(&GsmContextDefault);
+  if (!dwdGsmUartBaud) {
+    dwdGsmUartBaud = USART_GSM_BAUDRATE;
+  }
   UartGSMHandle.Instance        = USART_GSM;
 
-  UartGSMHandle.Init.BaudRate   = USART_GSM_BAUDRATE;
+  UartGSMHandle.Init.BaudRate   = dwdGsmUartBaud; // (may be set to the rate
+                                                  // saved from gsmevntUartBaud)
   UartGSMHandle.Init.WordLength = UART_WORDLENGTH_8B;
   UartGSMHandle.Init.StopBits   = UART_STOPBITS_1;
   UartGSMHandle.Init.Parity     = UART_PARITY_NONE;
+  #ifdef gsm_uart_hw_flow_ctl
+  UartGSMHandle.Init.HwFlowCtl  = UART_HWCONTROL_CTS; // RTS: see gsmUartRx()
+  #else
   UartGSMHandle.Init.HwFlowCtl  = UART_HWCONTROL_NONE;
+  #endif
   UartGSMHandle.Init.Mode       = UART_MODE_TX_RX;
   HAL_UART_Init(&UartGSMHandle);
+  #ifdef gsm_dma_uart_rx
+  gsmUartRxDmaStart();
+  #endif
+  gsmCtxLeave();
 }
-void gsmUART_Write_Text(char *UART_text) {
-  #ifndef gsm_blocking_uart_tx
+// Command echo
+// The last command line queued (up to its Cr) is remembered, so that the
+// module's echo of it can be dropped as it is received (see
+// gsmUartRxLineReceived()), should echo be on (e.g. before ATE0).
+
+static void gsmUartTxCmdAdd(char data_) {
+  if (data_ == 13) { // End of command line
+    if (bytGsmUartTxCmdLen <= cGsmUartTxCmdSize) {
+      memcpy(strGsmUartTxCmdEcho, strGsmUartTxCmd, bytGsmUartTxCmdLen);
+      bytGsmUartTxCmdEchoLen = bytGsmUartTxCmdLen;
+    } else {
+      bytGsmUartTxCmdEchoLen = 0;
+    }
+    bytGsmUartTxCmdLen = 0;
+  } else if (data_ != 10) {
+    if (bytGsmUartTxCmdLen < cGsmUartTxCmdSize) {
+      strGsmUartTxCmd[bytGsmUartTxCmdLen] = data_;
+    }
+    if (bytGsmUartTxCmdLen <= cGsmUartTxCmdSize) {
+      bytGsmUartTxCmdLen++; // cGsmUartTxCmdSize + 1 marks a long line
+    }
+  }
+}
+
+#ifndef gsm_blocking_uart_tx
+static unsigned int gsmUartTxRingFree() {
+  return cGsmUartTxRingSize - (wrdGsmUartTxRingHead - wrdGsmUartTxRingTail);
+}
+
+static void gsmUartTxRingPublish(unsigned int length) {
+  // Makes the characters written past the head available to be sent
+  wrdGsmUartTxRingHead += length;
+  length = wrdGsmUartTxRingHead - wrdGsmUartTxRingTail;
+  if (length > wrdGsmUartTxPeak) {
+    wrdGsmUartTxPeak = length;
+  }
+}
+
+static void gsmUartTxRingPut(char *data, unsigned int length) {
+  // Adds to the ring (the caller has checked that there is room)
+  unsigned int pos;
+  unsigned int chunk;
+  pos = wrdGsmUartTxRingHead & cGsmUartTxRingMask;
+  chunk = cGsmUartTxRingSize - pos;
+  if (chunk > length) {
+    chunk = length;
+  }
+  memcpy(strGsmUartTxRing + pos, data, chunk);
+  memcpy(strGsmUartTxRing, data + chunk, length - chunk); // Wrapped part
+  gsmUartTxRingPublish(length);
+}
+#endif
+
+char gsmUART_Write_Text(char *UART_text) {
   // Add a string to the UART Tx que
-  if (*UART_text != 0) {
-  //if (bytGsmUartTxStrQueSize < cGsmUartTxQueMaxSize) {
-    pcharGsmUartTxStrQue[bytGsmUartTxStrQueSize] = UART_text;
-    bytGsmUartTxStrQueSize++;
-    wrdGsmUartTxStrCharQueSw <<= 1;
-    wrdGsmUartTxStrCharQueSw |= 1;
-    //wrdGsmUartTxStrCharQueSw.B0 = 1;
-    bytGsmUartTxStrCharQueSwPos++;
-  //}
+  // Returns 1 if accepted, 0 if there is no room for all of it (nothing is
+  // qued, try again later)
+  char *pos;
+  #ifndef gsm_blocking_uart_tx
+  unsigned int length;
+  length = strlen(UART_text);
+  if (length > gsmUartTxRingFree()) {
+    wrdGsmUartTxFullCtr++;
+    return 0;
+  }
+  #endif
+  for (pos = UART_text; *pos != 0; pos++) {
+    gsmUartTxCmdAdd(*pos);
   }
+  #ifndef gsm_blocking_uart_tx
+  gsmUartTxRingPut(UART_text, length);
   #else
-    UART_Write_Text(UART_text);
+    UART_Write(UART_text);
   #endif
+  return 1;
 }
 
-void gsmUART_Write(char data_) {
-  #ifndef gsm_blocking_uart_tx
+char gsmUART_Write(char data_) {
   // Add a single character to the UART Tx que
-  //if (bytGsmUartTxCharQueSize < cGsmUartTxQueMaxSize) {
-    charGsmUartTxCharQue[bytGsmUartTxCharQueSize] = data_;
-    bytGsmUartTxCharQueSize++;
-    wrdGsmUartTxStrCharQueSw <<= 1;
-    //wrdGsmUartTxStrCharQueSw.B0 = 0; // Should not be necessary
-    bytGsmUartTxStrCharQueSwPos++;
-  //}
+  // Returns 1 if accepted, 0 if there is no room (try again later)
+  #ifndef gsm_blocking_uart_tx
+  if (!gsmUartTxRingFree()) {
+    wrdGsmUartTxFullCtr++;
+    return 0;
+  }
+  #endif
+  gsmUartTxCmdAdd(data_);
+  #ifndef gsm_blocking_uart_tx
+  gsmUartTxRingPut(&data_, 1);
   #else
-    UART_Write(data_)
+    UART_Write_Char(data_);
   #endif
+  return 1;
 }
 
 #ifndef gsm_blocking_uart_tx
+#ifdef gsm_dma_uart_tx
+char gsmUartTxSend(TGsmUartTxSeg *segs, char count,
+                   void (*done)(TGsmContext *ctx)) {
+  // Ques a list of segments (as a whole) to be streamed to the module
+  // (a segment with a Length of 0 is a null-terminated string)
+  // done (optional) is called from the interrupt once they have been sent
+  // Returns 1 if accepted, 0 if there is no room for all of them or a
+  // previous done callback is still pending
+  char i;
+  unsigned int length = 0;
+  if (p_gsmUartTxDmaDone) {
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    length += segs[i].Length ? segs[i].Length : strlen(segs[i].Data);
+  }
+  if (length > gsmUartTxRingFree()) {
+    wrdGsmUartTxFullCtr++;
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    length = segs[i].Length ? segs[i].Length : strlen(segs[i].Data);
+    gsmUartTxRingPut(segs[i].Data, length);
+  }
+  wrdGsmUartTxDmaDoneAt = wrdGsmUartTxRingHead;
+  p_gsmUartTxDmaDone = done;
+  return 1;
+}
+
+void gsmUartTxDmaDone(UART_HandleTypeDef *uart) {
+  // Transfer complete (called from HAL_UART_TxCpltCallback())
+  TGsmContext *pGsm = gsmInstanceOfUart(uart); // (see GSM_Ctx.h)
+  void (*done)(TGsmContext *ctx);
+  if (!pGsm) {
+    return; // Not used by an instance
+  }
+  wrdGsmUartTxRingTail += wrdGsmUartTxDmaLen;
+  wrdGsmUartTxDmaLen = 0;
+  bitGsmUartTxDmaBusy = 0;
+  #ifdef gsm_tickless
+  dwdGsmUartTxDoneTick = gsm_tick();
+  #endif
+  done = p_gsmUartTxDmaDone;
+  if (done && ((int)(wrdGsmUartTxRingTail - wrdGsmUartTxDmaDoneAt) >= 0)) {
+    p_gsmUartTxDmaDone = 0;
+    done(pGsm);
+  }
+  #ifdef gsm_rtos
+  gsmRtosNotifyFromISR(); // Send the rest / start the timeout
+  #endif
+}
+
+static char gsmUartTx() {
+  // Process the UART Tx Que
+  // Everything qued is sent in one transfer (two if it wraps around the ring)
+  // Returns 1 if there are still que items to be processed, 0 if not
+  unsigned int pos;
+  unsigned int length;
+  if (bitGsmUartTxDmaBusy) {
+    return 1;
+  }
+  length = wrdGsmUartTxRingHead - wrdGsmUartTxRingTail;
+  if (!length) {
+    return 0;
+  }
+  pos = wrdGsmUartTxRingTail & cGsmUartTxRingMask;
+  if (length > cGsmUartTxRingSize - pos) {
+    length = cGsmUartTxRingSize - pos; // Up to the end of the ring
+  }
+  wrdGsmUartTxDmaLen = length;
+  // Retried on the next call if the UART is busy
+  if (HAL_UART_Transmit_DMA(pGsm->pUart, (uint8_t *)strGsmUartTxRing + pos,
+                            length) == HAL_OK) {
+    bitGsmUartTxDmaBusy = 1;
+  }
+  return 1;
+}
+#else
 static char gsmUartTx() {
   // Process the UART Tx Que
   // Returns 1 if there are still que items to be processed, 0 if not
-  unsigned int sw;
-  if (bytGsmUartTxStrQueSize || bytGsmUartTxCharQueSize) {
+  if (wrdGsmUartTxRingHead != wrdGsmUartTxRingTail) {
     if (UART_Tx_Idle()) {
-      sw = wrdGsmUartTxStrCharQueSw >> (bytGsmUartTxStrCharQueSwPos - 1);
-      if (sw & 1) {
-        // String is next in que
-        UART_Write((char *)pcharGsmUartTxStrQue[bytGsmUartTxStrQuePos]);
-        pcharGsmUartTxStrQue[bytGsmUartTxStrQuePos]++; // Increment position within string
-        if (!*pcharGsmUartTxStrQue[bytGsmUartTxStrQuePos]) { // End of string
-          bytGsmUartTxStrQuePos++; // Increment que position
-          bytGsmUartTxStrCharQueSwPos--;
-          if (bytGsmUartTxStrQuePos == bytGsmUartTxStrQueSize) {
-            // End of que
-            bytGsmUartTxStrQueSize = 0;
-            bytGsmUartTxStrQuePos = 0;
-          }
-        }
-      } else {
-        // Char is next in que
-        UART_Write((char *)charGsmUartTxCharQue[bytGsmUartTxCharQuePos]);
-        bytGsmUartTxCharQuePos++; // Increment que position
-        bytGsmUartTxStrCharQueSwPos--;
-        if (bytGsmUartTxCharQuePos == bytGsmUartTxCharQueSize) {
-          // End of que
-          bytGsmUartTxCharQueSize = 0;
-          bytGsmUartTxCharQuePos = 0;
-        }
-      }
+      UART_Write_Char(strGsmUartTxRing[wrdGsmUartTxRingTail & cGsmUartTxRingMask]);
+      wrdGsmUartTxRingTail++;
     }
     return 1;
   } else {
@@ -257,89 +783,553 @@ static char gsmUartTx() {
   }
 }
 #endif
+#endif
+
+static char gsmUartTxEmpty(TGsmContext *pGsm) {
+  // (pGsm: as gsm1msPing() runs it from the interrupt)
+  #ifndef gsm_blocking_uart_tx
+  #ifdef gsm_dma_uart_tx
+  if (bitGsmUartTxDmaBusy) {
+    return 0;
+  }
+  #endif
+  return (wrdGsmUartTxRingHead == wrdGsmUartTxRingTail);
+  #else
+  return 1;
+  #endif
+}
+
+char gsmUartTxComplete() {
+  // Returns 1 once everything qued has been sent, 0 if not
+  return gsmUartTxEmpty(pGsm);
+}
+
+// Command composer
+// A command is formatted straight into the UART Tx ring (or a frame buffer
+// with gsm_blocking_uart_tx), with bounds checking, and committed as one
+// frame with Cr Lf appended.
+// gsmCmdBegin() .. gsmCmdCommit() should be called from the same state.
+
+char gsmCmdBegin() {
+  // Starts composing a command
+  // Returns 1 if successful, 0 if the UART Tx ring does not have room for a
+  // command of up to cGsmCmdMaxSize (try again later)
+  #ifndef gsm_blocking_uart_tx
+  if (gsmUartTxRingFree() < cGsmCmdMaxSize + 2) {
+    wrdGsmUartTxFullCtr++;
+    return 0;
+  }
+  #endif
+  wrdGsmCmdLen = 0;
+  bitGsmCmdOverflow = 0;
+  bytGsmUartTxCmdLen = 0; // Start of the command line (for its echo)
+  return 1;
+}
+
+static void gsmCmdStore(char data_) {
+  #ifndef gsm_blocking_uart_tx
+  strGsmUartTxRing[(wrdGsmUartTxRingHead + wrdGsmCmdLen) & cGsmUartTxRingMask] = data_;
+  #else
+  strGsmUartTxFrame[wrdGsmCmdLen] = data_;
+  #endif
+  wrdGsmCmdLen++;
+}
+
+void gsmCmdChar(char data_) {
+  if (wrdGsmCmdLen < cGsmCmdMaxSize) {
+    gsmCmdStore(data_);
+    gsmUartTxCmdAdd(data_);
+  } else {
+    bitGsmCmdOverflow = 1;
+  }
+}
+
+void gsmCmdText(char *text) {
+  // Literal text (e.g. "AT", strCREG)
+  for (; *text != 0; text++) {
+    gsmCmdChar(*text);
+  }
+}
+
+void gsmCmdQuoted(char *text) {
+  // Text between quotes (e.g. phone numbers, URLs)
+  gsmCmdChar('"');
+  gsmCmdText(text);
+  gsmCmdChar('"');
+}
+
+void gsmCmdInt(long value) {
+  char digits[10];
+  char ctr = 0;
+  unsigned long magnitude;
+  magnitude = value;
+  if (value < 0) {
+    gsmCmdChar('-');
+    magnitude = -magnitude;
+  }
+  do {
+    digits[ctr] = (magnitude % 10) + 48;
+    ctr++;
+    magnitude /= 10;
+  } while (magnitude);
+  while (ctr) {
+    ctr--;
+    gsmCmdChar(digits[ctr]);
+  }
+}
+
+void gsmCmdDigits2(char value) {
+  // Two-digit field (00 - 99), e.g. for dates / times
+  gsmCmdChar((value / 10) + 48);
+  gsmCmdChar((value % 10) + 48);
+}
+
+char gsmCmdCommit() {
+  // Sends the command composed
+  // Returns 1 if successful, 0 if it did not fit (nothing is sent)
+  if (bitGsmCmdOverflow) {
+    wrdGsmUartTxFullCtr++;
+    bytGsmUartTxCmdLen = 0;
+    return 0;
+  }
+  gsmUartTxCmdAdd(13); // Expect its echo
+  gsmCmdStore(13);
+  gsmCmdStore(10);
+  #ifndef gsm_blocking_uart_tx
+  gsmUartTxRingPublish(wrdGsmCmdLen);
+  #else
+  strGsmUartTxFrame[wrdGsmCmdLen] = 0;
+  UART_Write(strGsmUartTxFrame);
+  #endif
+  return 1;
+}
 
 // ---------- END UART Tx (Optionally Non-Blocking) ----------
 
 // ---------- UART Rx ----------
 
-char charGsmUartRx; // Received character
-char strGsmUartRxBuff[256]; // String of data / communication which has been rcvd
-char *pstrGsmUartRxBuff = (char *)strGsmUartRxBuff; // Current pos. within the above string
-bit bitGsmUartRxReset; // Clear UART Rx buffer on timeout
-#ifdef gsm_debug_state
-bit bitGsmUartRxCharsLost;
-bit bitGsmUartRxBuffCleared;
-#endif
-// Marker for avoiding buffer overrun
-char *pstrGsmUartRxBuffCutoff = (char *)strGsmUartRxBuff+sizeof(strGsmUartRxBuff);
-//char *pstrUartRxLine = &strGsmUartRxBuff; // Start of line currently being received
-bit bitGsmUartRxLineReady; // Indicates that a "line" of communcation has been
-                       // received, and is ready to be inspected / processed.
-                       // Should be reset / cleared after the communication
-                       // has been inspected / processed, in order to allow
-                       // further communication to be received.
-char bytGsmUartRxLinesReady = 0;
-char bytGsmUartRxQuietTimer = 0;
-#ifdef gsm_async_uart_rx
-bit bitGsmUartRxSync;
+// Characters are passed from the receiving side (gsm1msPing() when
+// gsm_async_uart_rx is defined) to gsmPoll() through a single-producer /
+// single-consumer ring buffer.
+// Only the producer writes wrdGsmUartRxRingHead and only the consumer writes
+// wrdGsmUartRxRingTail, so neither side ever has to wait for the other.
+// Both positions are free-running; they are masked when the ring is accessed.
+#define cGsmUartRxRingMask  (cGsmUartRxRingSize - 1)
+#ifdef gsm_uart_hw_flow_ctl
+// RTS is deasserted (module stops sending) once the ring is half full, which
+// leaves room for what the module sends before it reacts (and, with DMA, for
+// up to half a ring between two publishes), and asserted again below a quarter
+#define cGsmUartRxRtsOff    (cGsmUartRxRingSize / 2)
+#define cGsmUartRxRtsOn     (cGsmUartRxRingSize / 4)
 #endif
+// Completed lines are kept in strGsmUartRxBuff and described by a queue of
+// line descriptors (offset + length), oldest first.
+// Lines are stored null-terminated and are never moved once completed,
+// so handlers can inspect them in place until they are released.
+#define cGsmUartRxLinesMask (cGsmUartRxLinesMax - 1)
+
+static void gsmUartRxLineFirst() {
+  // Points pstrGsmUartRxLine / wrdGsmUartRxLineLen at the first line ready
+  TGsmUartRxLine *line;
+  if (bytGsmUartRxLinesReady) {
+    line = &GsmUartRxLines[bytGsmUartRxLinesTail & cGsmUartRxLinesMask];
+    pstrGsmUartRxLine = (char *)strGsmUartRxBuff + line->Offset;
+    wrdGsmUartRxLineLen = line->Length;
+    bytGsmUartRxLineRsp = line->Rsp;
+    bitGsmUartRxLineReady = 1;
+    bitGsmUartRxLineUrcChecked = 0;
+  } else {
+    bitGsmUartRxLineReady = 0;
+    bytGsmUartRxLineRsp = gsmrspNone;
+  }
+}
+
+// Response classifier
+// One hash over the token replaces a chain of memcmp() calls per state.
+// The case labels are generated from gsm_rsp_table (GSM.h), so two entries
+// sharing a hash value fail to compile (duplicate case value), i.e. the hash
+// is guaranteed to be perfect over the table.
+#define gsmRspHash(len, mid, last) ((((len) * 7) + ((mid) * 5) + (last)) & 31)
+#define gsm_rsp_token(name, token, mid, last) token,
+static const char * const pstrGsmRspToken[] = {"", gsm_rsp_table(gsm_rsp_token)};
+#undef gsm_rsp_token
+#define gsm_rsp_len(name, token, mid, last) sizeof(token) - 1,
+static const char bytGsmRspLen[] = {0, gsm_rsp_table(gsm_rsp_len)};
+#undef gsm_rsp_len
+
+char gsmRspClassify(char *line, unsigned int length) {
+  // Returns the response type (gsmrspXxx) of a line, gsmrspNone if unknown
+  unsigned int len;
+  char rsp;
+  len = strScanChar(line, length, ':'); // Token length
+  if ((len == 0) || (len > 15)) {
+    return gsmrspNone;
+  }
+  switch (gsmRspHash(len, line[len / 3], line[len - 1])) {
+    #define gsm_rsp_case(name, token, mid, last) \
+      case gsmRspHash(sizeof(token) - 1, mid, last): rsp = gsmrsp##name; break;
+    gsm_rsp_table(gsm_rsp_case)
+    #undef gsm_rsp_case
+    default: return gsmrspNone;
+  }
+  // Confirm the token (anything else can hash to the same value)
+  if ((len != bytGsmRspLen[rsp]) || (memcmp(line, pstrGsmRspToken[rsp], len) != 0)) {
+    return gsmrspNone;
+  }
+  return rsp;
+}
 
-static void gsmUartRxLineReceived() {
-  // New line received
-  *(pstrGsmUartRxBuff - 1) = 0;  // Mark end of line
-  bitGsmUartRxLineReady = 1; // Notify main thread that line is ready
+static void gsmUartRxLineReceived(unsigned int length) {
+  // New line received (the line ends at wrdGsmUartRxLinePos)
+  TGsmUartRxLine *line;
+  char *text;
+  text = strGsmUartRxBuff + wrdGsmUartRxLineStart;
+  if (bytGsmUartTxCmdEchoLen && (text[0] == strGsmUartTxCmdEcho[0])) {
+    // Echo ends with the command's Cr (followed by the Cr Lf of the response)
+    if (length && (text[length - 1] == 13)) {
+      length--;
+    }
+    if ((length == bytGsmUartTxCmdEchoLen) &&
+        (memcmp(text, strGsmUartTxCmdEcho, length) == 0)) {
+      // Echo of the last command, drop it
+      bytGsmUartTxCmdEchoLen = 0;
+      wrdGsmUartRxLinePos = wrdGsmUartRxLineStart;
+      return;
+    }
+    length = wrdGsmUartRxLinePos - wrdGsmUartRxLineStart;
+  }
+  line = &GsmUartRxLines[bytGsmUartRxLinesHead & cGsmUartRxLinesMask];
+  line->Offset = wrdGsmUartRxLineStart;
+  line->Length = length;
+  line->Rsp = gsmRspClassify(strGsmUartRxBuff + wrdGsmUartRxLineStart, length);
+  strGsmUartRxBuff[wrdGsmUartRxLineStart + length] = 0; // Mark end of line
+  bytGsmUartRxLinesHead++;
   bytGsmUartRxLinesReady++; // Increment number of lines ready
-  //pstrUartRxLine = pstrGsmUartRxBuff; // Mark start of line currently being received
+  wrdGsmUartRxLinePos = wrdGsmUartRxLineStart + length + 1;
+  wrdGsmUartRxLineStart = wrdGsmUartRxLinePos; // Start of the next line
+  if (pstrGsmUartRxRawHeader &&
+      (strncmp(strGsmUartRxBuff + line->Offset, pstrGsmUartRxRawHeader,
+               strlen(pstrGsmUartRxRawHeader)) == 0)) {
+    // A raw payload follows this line, leave it in the ring
+    bitGsmUartRxRawHalt = 1;
+  }
+  if (bytGsmUartRxLinesReady == 1) {
+    gsmUartRxLineFirst(); // Notify main thread that line is ready
+  }
+}
+
+static unsigned int gsmUartRxBuffLimit() {
+  // Returns the end of the space available to the line being received
+  unsigned int oldest;
+  if (bytGsmUartRxLinesReady) {
+    oldest = GsmUartRxLines[bytGsmUartRxLinesTail & cGsmUartRxLinesMask].Offset;
+    if (oldest >= wrdGsmUartRxLineStart) { // Line being received has wrapped
+      return oldest;
+    }
+  }
+  return sizeof(strGsmUartRxBuff);
+}
+
+static char gsmUartRxBuffWrap() {
+  // Moves the (partial) line being received to the start of strGsmUartRxBuff
+  // if there is more space there, returns 1 if successful
+  unsigned int len;
+  len = wrdGsmUartRxLinePos - wrdGsmUartRxLineStart;
+  if (wrdGsmUartRxLineStart == 0) {
+    return 0; // Already at the start
+  }
+  if (bytGsmUartRxLinesReady &&
+      (GsmUartRxLines[bytGsmUartRxLinesTail & cGsmUartRxLinesMask].Offset <= len + 1)) {
+    return 0; // Not enough space in front of the oldest line
+  }
+  memmove(strGsmUartRxBuff, strGsmUartRxBuff + wrdGsmUartRxLineStart, len);
+  wrdGsmUartRxLineStart = 0;
+  wrdGsmUartRxLinePos = len;
+  return 1;
+}
+
+#ifdef gsm_uart_hw_flow_ctl
+static void gsmUartRxRtsCheckFull(TGsmContext *pGsm, unsigned int head) {
+  // Deasserts RTS if the ring is filling up (producer side)
+  if ((head - wrdGsmUartRxRingTail) >= cGsmUartRxRtsOff) {
+    pGsm->Pins.RtsPort->BSRR = pGsm->Pins.RtsPin;
+    bitGsmUartRxRtsOff = 1;
+  }
+}
+
+static void gsmUartRxRtsCheckEmpty() {
+  // Asserts RTS again once the ring has been drained (consumer side)
+  if (bitGsmUartRxRtsOff) {
+    __disable_irq(); // Not to undo a deassert by the producer
+    if ((wrdGsmUartRxRingHead - wrdGsmUartRxRingTail) <= cGsmUartRxRtsOn) {
+      bitGsmUartRxRtsOff = 0;
+      pGsm->Pins.RtsPort->BRR = pGsm->Pins.RtsPin;
+    }
+    __enable_irq();
+  }
 }
+#endif
 
-static void gsmUartRx() {
-  // Read character from UART
-  charGsmUartRx = UART_Read();
-  //charGsmUartRx = RCREG1;
+static void gsmUartRx(TGsmContext *pGsm) {
+  // Read character from UART and add it to the ring buffer
+  // (producer side, may be called from an interrupt, see GSM_Ctx.h)
+  unsigned int head;
+  HAL_UART_Receive(pGsm->pUart, (uint8_t *)&charGsmUartRx, 1, TimeOut_RX);
   bytGsmUartRxQuietTimer = 0;
   bitGsmUartRxReset = 0; // Just in case this had been set in gsm1msPing();
-  if (pstrGsmUartRxBuff /*!=*/ < pstrGsmUartRxBuffCutoff) { // Check for buffer overrun
-    // Buffer is not yet full
-    // Check for new line
-    if ((charGsmUartRx == 10) && // If Cr received
-        (*(pstrGsmUartRxBuff - 1) == 13) /*&& // and previous character was Lf
-        (pstrGsmUartRxBuff != &strGsmUartRxBuff)*/) { // and not at the start of the buffer
-      // New line received
-      gsmUartRxLineReceived();
-    } else { // Otherwise add character to buffer
-      *pstrGsmUartRxBuff = charGsmUartRx;
-      pstrGsmUartRxBuff++;
-      if (pstrGsmUartRxBuff == pstrGsmUartRxBuffCutoff) { // If buffer is now full
-        gsmUartRxLineReceived(); // Process as if line was ready
-        #ifdef gsm_debug_state
-        bitGsmUartRxCharsLost = 1;
-        #endif
-      }
-    }
+  head = wrdGsmUartRxRingHead;
+  if ((head - wrdGsmUartRxRingTail) < cGsmUartRxRingSize) { // Check for ring overrun
+    strGsmUartRxRing[head & cGsmUartRxRingMask] = charGsmUartRx;
+    __DMB(); // Character must be stored before it is published
+    wrdGsmUartRxRingHead = head + 1;
+    #ifdef gsm_uart_hw_flow_ctl
+    gsmUartRxRtsCheckFull(pGsm, head + 1);
+    #endif
   } else {
-    // Buffer full, discard characters
-    if (!bitGsmUartRxLineReady) { // If buffer is full then
-      gsmUartRxLineReceived(); // process as if line was ready
-    }
+    // Ring full, discard character
     #ifdef gsm_debug_state
     bitGsmUartRxCharsLost = 1;
     #endif
   }
 }
 
-#ifdef gsm_async_uart_rx
-static void gsmUartRxSync() {
-  bitGsmUartRxSync = 1;
-  while (bitGsmUartRxSync);
+#ifdef gsm_dma_uart_rx
+DMA_HandleTypeDef hdmaGsmRx;
+
+void gsmUartRxDmaStart() {
+  // Starts circular DMA reception straight into the ring buffer
+  // (the ring must be empty, as the DMA starts again at its beginning)
+  wrdGsmUartRxRingHead = 0;
+  wrdGsmUartRxRingTail = 0;
+  bitGsmUartRxDmaRestart = 0;
+  HAL_UART_Receive_DMA(pGsm->pUart, (uint8_t *)strGsmUartRxRing, cGsmUartRxRingSize);
+  __HAL_UART_CLEAR_IDLEFLAG(pGsm->pUart);
+  __HAL_UART_ENABLE_IT(pGsm->pUart, UART_IT_IDLE);
+}
+
+void gsmUartRxPublish(UART_HandleTypeDef *uart) {
+  // Publishes the characters written to the ring buffer by the DMA since
+  // the last call (producer side)
+  // Called from the UART idle line interrupt and the DMA half / full
+  // transfer callbacks, so at most half of the ring is published at a time
+  TGsmContext *pGsm = gsmInstanceOfUart(uart); // (see GSM_Ctx.h)
+  unsigned int head;
+  unsigned int count;
+  if (!pGsm) {
+    return; // Not used by an instance
+  }
+  head = wrdGsmUartRxRingHead;
+  count = (cGsmUartRxRingSize - __HAL_DMA_GET_COUNTER(pGsm->pUart->hdmarx) - head) &
+          cGsmUartRxRingMask;
+  if (count) {
+    bytGsmUartRxQuietTimer = 0;
+    bitGsmUartRxReset = 0; // Just in case this had been set in gsm1msPing();
+    #ifdef gsm_debug_state
+    if ((head + count - wrdGsmUartRxRingTail) > cGsmUartRxRingSize) {
+      bitGsmUartRxCharsLost = 1; // DMA has overwritten unframed characters
+    }
+    #endif
+    wrdGsmUartRxRingHead = head + count;
+    #ifdef gsm_uart_hw_flow_ctl
+    gsmUartRxRtsCheckFull(pGsm, head + count);
+    #endif
+    #ifdef gsm_rtos
+    gsmRtosNotifyFromISR();
+    #endif
+  }
+}
+
+void gsmUartRxDmaError(UART_HandleTypeDef *uart) {
+  // Called from HAL_UART_ErrorCallback()
+  // (the HAL stops DMA reception on an overrun error)
+  TGsmContext *pGsm = gsmInstanceOfUart(uart); // (see GSM_Ctx.h)
+  if (!pGsm) {
+    return; // Not used by an instance
+  }
+  if (pGsm->pUart->RxState == HAL_UART_STATE_READY) {
+    bitGsmUartRxDmaRestart = 1; // Restarted from gsmPoll()
+    #ifdef gsm_rtos
+    gsmRtosNotifyFromISR();
+    #endif
+  }
 }
 #endif
 
+static void gsmUartRxRaw() {
+  // Hands characters from the ring buffer straight to the raw consumer /
+  // buffer (consumer side), in as few contiguous blocks as possible
+  unsigned int head;
+  unsigned int tail;
+  unsigned int offset;
+  unsigned int count;
+  tail = wrdGsmUartRxRingTail;
+  head = wrdGsmUartRxRingHead;
+  while (wrdGsmUartRxRawLeft && (tail != head)) {
+    offset = tail & cGsmUartRxRingMask;
+    count = head - tail;
+    if (count > cGsmUartRxRingSize - offset) { // Stop at the end of the ring
+      count = cGsmUartRxRingSize - offset;
+    }
+    if (count > wrdGsmUartRxRawLeft) {
+      count = wrdGsmUartRxRawLeft;
+    }
+    if (p_gsmUartRxRawConsumer) {
+      p_gsmUartRxRawConsumer(strGsmUartRxRing + offset, count);
+    } else {
+      memcpy(pstrGsmUartRxRawDest, strGsmUartRxRing + offset, count);
+      pstrGsmUartRxRawDest += count;
+    }
+    tail += count;
+    wrdGsmUartRxRawLeft -= count;
+    head = wrdGsmUartRxRingHead;
+  }
+  __DMB(); // Characters must be read before their space is released
+  wrdGsmUartRxRingTail = tail;
+}
+
+static void gsmUartRxFrame() {
+  // Moves characters from the ring buffer into strGsmUartRxBuff
+  // (consumer side), queueing a line descriptor for each completed line.
+  // Characters are moved in blocks, up to the next Lf (found with
+  // strScanChar()) or the end of the ring.
+  // Framing stops while the descriptor queue (or strGsmUartRxBuff) is full,
+  // or after a raw payload header, leaving the remaining characters in the ring.
+  unsigned int head;
+  unsigned int tail;
+  unsigned int offset;
+  unsigned int count;
+  unsigned int copy;
+  unsigned int limit;
+  char eol;
+  if (wrdGsmUartRxRawLeft) {
+    gsmUartRxRaw(); // Raw payload comes first
+    if (wrdGsmUartRxRawLeft) {
+      return;
+    }
+  }
+  tail = wrdGsmUartRxRingTail;
+  limit = gsmUartRxBuffLimit();
+  while ((bytGsmUartRxLinesReady < cGsmUartRxLinesMax) && !bitGsmUartRxRawHalt) {
+    head = wrdGsmUartRxRingHead;
+    if (tail == head) {
+      break; // Nothing left to frame
+    }
+    offset = tail & cGsmUartRxRingMask;
+    count = head - tail;
+    if (count > cGsmUartRxRingSize - offset) { // Stop at the end of the ring
+      count = cGsmUartRxRingSize - offset;
+    }
+    // Check for new line
+    copy = strScanChar(strGsmUartRxRing + offset, count, 10);
+    eol = 0;
+    if (copy < count) { // If Lf received
+      if (copy ? (strGsmUartRxRing[offset + copy - 1] == 13) :
+                 ((wrdGsmUartRxLinePos != wrdGsmUartRxLineStart) &&
+                  (strGsmUartRxBuff[wrdGsmUartRxLinePos - 1] == 13))) {
+        eol = 1; // and previous character was Cr
+      } else {
+        copy++; // Otherwise the Lf is part of the line
+      }
+    }
+    // Add characters to buffer (leaving space for the null terminator)
+    if ((wrdGsmUartRxLinePos + copy >= limit) && gsmUartRxBuffWrap()) {
+      limit = gsmUartRxBuffLimit();
+    }
+    if (wrdGsmUartRxLinePos + copy >= limit) { // Not enough space
+      copy = limit - wrdGsmUartRxLinePos - 1; // Add as much as possible
+      memcpy(strGsmUartRxBuff + wrdGsmUartRxLinePos, strGsmUartRxRing + offset, copy);
+      wrdGsmUartRxLinePos += copy;
+      tail += copy;
+      if (bytGsmUartRxLinesReady) { // Buffer is full of lines ready
+        break; // Leave the rest in the ring until a line is released
+      }
+      // Line is too long for the buffer, process as if line was ready
+      gsmUartRxLineReceived(wrdGsmUartRxLinePos - wrdGsmUartRxLineStart);
+      limit = gsmUartRxBuffLimit();
+      #ifdef gsm_debug_state
+      bitGsmUartRxCharsLost = 1;
+      #endif
+      continue;
+    }
+    memcpy(strGsmUartRxBuff + wrdGsmUartRxLinePos, strGsmUartRxRing + offset, copy);
+    wrdGsmUartRxLinePos += copy;
+    tail += copy;
+    if (eol) {
+      // New line received
+      tail++; // Skip the Lf
+      wrdGsmUartRxLinePos--; // Drop the Cr
+      gsmUartRxLineReceived(wrdGsmUartRxLinePos - wrdGsmUartRxLineStart);
+      limit = gsmUartRxBuffLimit();
+    }
+  }
+  __DMB(); // Characters must be read before their space is released
+  wrdGsmUartRxRingTail = tail;
+}
+
+char *gsmUartRxLinePeek(char index, unsigned int *length) {
+  // Returns line number "index" of the lines ready (0 being the oldest)
+  // without consuming it, or 0 if there is no such line
+  TGsmUartRxLine *line;
+  if (index >= bytGsmUartRxLinesReady) {
+    return 0;
+  }
+  line = &GsmUartRxLines[(char)(bytGsmUartRxLinesTail + index) & cGsmUartRxLinesMask];
+  if (length) {
+    *length = line->Length;
+  }
+  return (char *)strGsmUartRxBuff + line->Offset;
+}
+
+void gsmUartRxRawExpect(char *header) {
+  // Arms raw reception: framing halts after the next line starting with
+  // "header", until the payload length is known and gsmUartRxRawStart()
+  // is called (0 disarms)
+  pstrGsmUartRxRawHeader = header;
+  bitGsmUartRxRawHalt = 0;
+}
+
+void gsmUartRxRawStart(unsigned int length, char *dest,
+                       void (*consumer)(char *data, unsigned int length)) {
+  // Hands exactly "length" characters to "consumer" (in blocks, straight
+  // from the ring buffer) or, if there is no consumer, copies them to "dest",
+  // then returns to line mode
+  pstrGsmUartRxRawDest = dest;
+  p_gsmUartRxRawConsumer = consumer;
+  wrdGsmUartRxRawLeft = length;
+  pstrGsmUartRxRawHeader = 0;
+  bitGsmUartRxRawHalt = 0;
+  gsmUartRxRaw(); // Hand over what has already been received
+}
+
+unsigned int gsmUartRxRawPending() {
+  // Returns the number of raw characters still to be received
+  return wrdGsmUartRxRawLeft;
+}
+
+static void gsmUartRxLineGap() {
+  // Called once nothing has been received for gsm_uart_rx_line_gap ms
+  // Discards the line being received (if any), completed lines are kept
+  // until they are released
+  if (wrdGsmUartRxRingTail != wrdGsmUartRxRingHead) {
+    return; // Framing has stalled, the partial line may still be completed
+  }
+  bitGsmUartRxReset = 0;
+  wrdGsmUartRxRawLeft = 0; // Abandon a raw payload which was cut short
+  if (wrdGsmUartRxLinePos != wrdGsmUartRxLineStart) {
+    #ifdef gsm_debug_state
+    bitGsmUartRxLineDiscarded = 1;
+    #endif
+    wrdGsmUartRxLinePos = wrdGsmUartRxLineStart; // "Clear the line"
+    if (bytGsmUartRxLinesReady == 0) {
+      wrdGsmUartRxLineStart = 0; // Start again at the beginning
+      wrdGsmUartRxLinePos = 0;
+    }
+  }
+}
+
 void gsmUartRxLineClear() {
   /*
   //pstrGsmUartRxBuff = pstrUartRxLine; // Clear the line currently being received
-  #ifdef gsm_async_uart_rx
-  gsmUartRxSync();
-  #endif
   while ((*(pstrGsmUartRxBuff - 1) != 0) && (pstrGsmUartRxBuff > &strGsmUartRxBuff)) {
     pstrGsmUartRxBuff--;
   }
@@ -347,24 +1337,23 @@ void gsmUartRxLineClear() {
 }
 
 void gsmUartRxBuffClear() {
-  #ifdef gsm_async_uart_rx
-  gsmUartRxSync();
-  #endif
   #ifdef gsm_debug_state
-  if (pstrGsmUartRxBuff != &strGsmUartRxBuff) {
-    #ifdef gsm_async_uart_rx
+  if (bytGsmUartRxLinesReady || (wrdGsmUartRxLinePos != wrdGsmUartRxLineStart) ||
+      (wrdGsmUartRxRingTail != wrdGsmUartRxRingHead)) {
+    #if defined(gsm_async_uart_rx) || defined(gsm_dma_uart_rx) || defined(gsm_poll_budget)
     bitGsmUartRxBuffCleared = 1;
     #else
     strcpy(gsmDebugStateStrPtr, "UART Rx Buff Cleared. Contents:\r\n");
     gsmDebugStateStrReady();
+    gsmUartRxFrame();
     while (bitGsmUartRxLineReady) {
-      strncpyExNewLine(gsmDebugStateStrPtr, strGsmUartRxBuff, 64);
+      strncpyExNewLine(gsmDebugStateStrPtr, pstrGsmUartRxLine, 64);
       gsmDebugStateStrReady();
       gsmUartRxLineProcessed();
     }
-    if (pstrGsmUartRxBuff != strGsmUartRxBuff) {
-      *pstrGsmUartRxBuff = 0;
-      strncpyExNewLine(gsmDebugStateStrPtr, strGsmUartRxBuff, 64);
+    if (wrdGsmUartRxLinePos != wrdGsmUartRxLineStart) {
+      strGsmUartRxBuff[wrdGsmUartRxLinePos] = 0;
+      strncpyExNewLine(gsmDebugStateStrPtr, strGsmUartRxBuff + wrdGsmUartRxLineStart, 64);
       gsmDebugStateStrReady();
     }
     strcpy(gsmDebugStateStrPtr, "(End Contents)\r\n");
@@ -372,48 +1361,34 @@ void gsmUartRxBuffClear() {
     #endif
   }
   #endif
+  bytGsmUartRxLinesTail = bytGsmUartRxLinesHead;
   bytGsmUartRxLinesReady = 0;
   bitGsmUartRxLineReady = 0;
-  pstrGsmUartRxBuff = &strGsmUartRxBuff[0]; // Reset to the start of the buffer
-  //pstrUartRxLine = &strGsmUartRxBuff;
-  //strcpy(gsmDebugStateStrPtr, "UART Rx Buff Cleared.\r\n");
-  //gsmUartRxEcho(gsmDebugStateStrPtr);
+  wrdGsmUartRxLineStart = 0; // Reset to the start of the buffer
+  wrdGsmUartRxLinePos = 0;
+  wrdGsmUartRxRawLeft = 0; // Abandon raw reception
+  pstrGsmUartRxRawHeader = 0;
+  bitGsmUartRxRawHalt = 0;
+  wrdGsmUartRxRingTail = wrdGsmUartRxRingHead; // Discard unframed characters
 }
 
 void gsmUartRxLineProcessed() {
-  char bLineLen = 0;
-  char *psRdPos;
-  char *psWrPos;
-  #ifdef gsm_async_uart_rx
-  gsmUartRxSync();
-  #endif
+  // Releases the first line ready
+  if (!bytGsmUartRxLinesReady) {
+    return;
+  }
   #ifdef gsm_echo_int_rx
-  //strcpy(gsmDebugStateStrPtr, "UART Rx Line Processed:\r\n");
-  //gsmUartRxEcho(gsmDebugStateStrPtr);
-  gsmUartRxEcho(&strGsmUartRxBuff);
+  gsmUartRxEcho(pstrGsmUartRxLine);
   #endif
-  /*#ifdef gsm_debug_state
-  strcpy(gsmDebugStateStrPtr, "Shifting UART Rx Buffer\r\n");
-  gsmDebugStateStrReady();
-  #endif*/
-  psRdPos = (char *)strGsmUartRxBuff;
-  psWrPos = (char *)strGsmUartRxBuff;
-  // Find the end of the current line
-  while ((*psRdPos != 0) && (psRdPos < pstrGsmUartRxBuff)) {
-    psRdPos++;
-  }
-  psRdPos++; // Start of next line
-  bLineLen = psRdPos - psWrPos;
-  // Shift buffer
-  while (psRdPos < pstrGsmUartRxBuff) {
-    *psWrPos = *psRdPos;
-    psRdPos++;
-    psWrPos++;
-  }
-  pstrGsmUartRxBuff -= bLineLen;
-  //pstrUartRxLine -= bLineLen;
+  bytGsmUartRxLinesTail++;
   bytGsmUartRxLinesReady--;
-  if (bytGsmUartRxLinesReady == 0) {bitGsmUartRxLineReady = 0;}
+  if ((bytGsmUartRxLinesReady == 0) &&
+      (wrdGsmUartRxLinePos == wrdGsmUartRxLineStart)) {
+    // Nothing left in the buffer, start again at the beginning
+    wrdGsmUartRxLineStart = 0;
+    wrdGsmUartRxLinePos = 0;
+  }
+  gsmUartRxLineFirst();
 }
 
 // ---------- END UART Rx ----------
@@ -422,170 +1397,13 @@ void gsmUartRxLineProcessed() {
 extern void gsmEvent(char GsmEventType);
 char* pstrGsmEventOriginatorID;
 char* pstrGsmEventData;
+unsigned int wrdGsmEventDataLen; // Length of pstrGsmEventData (where applicable)
 TDateTime dtmGsmEvent;
 //</Events>
 
 // -- Constants --
 
-#ifdef __GNUC__
-// Events
-const char gsmevntDateTimeRead = 150;
-const char gsmevntDateTimeWrite = 151;
-const char gsmevntSignalQualityRead = 152;
-const char gsmevntIMEI_Read = 20;
-const char gsmevntPIN_Request = 30;
-const char gsmevntPIN_Fail = 31;
-const char gsmevntMissedCall = 70;
-const char gsmevntMsgRcvd = 80;
-const char gsmevntMsgDrafted = 81; // Message written to SIM card
-const char gsmevntMsgDiscarded = 82; // Gave up on trying to write msg to SIM card
-                                    // (SIM card memory full?)
-const char gsmevntMsgSent = 83;
-const char gsmevntMsgSendFailed = 84; // Gave up on trying to send message
-                                      // (no airtime?)
-const char gsmevntGprsFailed = 110;
-const char gsmevntGprsHttpResultErr = 111;
-const char gsmevntGprsHttpResponseLine = 112;
-// GSM State Machine States
-// Note: In order not to overrun the output buffer
-//       (when gsm_debug_state is defined)
-//       state names should not be longer than 26 characters
-//       i.e. last char here -----> x
-// General-Purpose
-const char gsmstDelay = 1;
-const char gsmstWaitingOK = 2;
-const char gsmstCmdOK = 3;
-const char gsmstDie = 9;
-// Diversions
-const char gsmstGetDateTimePre = 150;
-const char gsmstGetDateTimeQuery = 151;
-const char gsmstGetDateTimeResponse = 152;
-const char gsmstSetDateTimePre = 160;
-const char gsmstSetDateTime = 161;
-// Power
-const char gsmstPwrGsmOffPre = 10;
-const char gsmstPwrGsmOff = 11;
-const char gsmstPwringGsmOff = 12;
-const char gsmstPwrGsmOn = 13;
-const char gsmstPwringGsmOn = 14;
-// Info
-const char gsmstIMEIPre = 20;
-const char gsmstIMEIQuery = 21;
-const char gsmstIMEIResponse = 22;
-// Pin
-const char gsmstPinChkPre = 30;
-const char gsmstPinChkQuery = 31;
-const char gsmstPinChkResponse = 32;
-const char gsmstPinPre = 33;
-const char gsmstPinCmd = 34;
-const char gsmstPinResponse = 35;
-// Module Setup
-const char gsmstSetup_MSHI = 40;
-const char gsmstSetup_MSHO = 41;
-const char gsmstEnableCLIP = 42;
-const char gsmstSetMsgFrmtToTxt = 43;
-const char gsmstSetMsgAlertOnPre = 44;
-const char gsmstSetMsgAlertOn = 45;
-// Network Registration
-const char gsmstWaitRegPre = 50;
-const char gsmstWaitRegQuery = 51;
-const char gsmstWaitRegResponse = 52;
-// Standby
-const char gsmstStandbyPre = 60;
-const char gsmstStandby = 61;
-// Call
-const char gsmstWaitingCLIP = 70;
-const char gsmstWaitingNO_CARRIER = 71;
-// Text Message - States 80-109
-const gsmstMsgHook = 109;
-// GPRS - States 110-139
-const char gsmstGPRS_Hook = 110;
-// Module Specific - States 200+
-
-
-#ifdef gsm_debug_state                
-const char cstr_gsmstDelay[] = "gsmstDelay";
-const char cstr_gsmstWaitingOK[] = "gsmstWaitingOK";
-const char cstr_gsmstCmdOK[] = "gsmstCmdOK";
-const char cstr_gsmstDie[] = "gsmstDie";
-const char cstr_gsmstGetDateTimePre[] = "gsmstGetDateTimePre";
-const char cstr_gsmstGetDateTimeQuery[] = "gsmstGetDateTimeQuery";
-const char cstr_gsmstGetDateTimeResponse[] = "gsmstGetDateTimeResponse";
-const char cstr_gsmstSetDateTimePre[] = "gsmstSetDateTimePre";
-const char cstr_gsmstSetDateTime[] = "gsmstSetDateTime";
-const char cstr_gsmstPwrGsmOffPre[] = "gsmstPwrGsmOffPre";
-const char cstr_gsmstPwrGsmOff[] = "gsmstPwrGsmOff";
-const char cstr_gsmstPwringGsmOff[] = "gsmstPwringGsmOff";
-const char cstr_gsmstPwrGsmOn[] = "gsmstPwrGsmOn";
-const char cstr_gsmstPwringGsmOn[] = "gsmstPwringGsmOn";
-const char cstr_gsmstIMEIPre[] = "gsmstIMEIPre";
-const char cstr_gsmstIMEIQuery[] = "gsmstIMEIQuery";
-const char cstr_gsmstIMEIResponse[] = "gsmstIMEIResponse";
-const char cstr_gsmstPinChkPre[] = "gsmstPinChkPre";
-const char cstr_gsmstPinChkQuery[] = "gsmstPinChkQuery";
-const char cstr_gsmstPinChkResponse[] = "gsmstPinChkResponse";
-const char cstr_gsmstPinPre[] = "gsmstPinPre";
-const char cstr_gsmstPinCmd[] = "gsmstPinCmd";
-const char cstr_gsmstPinResponse[] = "gsmstPinResponse";
-const char cstr_gsmstSetup_MSHI[] = "gsmstSetup_MSHI";
-const char cstr_gsmstSetup_MSHO[] = "gsmstSetup_MSHO";
-const char cstr_gsmstEnableCLIP[] = "gsmstEnableCLIP";
-const char cstr_gsmstSetMsgFrmtToTxt[] = "gsmstSetMsgFrmtToTxt";
-const char cstr_gsmstSetMsgAlertOn[] = "gsmstSetMsgAlertOn";
-const char cstr_gsmstSetMsgAlertOnPre[] = "gsmstSetMsgAlertOnPre";
-const char cstr_gsmstWaitRegPre[] = "gsmstWaitRegPre";
-const char cstr_gsmstWaitRegQuery[] = "gsmstWaitRegQuery";
-const char cstr_gsmstWaitRegResponse[] = "gsmstWaitRegResponse";
-const char cstr_gsmstStandbyPre[] = "gsmstStandbyPre";
-const char cstr_gsmstStandby[] = "gsmstStandby";
-const char cstr_gsmstWaitingCLIP[] = "gsmstWaitingCLIP";
-const char cstr_gsmstWaitingNO_CARRIER[] = "gsmstWaitingNO_CARRIER";
-const char cstr_gsmstMsgHook[] = "gsmstMsgHook";
-const char cstr_gsmstGPRS_Hook[] = "gsmstGPRS_Hook";
-#endif
-
-#else /*__GNUC__*/
-#ifdef gsm_debug_state                
-#define cstr_gsmstDelay[]                       "gsmstDelay"
-#define cstr_gsmstWaitingOK[]                   "gsmstWaitingOK"
-#define cstr_gsmstCmdOK[]                       "gsmstCmdOK"
-#define cstr_gsmstDie[]                         "gsmstDie"
-#define cstr_gsmstGetDateTimePre[]              "gsmstGetDateTimePre"
-#define cstr_gsmstGetDateTimeQuery[]            "gsmstGetDateTimeQuery"
-#define cstr_gsmstGetDateTimeResponse[]         "gsmstGetDateTimeResponse"
-#define cstr_gsmstSetDateTimePre[]              "gsmstSetDateTimePre"
-#define cstr_gsmstSetDateTime[]                 "gsmstSetDateTime"
-#define cstr_gsmstPwrGsmOffPre[]                "gsmstPwrGsmOffPre"
-#define cstr_gsmstPwrGsmOff[]                   "gsmstPwrGsmOff"
-#define cstr_gsmstPwringGsmOff[]                "gsmstPwringGsmOff"
-#define cstr_gsmstPwrGsmOn[]                    "gsmstPwrGsmOn"
-#define cstr_gsmstPwringGsmOn[]                 "gsmstPwringGsmOn"
-#define cstr_gsmstIMEIPre[]                     "gsmstIMEIPre"
-#define cstr_gsmstIMEIQuery[]                   "gsmstIMEIQuery"
-#define cstr_gsmstIMEIResponse[]                "gsmstIMEIResponse"
-#define cstr_gsmstPinChkPre[]                   "gsmstPinChkPre"
-#define cstr_gsmstPinChkQuery[]                 "gsmstPinChkQuery"
-#define cstr_gsmstPinChkResponse[]              "gsmstPinChkResponse"
-#define cstr_gsmstPinPre[]                      "gsmstPinPre"
-#define cstr_gsmstPinCmd[]                      "gsmstPinCmd"
-#define cstr_gsmstPinResponse[]                 "gsmstPinResponse"
-#define cstr_gsmstSetup_MSHI[]                  "gsmstSetup_MSHI"
-#define cstr_gsmstSetup_MSHO[]                  "gsmstSetup_MSHO"
-#define cstr_gsmstEnableCLIP[]                  "gsmstEnableCLIP"
-#define cstr_gsmstSetMsgFrmtToTxt[]             "gsmstSetMsgFrmtToTxt"
-#define cstr_gsmstSetMsgAlertOn[]               "gsmstSetMsgAlertOn"
-#define cstr_gsmstSetMsgAlertOnPre[]            "gsmstSetMsgAlertOnPre"
-#define cstr_gsmstWaitRegPre[]                  "gsmstWaitRegPre"
-#define cstr_gsmstWaitRegQuery[]                "gsmstWaitRegQuery"
-#define cstr_gsmstWaitRegResponse[]             "gsmstWaitRegResponse"
-#define cstr_gsmstStandbyPre[]                  "gsmstStandbyPre"
-#define cstr_gsmstStandby[]                     "gsmstStandby"
-#define cstr_gsmstWaitingCLIP[]                 "gsmstWaitingCLIP"
-#define cstr_gsmstWaitingNO_CARRIER[]           "gsmstWaitingNO_CARRIER"
-#define cstr_gsmstMsgHook[]                     "gsmstMsgHook"
-#define cstr_gsmstGPRS_Hook[]                   "gsmstGPRS_Hook"
-#endif
-#endif /*__GNUC__*/ 
+// (Event and state numbers: gsm_event_table / gsm_state_table, GSM.h)
 
 #ifdef gsm_debug_state
 static void gsm_strcatState(char *to, char state) {
@@ -602,44 +1420,10 @@ static void gsm_strcatState(char *to, char state) {
   }
   if (!handled) {
     switch (state) {
-      case gsmstDelay: strcat(to, RomTxt30(&cstr_gsmstDelay)); break;
-      case gsmstWaitingOK: strcat(to, RomTxt30(&cstr_gsmstWaitingOK)); break;
-      case gsmstCmdOK: strcat(to, RomTxt30(&cstr_gsmstCmdOK)); break;
-      case gsmstDie: strcat(to, RomTxt30(&cstr_gsmstDie)); break;
-      case gsmstGetDateTimePre: strcat(to, RomTxt30(&cstr_gsmstGetDateTimePre)); break;
-      case gsmstGetDateTimeQuery: strcat(to, RomTxt30(&cstr_gsmstGetDateTimeQuery)); break;
-      case gsmstGetDateTimeResponse: strcat(to, RomTxt30(&cstr_gsmstGetDateTimeResponse)); break;
-      case gsmstSetDateTimePre: strcat(to, RomTxt30(&cstr_gsmstSetDateTimePre)); break;
-      case gsmstSetDateTime: strcat(to, RomTxt30(&cstr_gsmstSetDateTime)); break;
-      case gsmstPwrGsmOffPre: strcat(to, RomTxt30(&cstr_gsmstPwrGsmOffPre)); break;
-      case gsmstPwrGsmOff: strcat(to, RomTxt30(&cstr_gsmstPwrGsmOff)); break;
-      case gsmstPwringGsmOff: strcat(to, RomTxt30(&cstr_gsmstPwringGsmOff)); break;
-      case gsmstPwrGsmOn: strcat(to, RomTxt30(&cstr_gsmstPwrGsmOn)); break;
-      case gsmstPwringGsmOn: strcat(to, RomTxt30(&cstr_gsmstPwringGsmOn)); break;
-      case gsmstIMEIPre: strcat(to, RomTxt30(&cstr_gsmstIMEIPre)); break;
-      case gsmstIMEIQuery: strcat(to, RomTxt30(&cstr_gsmstIMEIQuery)); break;
-      case gsmstIMEIResponse: strcat(to, RomTxt30(&cstr_gsmstIMEIResponse)); break;
-      case gsmstPinChkPre: strcat(to, RomTxt30(&cstr_gsmstPinChkPre)); break;
-      case gsmstPinChkQuery: strcat(to, RomTxt30(&cstr_gsmstPinChkQuery)); break;
-      case gsmstPinChkResponse: strcat(to, RomTxt30(&cstr_gsmstPinChkResponse)); break;
-      case gsmstPinPre: strcat(to, RomTxt30(&cstr_gsmstPinPre)); break;
-      case gsmstPinCmd: strcat(to, RomTxt30(&cstr_gsmstPinCmd)); break;
-      case gsmstPinResponse: strcat(to, RomTxt30(&cstr_gsmstPinResponse)); break;
-      case gsmstSetup_MSHI: strcat(to, RomTxt30(&cstr_gsmstSetup_MSHI)); break;
-      case gsmstSetup_MSHO: strcat(to, RomTxt30(&cstr_gsmstSetup_MSHO)); break;
-      case gsmstEnableCLIP: strcat(to, RomTxt30(&cstr_gsmstEnableCLIP)); break;
-      case gsmstSetMsgFrmtToTxt: strcat(to, RomTxt30(&cstr_gsmstSetMsgFrmtToTxt)); break;
-      case gsmstSetMsgAlertOn: strcat(to, RomTxt30(&cstr_gsmstSetMsgAlertOn)); break;
-      case gsmstSetMsgAlertOnPre: strcat(to, RomTxt30(&cstr_gsmstSetMsgAlertOnPre)); break;
-      case gsmstWaitRegPre: strcat(to, RomTxt30(&cstr_gsmstWaitRegPre)); break;
-      case gsmstWaitRegQuery: strcat(to, RomTxt30(&cstr_gsmstWaitRegQuery)); break;
-      case gsmstWaitRegResponse: strcat(to, RomTxt30(&cstr_gsmstWaitRegResponse)); break;
-      case gsmstStandbyPre: strcat(to, RomTxt30(&cstr_gsmstStandbyPre)); break;
-      case gsmstStandby: strcat(to, RomTxt30(&cstr_gsmstStandby)); break;
-      case gsmstWaitingCLIP: strcat(to, RomTxt30(&cstr_gsmstWaitingCLIP)); break;
-      case gsmstWaitingNO_CARRIER: strcat(to, RomTxt30(&cstr_gsmstWaitingNO_CARRIER)); break;
-      case gsmstMsgHook: strcat(to, RomTxt30(&cstr_gsmstMsgHook)); break;
-      case gsmstGPRS_Hook: strcat(to, RomTxt30(&cstr_gsmstGPRS_Hook)); break;
+      #define gsm_state_case(name, id) \
+        case gsmst##name: strcat(to, RomTxt30("gsmst" #name)); break;
+      gsm_state_table(gsm_state_case)
+      #undef gsm_state_case
       default:
         strcat(to, "[not found]"); break;
     }
@@ -648,13 +1432,6 @@ static void gsm_strcatState(char *to, char state) {
 #endif
 
 // -- Variables --
-// General-Purpose
-unsigned int wrdGsmGPTmr = 0; // General-purpose timer (integer)
-unsigned long dwdGsmGPTmr = 0; // General-purpose timer (long)
-char bytGsmGPCtr = 0; // General-purpose counter
-bit bitGsmGPFlag; // General-purpose flag   
-char strGsmGP[22]; // General-purpose string
-char* pstrGsmGP;
 // UART Communication Strings
 char strNewLine[] = "\r\n"; //{13, 10, 0};
 char strAT[] = "AT";
@@ -670,87 +1447,326 @@ char strCLIP[] = "+CLIP";
 char strNOCARRIER[] = "NO CARRIER";
 char strCMTI[] = "+CMTI";
 char strCSQ[] = "+CSQ";
-// State Machine
-char bytGsmState;   
-// State Machine Module Specific
-#ifdef gsm_debug_state
-char (*p_gsm_MS_strcatState)(char *to, char state) = 0;
-#endif
-char (*p_gsm_MS_ProcessState)(char dummy) = 0;
-// State Machine Delay
-char bytGsmStateAfterDelay;
-unsigned int wrdGsmDelayTime;
-unsigned int wrdGsmDelayTmr = 0;
-// State Machine Timeout
-char bytGsmStateAfterTimeout = 0;
-unsigned int wrdGsmTimeoutTime;
-unsigned int wrdGsmTimeoutTmr = 0;
-// State Machine Divert
-char bytGsmStateAfterDivert = 0;
-// State Machine Clock
-bit bitGsmDateTimeReadPending;
-bit bitGsmDateTimeWritePending;
-// State Machine SMS
-#ifdef gsm_debug_state
-char (*p_gsm_Msg_strcatState)(char *to, char state) = 0;
-#endif
-char (*p_gsm_Msg_ProcessState)(char dummy) = 0;
-char *pstrGsmMsgSendTxt;
-char *pstrGsmMsgSendNum;
-bit bitGsmMsgDelPending;
-bit bitGsmMsgWritePending;
-bit bitGsmMsgReadPending;
-bit bitGsmMsgSendPending;
-//unsigned int wrdGsmMsgWriteTmr;
-bit bitGsmMsgJustArrived;
-// State Machine GPRS
-#ifdef gsm_debug_state
-char (*p_gsm_GPRS_strcatState)(char *to, char state) = 0;
-#endif
-char (*p_gsm_GPRS_ProcessState)(char dummy) = 0;
-bit bitGsmGprsPending;
-bit bitGsmGprsInProgress;
-char *pstrGsmGprsURL;
-char *pstrGsmGprsData;
-unsigned int wrdGsmGprsDataSize;
-bit bitGsmGprsHttpKeepAlive;
-bit bitGsmGprsRestartFlag; // Informs the GPRS module that the system has restarted
-// State Machine Other
-bit bitExpectGSM_On;
-bit bitGSM_PowerOff; // Instructs the library to power the GSM module off
-char bytGsmStateAfterOK = 0;
-char bytGsmCmdOKCtr = 0;
-char bytGsmStateAfterReg = 0;
-char *pstrGsmCommand;
-char bytGsmStateAfterCmdFail = 0;
-char strGsmOrigOrDestID[15];
-char bytGSM_StatTmr = 0; //GSM_Stat can sometimes dip off very briefly
-                         //This is used to avoid "false" off readings
-// Misc
-bit bitGSM_Stat_On_State; // Determines what state of GSM_Stat is considered "on"
-bit bitGSM_Ready; // Indicates if the module is registered on the network
 
-static char gsmCheckStateDivert() {
-  if (bitGSM_PowerOff) {
-    return gsmstPwrGsmOffPre;
-  } if (bitGsmDateTimeReadPending) {
-    //bitGsmDateTimeReadPending = 0; // Now only done once successful
-    return gsmstGetDateTimePre;
-  } else if (bitGsmDateTimeWritePending) {
-    return gsmstSetDateTimePre;
+static void gsmRequestRemove(char index) {
+  bytGsmRequestCount--;
+  for (; index < bytGsmRequestCount; index++) {
+    GsmRequests[index] = GsmRequests[index + 1];
+  }
+}
+
+static void gsmRequestResultSet(TGsmResult *result, TGsmRequest *req,
+                                char status) {
+  result->Ctx = pGsm;
+  result->Handle = req->Handle;
+  result->Kind = req->Kind;
+  result->Status = status;
+  result->User = req->User;
+  memset(&result->Data, 0, sizeof(result->Data));
+  if (req->Kind == gsmreqMsgSend) {
+    result->Data.Msg.Message = req->Text;
+    result->Data.Msg.DestinationID = req->Dest;
+  } else if (req->Kind == gsmreqGprs) {
+    result->Data.Gprs.URL = req->Text;
+    result->Data.Gprs.PostData = req->Dest;
   } else {
-    return 0;
+    result->Data.DateTime = dtmGsmEvent;
   }
 }
 
-void gsmSetStateNext(char stateNext, char allowDivert) {
-  /*if (stateNext == bytGsmStateAfterDivert) {
-    // Returning from divert
-    bytGsmStateAfterDivert = 0;
-  }*/
-  if (/*(bytGsmStateAfterDivert == 0) &&*/ (allowDivert)) {
-    bytGsmStateAfterDivert = stateNext;
-    stateNext = gsmCheckStateDivert();
+static void gsmRequestFinish(char index, char status) {
+  // Removes a qued request, passing its result to its callback (if any)
+  TGsmRequest req;
+  TGsmResult result;
+  req = GsmRequests[index];
+  gsmRequestRemove(index);
+  if (req.Done) {
+    gsmRequestResultSet(&result, &req, status);
+    req.Done(&result);
+  }
+}
+
+static void gsmRequestsFinish(char kind, char status) {
+  // Removes all the requests of this kind qued (not any qued by the callbacks)
+  char i = 0;
+  char count = bytGsmRequestCount;
+  while ((i < count) && (i < bytGsmRequestCount)) {
+    if (GsmRequests[i].Kind == kind) {
+      gsmRequestFinish(i, status);
+      count--;
+    } else {
+      i++;
+    }
+  }
+}
+
+static void gsmRequestRequeue(char index) {
+  // Moves a qued request behind the others (to be run again later)
+  TGsmRequest req;
+  req = GsmRequests[index];
+  gsmRequestRemove(index);
+  GsmRequests[bytGsmRequestCount++] = req;
+}
+
+static char gsmRequestFind(char kind) {
+  // Returns the index + 1 of the first request of this kind qued, 0 if none
+  char i;
+  for (i = 0; i < bytGsmRequestCount; i++) {
+    if (GsmRequests[i].Kind == kind) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static char gsmRequestBefore(TGsmRequest *a, TGsmRequest *b) {
+  // Indicates if request a should be run before request b
+  // (more urgent, then the earlier deadline, otherwise in the order qued)
+  if (a->Priority != b->Priority) {
+    return (a->Priority < b->Priority);
+  }
+  if (!a->Deadline) {
+    return 0;
+  }
+  if (!b->Deadline) {
+    return 1;
+  }
+  return ((long)(a->Deadline - b->Deadline) < 0);
+}
+
+static char gsmRequestExpired(TGsmRequest *req) {
+  // Indicates if a request has passed its deadline
+  return (req->Deadline && ((long)(dwdGsmMsTmr - req->Deadline) >= 0));
+}
+
+static void gsmRequestsExpire() {
+  // Drops the requests which have passed their deadline (from gsmPollStep()
+  // only, so that the events and callbacks are raised at one point)
+  char i = 0;
+  TGsmRequest *req;
+  while (i < bytGsmRequestCount) {
+    req = &GsmRequests[i];
+    if (gsmRequestExpired(req)) {
+      if (req->Kind == gsmreqMsgSend) {
+        gsmEvent(gsmevntMsgDiscarded);
+      } else if (req->Kind == gsmreqGprs) {
+        gsmEvent(gsmevntGprsFailed);
+      }
+      gsmRequestFinish(i, gsmresExpired);
+    } else {
+      i++;
+    }
+  }
+}
+
+static char gsmRequestNext(char jobs) {
+  // Returns the index + 1 of the request to run next (0 if none), passing
+  // over any which have passed their deadline (see gsmRequestsExpire())
+  // jobs: 0 - diversions (date/time), 1 - jobs (SMS, GPRS)
+  char i;
+  char best = 0;
+  TGsmRequest *req;
+  for (i = 0; i < bytGsmRequestCount; i++) {
+    req = &GsmRequests[i];
+    if (!gsmRequestExpired(req) && ((req->Kind >= gsmreqJobs) == jobs) &&
+        (!best || gsmRequestBefore(req, &GsmRequests[best - 1]))) {
+      best = i + 1;
+    }
+  }
+  return best;
+}
+
+static char gsmRequestStart() {
+  // Takes the next job (SMS, GPRS) off the queue and loads it for the module
+  // Returns the state (hook) to run it from, 0 if none is qued
+  TGsmRequest req;
+  char idx;
+  idx = gsmRequestNext(1);
+  if (!idx) {
+    return 0;
+  }
+  req = GsmRequests[idx - 1];
+  gsmRequestRemove(idx - 1);
+  bytGsmRequestPriority = req.Priority;
+  gsmRequestResultSet(&GsmRequestJob, &req, gsmresOK);
+  pGsmRequestJobDone = req.Done;
+  if (req.Kind == gsmreqMsgSend) {
+    pstrGsmMsgSendTxt = req.Text;
+    pstrGsmMsgSendNum = req.Dest;
+    bitGsmMsgWritePending = 1;
+    return gsmstMsgHook;
+  }
+  pstrGsmGprsURL = req.Text;
+  pstrGsmGprsData = req.Dest;
+  if (req.Dest) {
+    wrdGsmGprsDataSize = strlen(req.Dest);
+  } else {
+    wrdGsmGprsDataSize = 0;
+  }
+  bitGsmGprsPending = 1;
+  return gsmstGPRS_Hook;
+}
+
+TGsmHandle gsmRequestSubmit(char kind, char priority, unsigned long timeout,
+                            char *text, char *dest, TGsmRequestDone done,
+                            void *user) {
+  // Ques a request (gsmreqXxx) with a priority (gsmprioXxx) and a deadline
+  // (timeout ms from now, 0 for none); done (if not 0) is called with its
+  // result, and user, once it has been run (or dropped)
+  // Returns the request's handle, 0 if the queue is full
+  TGsmRequest *req;
+  if (bytGsmRequestCount >= cGsmRequestMax) {
+    return 0;
+  }
+  req = &GsmRequests[bytGsmRequestCount];
+  req->Kind = kind;
+  req->Priority = priority;
+  req->Deadline = 0;
+  if (timeout) {
+    req->Deadline = dwdGsmMsTmr + timeout;
+    if (!req->Deadline) {
+      req->Deadline = 1; // (0 means none)
+    }
+  }
+  req->Text = text;
+  req->Dest = dest;
+  req->Done = done;
+  req->User = user;
+  req->Tries = 0;
+  wrdGsmRequestSeq++;
+  #ifdef gsm_rtos
+  wrdGsmRequestSeq &= ~cGsmRtosHandle; // (see gsmRtosRequest())
+  #endif
+  if (!wrdGsmRequestSeq) {
+    wrdGsmRequestSeq = 1; // (0 means not qued)
+  }
+  req->Handle = wrdGsmRequestSeq;
+  bytGsmRequestCount++;
+  return req->Handle;
+}
+
+char gsmRequestAdd(char kind, char priority, unsigned long timeout,
+                   char *text, char *dest) {
+  // Ques a request without a callback (see gsmRequestSubmit())
+  // Returns 1 if successful, 0 if the queue is full
+  if (gsmRequestSubmit(kind, priority, timeout, text, dest, 0, 0)) { return 1; } else { return 0; }
+}
+
+char gsmRequestAbort(TGsmHandle handle) {
+  // Removes a qued request (its callback is called with gsmresCancelled);
+  // a job already in progress is left to finish, without its callback
+  // Returns 1 if the request was qued or in progress, 0 if not
+  char i;
+  for (i = 0; i < bytGsmRequestCount; i++) {
+    if (GsmRequests[i].Handle == handle) {
+      gsmRequestFinish(i, gsmresCancelled);
+      return 1;
+    }
+  }
+  if (GsmRequestJob.Kind && (GsmRequestJob.Handle == handle)) {
+    pGsmRequestJobDone = 0;
+    return 1;
+  }
+  return 0;
+}
+
+char gsmRequestActive(TGsmHandle handle) {
+  // Indicates if a request is qued or in progress
+  char i;
+  for (i = 0; i < bytGsmRequestCount; i++) {
+    if (GsmRequests[i].Handle == handle) {
+      return 1;
+    }
+  }
+  if (GsmRequestJob.Kind && (GsmRequestJob.Handle == handle)) { return 1; } else { return 0; }
+}
+
+TGsmResult *gsmRequestResult() {
+  // Returns the result of the job in progress, for the module running it to
+  // fill in (e.g. Data.Gprs.HttpStatus), 0 if there is none
+  if (!GsmRequestJob.Kind) {
+    return 0;
+  }
+  return &GsmRequestJob;
+}
+
+void gsmRequestData(char *data, unsigned int length) {
+  // Passes part of the result of the GPRS job in progress (e.g. a line of
+  // the HTTP response) to its callback (gsmresData)
+  if ((GsmRequestJob.Kind != gsmreqGprs) || !pGsmRequestJobDone) {
+    return;
+  }
+  GsmRequestJob.Status = gsmresData;
+  GsmRequestJob.Data.Gprs.Data = data;
+  GsmRequestJob.Data.Gprs.DataLen = length;
+  pGsmRequestJobDone(&GsmRequestJob);
+  GsmRequestJob.Data.Gprs.Data = 0;
+  GsmRequestJob.Data.Gprs.DataLen = 0;
+}
+
+void gsmRequestDone(char status) {
+  // Ends the job in progress (called by the module running it, or by the
+  // library once the job is back in gsmstStandbyPre), passing its result to
+  // its callback
+  TGsmResult result;
+  TGsmRequestDone done;
+  if (!GsmRequestJob.Kind) {
+    return;
+  }
+  result = GsmRequestJob;
+  result.Status = status;
+  done = pGsmRequestJobDone;
+  GsmRequestJob.Kind = 0;
+  pGsmRequestJobDone = 0;
+  if (done) {
+    done(&result);
+  }
+}
+
+char gsmRequestPending(char kind) {
+  // Indicates if a request of this kind is qued
+  if (gsmRequestFind(kind)) { return 1; } else { return 0; }
+}
+
+void gsmRequestCancel(char kind) {
+  // Removes all the requests of this kind from the queue (their callbacks are
+  // called with gsmresCancelled)
+  gsmRequestsFinish(kind, gsmresCancelled);
+}
+
+char gsmRequestPreempt() {
+  // Indicates if a job more urgent than the one in progress has been qued
+  char idx;
+  idx = gsmRequestNext(1);
+  if (idx && (GsmRequests[idx - 1].Priority < bytGsmRequestPriority)) {
+    return 1;
+  }
+  return 0;
+}
+
+static char gsmCheckStateDivert() {
+  char idx;
+  if (bitGSM_PowerOff) {
+    return gsmstPwrGsmOffPre;
+  }
+  idx = gsmRequestNext(0); // (only removed once successful)
+  if (!idx) {
+    return 0;
+  } else if (GsmRequests[idx - 1].Kind == gsmreqDateTimeRead) {
+    return gsmstGetDateTimePre;
+  } else {
+    return gsmstSetDateTimePre;
+  }
+}
+
+void gsmSetStateNext(char stateNext, char allowDivert) {
+  /*if (stateNext == bytGsmStateAfterDivert) {
+    // Returning from divert
+    bytGsmStateAfterDivert = 0;
+  }*/
+  if (/*(bytGsmStateAfterDivert == 0) &&*/ (allowDivert)) {
+    bytGsmStateAfterDivert = stateNext;
+    stateNext = gsmCheckStateDivert();
     if (stateNext == 0) {
       stateNext = bytGsmStateAfterDivert; // No diversions currently pending
       //bytGsmStateAfterDivert = 0;
@@ -759,6 +1775,7 @@ void gsmSetStateNext(char stateNext, char allowDivert) {
   // Diversions should only be allowed when the state machine is completely "free"
   // (no timeouts, counters, etc being used by any other state)
   // Diversion should never be allowed from within another diversion
+  bitGsmStateDefSent = 0; // (Re-)enter table-driven states
   if (stateNext != bytGsmState) {
     #ifdef gsm_debug_state
     // Output the current and next states
@@ -822,6 +1839,7 @@ void gsmSetStateWaitReg(char stateAfterReg) {
 void gsmSetStateCmdOK(char* cmd, char stateAfterOK, char stateAfterFail) {
   dwdGsmGPTmr = 0;
   bytGsmGPCtr = 0;
+  bytGsmCmdOKCtr = 0;
   pstrGsmCommand = cmd;
   bytGsmStateAfterOK = stateAfterOK;
   if (stateAfterFail == 0) {
@@ -831,6 +1849,372 @@ void gsmSetStateCmdOK(char* cmd, char stateAfterOK, char stateAfterFail) {
   gsmSetStateNext(gsmstCmdOK, 0);
 }
 
+char gsmStateDefine(TGsmStateDef *def) {
+  // Adds a table-driven state (copied, so def may be a local variable)
+  // Returns 1 if successful, 0 if the table is full
+  if (bytGsmStateDefCount >= cGsmStateDefMax) {
+    return 0;
+  }
+  GsmStateDefs[bytGsmStateDefCount] = *def;
+  GsmStateDefs[bytGsmStateDefCount].Latency = 0;
+  bytGsmStateDefCount++;
+  bytGsmStateDefIdx[(unsigned char)def->State] = bytGsmStateDefCount;
+  return 1;
+}
+
+void gsmStateDefRestart() {
+  // Starts counting the tries of the next table-driven state from 0
+  // (otherwise they carry on when the same state is entered again, e.g. after
+  // gsmSetStateWaitOK() / gsmSetStateDelay())
+  bytGsmStateDefLast = 0;
+}
+
+unsigned int gsmStateLatency(char state) {
+  // Returns the time (ms) from the last command of a table-driven state being
+  // qued to its response (0 if none yet)
+  char idx;
+  idx = bytGsmStateDefIdx[(unsigned char)state];
+  if (!idx) {
+    return 0;
+  }
+  return GsmStateDefs[idx - 1].Latency;
+}
+
+static char gsmStateDefNext(char next) {
+  if ((unsigned char)next == cGsmStateAfterDivert) {
+    return bytGsmStateAfterDivert;
+  }
+  return next;
+}
+
+static char gsmStateDefRun() {
+  // Processes the current state if it is table-driven
+  // Returns 1 if it was processed here, 0 if not
+  TGsmStateDef *def;
+  char idx;
+  char next;
+  idx = bytGsmStateDefIdx[(unsigned char)bytGsmState];
+  if (!idx) {
+    return 0;
+  }
+  def = &GsmStateDefs[idx - 1];
+  if (!bitGsmStateDefSent) {
+    // Entry (or retry after the timeout)
+    gsmUartRxLineClear(); // Make sure that new UART data will be received
+    if (bytGsmState != bytGsmStateDefLast) {
+      bytGsmStateDefLast = bytGsmState;
+      bytGsmStateDefTries = 0;
+    }
+    if (bytGsmStateDefTries >= def->Tries) {
+      gsmCancelStateTimeout();
+      gsmSetStateNext(def->NextFail ? gsmStateDefNext(def->NextFail) : gsmstPwrGsmOffPre, 0);
+      return 1;
+    }
+    if (!gsmCmdBegin()) {
+      return 1; // UART Tx busy, try again
+    }
+    if (def->Compose) {
+      if (!def->Compose()) { // (command too long / not to be sent)
+        gsmSetStateNext(def->NextFail ? gsmStateDefNext(def->NextFail) : gsmstPwrGsmOffPre, 0);
+        return 1;
+      }
+    } else {
+      gsmCmdText(def->Cmd);
+      gsmCmdCommit();
+    }
+    bitGsmStateDefSent = 1;
+    bytGsmStateDefTries++;
+    wrdGsmStateDefTmr = 0;
+    gsmSetStateTimeout(def->Timeout, bytGsmState); // Retry on timeout
+    return 1;
+  }
+  if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
+    if (def->Parse) {
+      wrdGsmTimeoutTmr = 0; // Reset timeout timer
+      if (bytGsmUartRxLineRsp == def->Rsp) {
+        next = def->Parse(pstrGsmUartRxLine, wrdGsmUartRxLineLen);
+        if (next) {
+          // Proceed to the next state after "OK"
+          def->Latency = wrdGsmStateDefTmr;
+          gsmSetStateWaitOK(gsmStateDefNext(next), 250, gsmStateDefNext(next));
+        } else if (bytGsmState != def->State) {
+          gsmCancelStateTimeout(); // Moved on by the parser
+        }
+      }
+    } else if (bytGsmUartRxLineRsp == def->Rsp) {
+      def->Latency = wrdGsmStateDefTmr;
+      gsmCancelStateTimeout();
+      gsmSetStateNext(gsmStateDefNext(def->NextOK), 0);
+    }
+    if ((bytGsmState == def->State) && def->NextError &&
+        ((bytGsmUartRxLineRsp == gsmrspERROR) ||
+         (bytGsmUartRxLineRsp == gsmrspCME_ERROR) ||
+         (bytGsmUartRxLineRsp == gsmrspCMS_ERROR))) {
+      gsmCancelStateTimeout();
+      gsmSetStateNext(gsmStateDefNext(def->NextError), 0);
+    }
+    gsmUartRxLineProcessed(); // Allow new comms to be received
+  }
+  return 1;
+}
+
+#ifdef gsm_uart_baud_high
+static void gsmUartBaudSet(unsigned long rate) {
+  // Reconfigures the UART for another baud rate (everything qued must have
+  // been sent - see gsmUartTxComplete(); anything being received is lost)
+  if (rate == dwdGsmUartBaud) {
+    return;
+  }
+  dwdGsmUartBaud = rate;
+  HAL_UART_Abort(pGsm->pUart);
+  pGsm->pUart->Init.BaudRate = rate;
+  HAL_UART_Init(pGsm->pUart);
+  gsmUartRxBuffClear();
+  #ifdef gsm_dma_uart_rx
+  gsmUartRxDmaStart();
+  #endif
+}
+
+static unsigned long gsmUartBaudCandidate(char index) {
+  // Rates tried when looking for the module, the one saved in its profile
+  // (or else the last working one) first
+  switch (index) {
+    case 0: return dwdGsmUartBaudSaved ? dwdGsmUartBaudSaved : dwdGsmUartBaudPrev;
+    case 1: return USART_GSM_BAUDRATE;
+    default: return gsm_uart_baud_high;
+  }
+}
+#endif
+
+char gsmSetupBatchAdd(char *cmd) {
+  // Adds a module-specific setup command (without "AT", e.g. "+CTZU=2") to
+  // the batched setup command line (from gsmstSetup_MSHI)
+  // Returns 1 if added, 0 if the module should send it on its own
+  // (gsm_setup_batch not defined, or the batch has already failed)
+  #ifdef gsm_setup_batch
+  if (!bitGsmSetupBatchFailed && (bytGsmSetupBatchCount < cGsmSetupBatchMax)) {
+    pstrGsmSetupBatch[bytGsmSetupBatchCount] = cmd;
+    bytGsmSetupBatchCount++;
+    return 1;
+  }
+  #endif
+  return 0;
+}
+
+#ifdef gsm_setup_batch
+static char gsmSetupBatchSend() {
+  // Composes and sends the batched setup command line (gsmstSetupBatch)
+  // Returns 1 if successful, 0 if it is too long
+  char i;
+  gsmCmdText("AT+CLIP=1;+CMGF=1;+CNMI=2,1");
+  for (i = 0; i < bytGsmSetupBatchCount; i++) {
+    gsmCmdChar(';');
+    gsmCmdText(pstrGsmSetupBatch[i]);
+  }
+  return gsmCmdCommit();
+}
+#endif
+
+static char gsmParseIMEI(char *line, unsigned int length) {
+  if (!isnumeric(line)) {
+    return 0;
+  }
+  pstrGsmEventData = line;
+  wrdGsmEventDataLen = length;
+  gsmEvent(gsmevntIMEI_Read); // Call the external routine
+  return gsmstPinChkPre;
+}
+
+static char gsmParseCPIN(char *line, unsigned int length) {
+  if (memcmp(line + 7, &strREADY, 5) == 0) {
+    return gsmstSetup_MSHI; // No PIN required
+  } else if (memcmp(line + 11, "PIN", 3) == 0) {
+    return gsmstPinPre; // PIN must be entered
+  } else if (memcmp(line + 11, "PUK", 3) == 0) {
+    // PUK required
+    // (User should remove the SIM card, unblock the PUK, and try again)
+    return gsmstPwrGsmOffPre;
+  }
+  return gsmstPinChkQuery; // Unrecognised response, try again
+}
+
+static char gsmParseCCLK(char *line, unsigned int length) {
+  gsmExtractDateTime(line + 6); //Extract date/time
+  gsmEvent(gsmevntDateTimeRead); // Call the external routine
+  if (dtmGsmEvent.Day) {
+    gsmRequestsFinish(gsmreqDateTimeRead, gsmresOK);
+  } else {
+    gsmRequestsFinish(gsmreqDateTimeRead, gsmresFailed);
+  }
+  return cGsmStateAfterDivert;
+}
+
+static char gsmComposeCCLK() {
+  gsmEvent(gsmevntDateTimeWrite); // Request the date/time to write
+  // Send the command (AT+CCLK="yy/MM/dd,hh:mm:ss+00")
+  gsmCmdText((char *)strAT);
+  gsmCmdText((char *)strCCLK);
+  gsmCmdChar('=');
+  gsmCmdChar('"');
+  gsmCmdDigits2(dtmGsmEvent.Year);
+  gsmCmdChar('/');
+  gsmCmdDigits2(dtmGsmEvent.Month);
+  gsmCmdChar('/');
+  gsmCmdDigits2(dtmGsmEvent.Day);
+  gsmCmdChar(',');
+  gsmCmdDigits2(dtmGsmEvent.Hour);
+  gsmCmdChar(':');
+  gsmCmdDigits2(dtmGsmEvent.Minute);
+  gsmCmdChar(':');
+  gsmCmdDigits2(dtmGsmEvent.Second);
+  gsmCmdText("+00"); // Ignoring time-zone
+  gsmCmdChar('"');
+  return gsmCmdCommit();
+}
+
+static char gsmComposeCREG() {
+  if (dwdGsmGPTmr >= 60000) { // Trying this for longer than a minute
+    return 0; // Restart the module
+  }
+  gsmCmdText((char *)strAT);     // Request network registration
+  gsmCmdText((char *)strCREG);   // status from the GSM module
+  gsmCmdChar('?');
+  return gsmCmdCommit();
+}
+
+static char gsmParseCREG(char *line, unsigned int length) {
+  char next;
+  if ((*(line + 9) == '1') || (*(line + 9) == '5')) {
+    // If registered then proceed to next gsmst, after "OK"
+    next = bytGsmStateAfterReg;
+    bytGsmStateAfterReg = 0; // Reset to default
+    bitGSM_Ready = 1;
+    return next;
+  }
+  // If not registered then wait 5 seconds before checking again
+  gsmSetStateDelay(5000, gsmstWaitRegQuery);
+  bitGSM_Ready = 0;
+  return 0;
+}
+
+static void gsmStateDefsInit() {
+  TGsmStateDef def;
+  bytGsmStateDefCount = 0;
+  memset(bytGsmStateDefIdx, 0, sizeof(bytGsmStateDefIdx));
+  def.Rsp = gsmrspOK;
+  def.Timeout = 1000;
+  def.Tries = 3;
+  def.Compose = 0;
+  def.Parse = 0;
+  def.NextError = 0;
+  // -- Turn off command echo --
+  // (on failure carry on - echo is still filtered by gsmUartRxLineReceived())
+  def.State = gsmstEchoOff;
+  def.Cmd = "ATE0";
+  #ifdef gsm_uart_hw_flow_ctl
+  def.NextOK = gsmstFlowCtl;
+  #else
+  def.NextOK = gsmstIMEIPre;
+  #endif
+  def.NextFail = def.NextOK;
+  gsmStateDefine(&def);
+  #ifdef gsm_uart_hw_flow_ctl
+  // -- Turn on RTS/CTS flow control in the module --
+  def.State = gsmstFlowCtl;
+  def.Cmd = "AT+IFC=2,2";
+  def.NextOK = gsmstIMEIPre;
+  def.NextFail = 0;
+  gsmStateDefine(&def);
+  #endif
+  // Queries (the response line is handed to Parse)
+  def.Timeout = 500;
+  def.NextOK = 0;
+  // -- Request the IMEI --
+  // (on failure carry on)
+  def.State = gsmstIMEIQuery;
+  def.Cmd = "AT+CGSN";
+  def.Rsp = gsmrspNone; // (just digits)
+  def.Parse = &gsmParseIMEI;
+  def.NextFail = gsmstPinChkPre;
+  gsmStateDefine(&def);
+  // -- Request the PIN status --
+  def.State = gsmstPinChkQuery;
+  def.Cmd = "AT+CPIN?";
+  def.Rsp = gsmrspCPIN;
+  def.Parse = &gsmParseCPIN;
+  def.NextFail = 0;
+  gsmStateDefine(&def);
+  // -- Get date/time from the GSM module --
+  // (on failure give up and carry on)
+  def.State = gsmstGetDateTimeQuery;
+  def.Cmd = "AT+CCLK?";
+  def.Rsp = gsmrspCCLK;
+  def.Parse = &gsmParseCCLK;
+  def.NextFail = cGsmStateAfterDivert;
+  gsmStateDefine(&def);
+  // -- Request network registration status --
+  // (for up to a minute - see gsmComposeCREG())
+  def.State = gsmstWaitRegQuery;
+  def.Cmd = 0;
+  def.Compose = &gsmComposeCREG;
+  def.Rsp = gsmrspCREG;
+  def.Parse = &gsmParseCREG;
+  def.Tries = 255;
+  def.NextFail = 0;
+  gsmStateDefine(&def);
+  def.Compose = 0;
+  def.Parse = 0;
+  def.Rsp = gsmrspOK;
+  def.Timeout = 1000;
+  def.Tries = 3;
+  // -- Turn on CLIP (Caller Line Identity Presentation) --
+  def.State = gsmstEnableCLIP;
+  def.Cmd = "AT+CLIP=1";
+  def.NextOK = gsmstSetMsgFrmtToTxt;
+  def.NextFail = 0;
+  gsmStateDefine(&def);
+  // -- Set SMS format to text mode --
+  def.State = gsmstSetMsgFrmtToTxt;
+  def.Cmd = "AT+CMGF=1";
+  def.NextOK = gsmstSetMsgAlertOnPre;
+  gsmStateDefine(&def);
+  #ifdef gsm_setup_batch
+  // -- Send the setup commands as one command line --
+  // ("ERROR", or no "OK" after 3 tries: one command at a time)
+  def.State = gsmstSetupBatch;
+  def.Cmd = 0;
+  def.Compose = &gsmSetupBatchSend;
+  def.NextOK = gsmstWaitRegPre;
+  def.NextError = gsmstSetupBatchFail;
+  def.NextFail = gsmstSetupBatchFail;
+  gsmStateDefine(&def);
+  #endif
+  #ifdef gsm_uart_baud_high
+  // -- Save the verified baud rate in the module's profile --
+  // (on failure carry on at the rate, which works until the module restarts)
+  def.State = gsmstBaudSave;
+  def.Cmd = "AT&W";
+  def.Compose = 0;
+  def.NextOK = gsmstBaudSaved;
+  def.NextError = gsmstBaudSet;
+  def.NextFail = gsmstBaudSet;
+  gsmStateDefine(&def);
+  #endif
+  // -- Set the date/time of the GSM module --
+  // (one try per diversion: see gsmstSetDateTimeFail)
+  def.State = gsmstSetDateTime;
+  def.Cmd = 0;
+  def.Compose = &gsmComposeCCLK;
+  def.Rsp = gsmrspOK;
+  def.Parse = 0;
+  def.Timeout = 250;
+  def.Tries = 1;
+  def.NextOK = gsmstSetDateTimeDone;
+  def.NextError = gsmstSetDateTimeFail;
+  def.NextFail = gsmstSetDateTimeFail;
+  gsmStateDefine(&def);
+}
+
 static char gsmExtractCallerId(char *source, char *dest) {
   // Copies to dest the value between the next two quotes in source
   // Returns 1 if successful, 0 if not
@@ -880,49 +2264,456 @@ void gsmExtractDateTime(char *source) {
   }
 }
 
-static void gsmRTCC_GenerateDigits(char value, char *pos, char tail) {
-  *pos = (value / 10) + 48;
-  pos++;
-  *pos = (value % 10) + 48;
-  pos++;
-  *pos = tail;
+static char gsmMsgPending() {
+  if (bitGsmMsgDelPending || bitGsmMsgWritePending || bitGsmMsgReadPending || bitGsmMsgSendPending) {
+    return 1;
+  }
+  return 0;
+}
+// ---------- URC Dispatch ----------
+// Unsolicited result codes are recognised (by prefix) before the current state
+// is processed, so that they are not lost while the state machine is busy with
+// something else. Modules can add their own prefixes with gsmUrcRegister().
+#define cGsmCallRingTimeout 5000 // Ringing has stopped if no RING within (ms)
+
+char gsmUrcRegister(char *prefix, char (*handler)(char *line, unsigned int length)) {
+  // Adds a prefix to the URC table (checked in the order registered)
+  // Returns 1 if successful, 0 if the table is full
+  if (bytGsmUrcCount >= cGsmUrcMax) {
+    return 0;
+  }
+  GsmUrcs[bytGsmUrcCount].Prefix = prefix;
+  GsmUrcs[bytGsmUrcCount].PrefixLen = strlen(prefix);
+  GsmUrcs[bytGsmUrcCount].Handler = handler;
+  bytGsmUrcCount++;
+  return 1;
+}
+
+static void gsmUrcCallEnded() {
+  bitGsmCallRinging = 0;
+  bitGsmCallIdReported = 0;
+}
+
+static char gsmUrcRING(char *line, unsigned int length) {
+  bitGsmCallRinging = 1;
+  wrdGsmCallRingTmr = 0;
+  return 1;
+}
+
+static char gsmUrcCLIP(char *line, unsigned int length) {
+  bitGsmCallRinging = 1;
+  wrdGsmCallRingTmr = 0;
+  if (bitGsmCallIdReported) { // Repeated with every RING
+    return 1;
+  }
+  // Try to extract the caller ID
+  if (gsmExtractCallerId(line, (char *)strGsmOrigOrDestID) == 1) {
+    #ifdef gsm_debug_state
+    strcpy(gsmDebugStateStrPtr, "Incoming call from ");
+    strcat(gsmDebugStateStrPtr, &strGsmOrigOrDestID);
+    strcat(gsmDebugStateStrPtr, &strNewLine);
+    gsmDebugStateStrReady();
+    #endif
+    bitGsmCallIdReported = 1;
+    pstrGsmEventOriginatorID = (char *)strGsmOrigOrDestID;
+    gsmEvent(gsmevntMissedCall); // Call the external routine
+  }
+  return 1;
+}
+
+static char gsmUrcNOCARRIER(char *line, unsigned int length) {
+  if (!bitGsmCallRinging) {
+    return 0; // Not an incoming call, leave it to the current state
+  }
+  gsmUrcCallEnded();
+  return 1;
+}
+
+static char gsmUrcCMTI(char *line, unsigned int length) {
+  if (!gsmMsgPending()) {
+    bitGsmMsgJustArrived = 1;
+  }
+  bitGsmMsgReadPending = 1; // Read from gsmstStandby (via gsmstMsgHook)
+  return 1;
+}
+
+static char gsmUrcCREG(char *line, unsigned int length) {
+  // Unsolicited: "+CREG: <stat>", response to AT+CREG?: "+CREG: <n>,<stat>"
+  if (bytGsmState == gsmstWaitRegQuery) {
+    return 0; // Left to gsmstWaitRegQuery
+  }
+  if ((length > 7) && (*(line + 8) != ',')) {
+    if ((*(line + 7) == '1') || (*(line + 7) == '5')) {
+      bitGSM_Ready = 1;
+    } else {
+      bitGSM_Ready = 0;
+    }
+  }
+  return 1;
+}
+
+static void gsmUrcDispatch() {
+  // Hands the lines ready to the URC table, releasing the ones consumed
+  char i;
+  if (bitGsmCallRinging && (wrdGsmCallRingTmr >= cGsmCallRingTimeout)) {
+    gsmUrcCallEnded(); // Ringing stopped without NO CARRIER
+  }
+  while (bitGsmUartRxLineReady && !bitGsmUartRxLineUrcChecked) {
+    for (i = 0; i < bytGsmUrcCount; i++) {
+      if ((wrdGsmUartRxLineLen >= GsmUrcs[i].PrefixLen) &&
+          (memcmp(pstrGsmUartRxLine, GsmUrcs[i].Prefix, GsmUrcs[i].PrefixLen) == 0) &&
+          GsmUrcs[i].Handler(pstrGsmUartRxLine, wrdGsmUartRxLineLen)) {
+        break; // Consumed
+      }
+    }
+    if (i < bytGsmUrcCount) {
+      gsmUartRxLineProcessed(); // Next line (if any) is checked as well
+    } else {
+      bitGsmUartRxLineUrcChecked = 1; // Leave it to the current state
+    }
+  }
+}
+
+// ---------- END URC Dispatch ----------
+ 
+static void gsmTimersAdd(TGsmContext *pGsm, unsigned long elapsed,
+                         unsigned long elapsedTx) {
+  // Advances the timers by elapsed ms
+  // (elapsedTx: ms of that with nothing qued for transmission)
+  // (pGsm: as gsm1msPing() runs it from the interrupt)
+  unsigned char quiet;
+  wrdGsmGPTmr += elapsed;
+  dwdGsmGPTmr += elapsed;
+  wrdGsmStateDefTmr += elapsed;
+  dwdGsmMsTmr += elapsed;
+  wrdGsmDelayTmr += elapsedTx;   // Delays / timeouts run from the end of the
+  wrdGsmTimeoutTmr += elapsedTx; // command sent, not from when it was qued
+  //wrdGsmMsgWriteTmr++;
+  if (elapsed < 255 - bytGSM_StatTmr) {
+    bytGSM_StatTmr += elapsed;
+  } else {
+    bytGSM_StatTmr = 255;
+  }
+  if (bitGsmCallRinging) {
+    wrdGsmCallRingTmr += elapsed;
+  }
+  quiet = bytGsmUartRxQuietTimer;
+  if (elapsed < 255 - quiet) {
+    bytGsmUartRxQuietTimer = quiet + elapsed;
+  } else {
+    bytGsmUartRxQuietTimer = 255;
+  }
+  if ((quiet < gsm_uart_rx_line_gap) && (bytGsmUartRxQuietTimer >= gsm_uart_rx_line_gap)) {
+    bitGsmUartRxReset = 1;
+    /*#ifdef gsm_debug_state
+    if (bytGsmUartRxLinesReady) {bitGsmUartRxBuffCleared = 1;}
+    #endif  
+    bytGsmUartRxQuietTimer = 0;
+    bitGsmUartRxLineReady = 0;  
+    wrdGsmUartRxLinePos = wrdGsmUartRxLineStart; //"Clear the line"*/
+  }
+}
+
+#ifdef gsm_tickless
+static void gsmTimersAdvance() {
+  // Advances the timers by the time elapsed since the last call (gsmPoll())
+  unsigned long now;
+  unsigned long elapsedTx = 0;
+  now = gsm_tick();
+  if (gsmUartTxComplete()) {
+    #if defined(gsm_dma_uart_tx) && !defined(gsm_blocking_uart_tx)
+    if ((long)(dwdGsmUartTxDoneTick - dwdGsmTickTx) > 0) {
+      dwdGsmTickTx = dwdGsmUartTxDoneTick; // Sent since the last call
+    }
+    #endif
+    elapsedTx = now - dwdGsmTickTx;
+  }
+  dwdGsmTickTx = now;
+  gsmTimersAdd(pGsm, now - dwdGsmTick, elapsedTx);
+  dwdGsmTick = now;
+}
+#endif
+
+void gsm1msPing() {  
+  // Runs for every instance (without changing the instance being run by the
+  // main loop, see GSM_Ctx.h)
+  TGsmContext *pGsm;
+  for (pGsm = pGsmFirst; pGsm; pGsm = pGsm->pNext) {
+    #if defined(gsm_async_uart_rx) && !defined(gsm_dma_uart_rx)
+    if (__HAL_UART_GET_FLAG(pGsm->pUart, UART_FLAG_RXNE) == SET) {gsmUartRx(pGsm);}
+    if (__HAL_UART_GET_FLAG(pGsm->pUart, UART_FLAG_RXNE) == SET) {gsmUartRx(pGsm);}
+    #ifdef gsm_rtos
+    if (wrdGsmUartRxRingHead != wrdGsmUartRxRingTail) {
+      gsmRtosNotifyFromISR();
+    }
+    #endif
+    #endif
+    #ifndef gsm_tickless
+    gsmTimersAdd(pGsm, 1, gsmUartTxEmpty(pGsm));
+    #endif
+  }
+}      
+
+#define cGsmSleepMax 1000 // Longest time gsmNextDeadline() returns (ms)
+
+static void gsmDeadlineMin(unsigned long *deadline, unsigned long time,
+                           unsigned long elapsed) {
+  // Brings the deadline forward to when a timer reaches time (if sooner)
+  if (elapsed >= time) {
+    *deadline = 0;
+  } else if (time - elapsed < *deadline) {
+    *deadline = time - elapsed;
+  }
+}
+
+// ---------- Flows ----------
+// Flows (see GSM.h) are run in turn from gsmstFlow. A flow which has sent a
+// command (gsmFlowSend()) owns the module until its final response, so the
+// commands and responses of several flows never mix, while the flows which
+// are only waiting (gsmFlowDelay(), gsmFlowWaitUntil()) carry on.
+char gsmFlowStart(TGsmFlow *flow, char (*run)(TGsmFlow *flow)) {
+  // Starts a flow (run from standby, in gsmstFlow)
+  // Returns 0 if it is already running
+  if (gsmFlowRunning(flow)) {
+    return 0;
+  }
+  flow->Lc = 0;
+  flow->Run = run;
+  flow->Timeout = 0;
+  flow->Final = gsmrspNone;
+  flow->pNext = pGsmFlows;
+  pGsmFlows = flow;
+  return 1;
+}
+
+char gsmFlowRunning(TGsmFlow *flow) {
+  TGsmFlow *scan;
+  for (scan = pGsmFlows; scan; scan = scan->pNext) {
+    if (scan == flow) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void gsmFlowRelease(TGsmFlow *flow) {
+  // Releases the line held for the flow
+  if (pGsmFlowHolder == flow) {
+    pGsmFlowHolder = 0;
+    gsmUartRxLineProcessed();
+  }
+}
+
+void gsmFlowAbort(TGsmFlow *flow) {
+  // Stops a flow (also called once it is done)
+  TGsmFlow **link;
+  gsmFlowRelease(flow);
+  if (pGsmFlowOwner == flow) {
+    pGsmFlowOwner = 0;
+  }
+  for (link = &pGsmFlows; *link; link = &(*link)->pNext) {
+    if (*link == flow) {
+      *link = flow->pNext;
+      break;
+    }
+  }
+  flow->Lc = 0;
+}
+
+char gsmFlowCmdSend(TGsmFlow *flow, char *cmd) {
+  // Sends a command for the flow once no other flow owns the module
+  // Returns 1 if sent, 0 to try again
+  if ((pGsmFlowOwner && (pGsmFlowOwner != flow)) || !gsmCmdBegin()) {
+    return 0;
+  }
+  gsmFlowRelease(flow);
+  pGsmFlowOwner = flow;
+  flow->Final = gsmrspNone;
+  gsmCmdText(cmd);
+  gsmCmdCommit();
+  return 1;
+}
+
+void gsmFlowWaitStart(TGsmFlow *flow, char rsp, unsigned long timeout) {
+  gsmFlowRelease(flow);
+  flow->Rsp = rsp;
+  flow->Start = dwdGsmMsTmr;
+  flow->Timeout = timeout;
+}
+
+char gsmFlowWaitDone(TGsmFlow *flow) {
+  // Returns 1 once the time given to gsmFlowWaitStart() has elapsed
+  return (dwdGsmMsTmr - flow->Start) >= flow->Timeout;
+}
+
+char gsmFlowAwaitDone(TGsmFlow *flow) {
+  // Returns 1 once the response awaited, a final response (OK, ERROR,
+  // +CME / +CMS ERROR) or a timeout has been received, with flow->Rsp set to
+  // it (the line stays in pstrGsmUartRxLine until the next wait)
+  // The module is released after a final response or a timeout; awaiting
+  // again after the final response returns at once, with flow->Rsp set to it
+  char rsp;
+  if (pGsmFlowOwner != flow) {
+    if ((flow->Final != gsmrspNone) && (flow->Rsp != gsmrspNone)) {
+      flow->Rsp = flow->Final; // Already received
+      return 1;
+    }
+    return gsmFlowWaitDone(flow); // No command sent, only the timeout
+  }
+  while (bitGsmUartRxLineReady && bitGsmUartRxLineUrcChecked &&
+         !pGsmFlowHolder) {
+    // (a line not yet seen by the URC table waits for gsmUrcDispatch())
+    rsp = bytGsmUartRxLineRsp;
+    if ((rsp == gsmrspOK) || (rsp == gsmrspERROR) ||
+        (rsp == gsmrspCME_ERROR) || (rsp == gsmrspCMS_ERROR)) {
+      pGsmFlowHolder = flow;
+      flow->Rsp = rsp;
+      flow->Final = rsp;
+      pGsmFlowOwner = 0; // Final response (the line is released on the next wait)
+      return 1;
+    }
+    if ((rsp == flow->Rsp) && (rsp != gsmrspNone)) {
+      pGsmFlowHolder = flow;
+      return 1;
+    }
+    gsmUartRxLineProcessed(); // Not the one awaited
+  }
+  if (gsmFlowWaitDone(flow)) {
+    flow->Rsp = gsmrspNone;
+    pGsmFlowOwner = 0;
+    return 1;
+  }
+  return 0;
+}
+
+static void gsmFlowRunAll() {
+  // Runs each flow once (gsmstFlow)
+  TGsmFlow *flow;
+  TGsmFlow *next;
+  for (flow = pGsmFlows; flow; flow = next) {
+    next = flow->pNext; // (the flow may be removed)
+    if (flow->Run(flow) == gsmflowDone) {
+      gsmFlowAbort(flow);
+    }
+  }
+  if (bitGsmUartRxLineReady && bitGsmUartRxLineUrcChecked && !pGsmFlowHolder) {
+    gsmUartRxLineProcessed(); // Not awaited by any flow
+  }
 }
 
-static char gsmMsgPending() {
-  if (bitGsmMsgDelPending || bitGsmMsgWritePending || bitGsmMsgReadPending || bitGsmMsgSendPending) {
-    return 1;
+static char gsmFlowDeadline(unsigned long *deadline, unsigned long elapsed) {
+  // Brings the deadline forward to the end of the earliest flow wait
+  // Returns 0 if a flow is waiting on a condition (it has to be polled)
+  TGsmFlow *flow;
+  for (flow = pGsmFlows; flow; flow = flow->pNext) {
+    if (!flow->Timeout) {
+      return 0;
+    }
+    gsmDeadlineMin(deadline, flow->Timeout, (dwdGsmMsTmr - flow->Start) + elapsed);
   }
-  return 0;
+  return 1;
 }
- 
-void gsm1msPing() {  
-  #ifdef gsm_async_uart_rx
-  if (UART_Data_Ready()) {gsmUartRx();}
-  if (UART_Data_Ready()) {gsmUartRx();}
-  bitGsmUartRxSync = 0;
+
+static unsigned long gsmNextDeadlineRun() {
+  unsigned long deadline = cGsmSleepMax;
+  unsigned long elapsed = 0; // Since the timers were last advanced
+  long left;
+  char i;
+  #ifdef gsm_tickless
+  elapsed = gsm_tick() - dwdGsmTick;
   #endif
-  wrdGsmGPTmr++;
-  dwdGsmGPTmr++;
-  wrdGsmDelayTmr++;
-  wrdGsmTimeoutTmr++;
-  //wrdGsmMsgWriteTmr++;
-  bytGSM_StatTmr++;
-  if (bytGsmUartRxQuietTimer < 255) {
-    bytGsmUartRxQuietTimer++;
-  } 
-  if (bytGsmUartRxQuietTimer == 100) {
-    bitGsmUartRxReset = 1;
-    /*#ifdef gsm_debug_state
-    if (pstrGsmUartRxBuff != &strGsmUartRxBuff) {bitGsmUartRxBuffCleared = 1;}
-    #endif  
-    bytGsmUartRxQuietTimer = 0;
-    bytGsmUartRxLinesReady = 0;
-    bitGsmUartRxLineReady = 0;  
-    pstrGsmUartRxBuff = &strGsmUartRxBuff; //"Clear the line"*/
+  if (bitGsmUartRxLineReady ||
+      ((wrdGsmUartRxRingHead != wrdGsmUartRxRingTail) && !bitGsmUartRxRawHalt)) {
+    return 0; // Received data to process
   }
-}      
+  if (bitGsmUartRxReset && (wrdGsmUartRxRingHead == wrdGsmUartRxRingTail)) {
+    return 0; // Partial line to discard (gsmUartRxLineGap() waits while
+              // framing has stalled, e.g. at a raw payload header)
+  }
+  #if defined(gsm_dma_uart_tx) && !defined(gsm_blocking_uart_tx)
+  if (!bitGsmUartTxDmaBusy && !gsmUartTxComplete()) {
+    return 0; // Qued characters to send
+  }
+  #else
+  if (!gsmUartTxComplete()) {
+    return 0; // Qued characters to send
+  }
+  #endif
+  if (bytGsmState == gsmstStandby) {
+    if (bitGsmCallRinging || gsmMsgPending() || bitGsmGprsPending ||
+        gsmRequestNext(1) || gsmCheckStateDivert()) {
+      return 0;
+    }
+    gsmDeadlineMin(&deadline, 60000, dwdGsmGPTmr + elapsed); // Registration check
+  } else if (bytGsmState == gsmstFlow) {
+    if (!pGsmFlows || !gsmFlowDeadline(&deadline, elapsed)) {
+      return 0;
+    }
+    if (!pGsmFlowOwner) {
+      if (bitGsmCallRinging || gsmMsgPending() || bitGsmGprsPending ||
+          gsmRequestNext(1) || gsmCheckStateDivert()) {
+        return 0;
+      }
+      gsmDeadlineMin(&deadline, 60000, dwdGsmGPTmr + elapsed); // Registration check
+    }
+  } else if (bytGsmState == gsmstDelay) {
+    if (gsmUartTxComplete()) {
+      gsmDeadlineMin(&deadline, wrdGsmDelayTime, wrdGsmDelayTmr + elapsed);
+    }
+  } else if ((bytGsmState != gsmstWaitingNO_CARRIER) &&
+             (bytGsmState != gsmstDie) && !bytGsmStateAfterTimeout) {
+    return 0; // Not waiting for anything (or for something only it knows)
+  }
+  if (bytGsmStateAfterTimeout && gsmUartTxComplete()) {
+    gsmDeadlineMin(&deadline, wrdGsmTimeoutTime, wrdGsmTimeoutTmr + elapsed);
+  }
+  if (bitGsmCallRinging) {
+    gsmDeadlineMin(&deadline, cGsmCallRingTimeout, wrdGsmCallRingTmr + elapsed);
+  }
+  if (bytGsmUartRxQuietTimer < gsm_uart_rx_line_gap) {
+    gsmDeadlineMin(&deadline, gsm_uart_rx_line_gap, bytGsmUartRxQuietTimer + elapsed);
+  }
+  if (bitExpectGSM_On && ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) != bitGSM_Stat_On_State)) {
+    gsmDeadlineMin(&deadline, 101, bytGSM_StatTmr + elapsed); // Powered down?
+  }
+  for (i = 0; i < bytGsmRequestCount; i++) {
+    if (GsmRequests[i].Deadline) { // Request to drop (gsmRequestsExpire())
+      left = (long)(GsmRequests[i].Deadline - dwdGsmMsTmr);
+      gsmDeadlineMin(&deadline, (left > 0) ? (unsigned long)left : 0, elapsed);
+    }
+  }
+  return deadline;
+}
 
-void gsmInit() {
+void gsmInstanceInit(TGsmContext *ctx, UART_HandleTypeDef *uart,
+                     const TGsmPins *pins) {
+  // Sets up an instance for the module on uart (already initialised, see
+  // UART_GSM_Init()) and pins (followed by the modules' InstanceInit routines)
+  // A context not seen before is cleared and added to the instances; a live
+  // one is restarted, keeping the states and URCs registered with it
+  TGsmContext *scan;
+  TGsmPins pinsNew = *pins; // (pins may be within ctx)
+  char i;
+  gsmCtxEnter(ctx);
+  for (scan = pGsmFirst; scan && (scan != ctx); scan = scan->pNext);
+  if (!scan) {
+    memset(ctx, 0, sizeof(TGsmContext));
+    gsmStateDefsInit();
+    gsmUrcRegister((char *)strRING, &gsmUrcRING);
+    gsmUrcRegister((char *)strCLIP, &gsmUrcCLIP);
+    gsmUrcRegister((char *)strNOCARRIER, &gsmUrcNOCARRIER);
+    gsmUrcRegister((char *)strCMTI, &gsmUrcCMTI);
+    gsmUrcRegister((char *)strCREG, &gsmUrcCREG);
+  } else {
+    for (i = 0; i < bytGsmStateDefCount; i++) {
+      GsmStateDefs[i].Latency = 0;
+    }
+    bytGsmStateDefLast = 0;
+  }
+  pGsm->pUart = uart;
+  pGsm->Pins = pinsNew;
+  dwdGsmUartBaud = uart->Init.BaudRate;
+  pstrGsmUartRxLine = strGsmUartRxBuff;
   //Setup
   //GSM_Pwr_Key_Dir = 0; // Should now be done externally
   #ifdef gsm_reset_en
@@ -935,18 +2726,20 @@ void gsmInit() {
   //Startup
   bytGsmState = gsmstPwrGsmOn;
   bitGsmUartRxLineReady = 0;
-  GSM_Pwr_Key->BRR = GSM_Pwr_Key_Pin;
+  pGsm->Pins.PwrKeyPort->BRR = pGsm->Pins.PwrKeyPin;
   #ifdef gsm_reset_en
-  GSM_Reset->BRR = GSM_Reset_Pin;
+  pGsm->Pins.ResetPort->BRR = pGsm->Pins.ResetPin;
   #endif
 //  HAL_Delay(100);
-//  GSM_Pwr_Key->BSRR = GSM_Pwr_Key_Pin;
+//  pGsm->Pins.PwrKeyPort->BSRR = pGsm->Pins.PwrKeyPin;
 //  HAL_Delay(100);
-//  GSM_Pwr_Key->BRR = GSM_Pwr_Key_Pin;
-  while(GSM_Stat->IDR & GSM_Stat_Pin != GPIO_PIN_SET);
+//  pGsm->Pins.PwrKeyPort->BRR = pGsm->Pins.PwrKeyPin;
+  while(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin != GPIO_PIN_SET);
   
-  bitGsmDateTimeReadPending = 0;
-  bitGsmDateTimeWritePending = 0;
+  bytGsmRequestCount = 0;
+  bytGsmRequestPriority = gsmprioIdle;
+  GsmRequestJob.Kind = 0;
+  pGsmRequestJobDone = 0;
   bitExpectGSM_On = 0;
   bitGSM_PowerOff = 0;
   //strcpy(&strGsmOrigOrDestID, &strExpectedOriginatorID);
@@ -960,22 +2753,73 @@ void gsmInit() {
   bitGsmGprsHttpKeepAlive = 0;
   bitGsmGprsRestartFlag = 0;
   bitGSM_Ready = 0;
-  #ifdef gsm_async_uart_rx
-  bitGsmUartRxSync = 0;
-  #endif
+  wrdGsmUartRxRingHead = 0;
+  wrdGsmUartRxRingTail = 0;
+  wrdGsmUartRxLineStart = 0;
+  wrdGsmUartRxLinePos = 0;
+  bytGsmUartRxLinesHead = 0;
+  bytGsmUartRxLinesTail = 0;
+  bytGsmUartRxLinesReady = 0;
+  wrdGsmUartRxRawLeft = 0;
+  pstrGsmUartRxRawHeader = 0;
+  bitGsmUartRxRawHalt = 0;
   bitGsmUartRxReset = 0;
+  #ifdef gsm_uart_hw_flow_ctl
+  bitGsmUartRxRtsOff = 0;
+  pGsm->Pins.RtsPort->BRR = pGsm->Pins.RtsPin; // Ready to receive
+  #endif
+  bitGsmCallRinging = 0;
+  bitGsmCallIdReported = 0;
+  bytGsmSetupBatchCount = 0;
+  bitGsmSetupBatchFailed = 0;
+  #ifdef gsm_uart_baud_high
+  bitGsmUartBaudFailed = 0;
+  #endif
   #ifdef gsm_debug_state
   bitGsmUartRxCharsLost = 0;
   bitGsmUartRxBuffCleared = 0;
+  bitGsmUartRxLineDiscarded = 0;
+  #endif
+  #ifdef gsm_poll_budget
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; // Enable the cycle counter
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  dwdGsmPollCyclesMax = 0;
+  #endif
+  if (!scan) {
+    pGsm->pNext = pGsmFirst; // Interrupts are handled from here on
+    pGsmFirst = pGsm;
+  }
+  #ifdef gsm_dma_uart_rx
+  if (uart->RxState == HAL_UART_STATE_READY) { // (not started yet)
+    gsmUartRxDmaStart();
+  }
   #endif
+  gsmCtxLeave();
 }
 
-void gsmPoll() {
+void gsmInit() {
+  // Sets up the default instance (UartGSMHandle and the pins in GSM.h)
+  gsmInstanceInit(&GsmContextDefault, &UartGSMHandle, &GsmPinsDefault);
+}
+
+#ifdef gsm_poll_budget
+#define cGsmUartRxPollMax 16 // Characters read per gsmPoll() (polled reception)
+#endif
+
+static void gsmPollStep() {
   char handled = 0;
+  char stateNext;
+  char idx;
+  #ifdef gsm_poll_budget
+  char count = 0;
+  #endif
+  #ifdef gsm_tickless
+  gsmTimersAdvance();
+  #endif
   /*while (UART_Data_Ready()) {
     gsmUartRx();
   }*/
-  #ifndef gsm_async_uart_rx
+  #if !defined(gsm_async_uart_rx) && !defined(gsm_dma_uart_rx)
   // The below check should be done externally
   // Only if not using mikroE UART_Read routines
   // (mikroE UART_Read routine does it automatically)
@@ -988,13 +2832,33 @@ void gsmPoll() {
   }*/
   //if (UART_Data_Ready()) {gsmUartRx();}
   //if (UART_Data_Ready()) {gsmUartRx();}
-  while (UART_Data_Ready()) {gsmUartRx();}
+  #ifdef gsm_poll_budget
+  while ((count < cGsmUartRxPollMax) && UART_Data_Ready()) {
+    gsmUartRx(pGsm);
+    count++;
+  }
+  #else
+  while (UART_Data_Ready()) {gsmUartRx(pGsm);}
   #endif
-  if (bitGsmUartRxReset) {
+  #endif
+  #ifdef gsm_dma_uart_rx
+  if (bitGsmUartRxDmaRestart) {
     gsmUartRxBuffClear();
-    //bytGsmUartRxQuietTimer = 0;
-    bitGsmUartRxReset = 0;
+    gsmUartRxDmaStart();
+    #ifdef gsm_debug_state
+    bitGsmUartRxCharsLost = 1;
+    #endif
   }
+  #endif
+  gsmUartRxFrame(); // Frame the next lines from the received characters
+  #ifdef gsm_uart_hw_flow_ctl
+  gsmUartRxRtsCheckEmpty(); // Let the module send again (if it was stopped)
+  #endif
+  if (bitGsmUartRxReset) {
+    gsmUartRxLineGap(); // Discard the partial line (if framing is complete)
+  }
+  gsmUrcDispatch(); // Handle unsolicited result codes, whatever the state
+  gsmRequestsExpire(); // Drop the requests which have passed their deadline
   #ifdef gsm_debug_state
   if (bitGsmUartRxCharsLost) {
     strcpy(gsmDebugStateStrPtr, "UART Rx Chars Lost\r\n");
@@ -1006,12 +2870,19 @@ void gsmPoll() {
     gsmDebugStateStrReady();    
     bitGsmUartRxBuffCleared = 0;  
   }
+  if (bitGsmUartRxLineDiscarded) {
+    strcpy(gsmDebugStateStrPtr, "UART Rx Partial Line Discarded\r\n");
+    gsmDebugStateStrReady();
+    bitGsmUartRxLineDiscarded = 0;
+  }
   #endif  
   #ifndef gsm_blocking_uart_tx
-  // Transmit any qued UART communication until there is none left
-  if (gsmUartTx()) {return;}  
+  // Transmit qued UART communication (it carries on in the background while
+  // the states are processed)
+  gsmUartTx();
   #endif
   // Process the current state
+  handled = gsmStateDefRun(); // Table-driven states first
   if (!handled && p_gsm_MS_ProcessState) {
     handled = p_gsm_MS_ProcessState(0);
   }
@@ -1029,7 +2900,7 @@ void gsmPoll() {
         // Entry from: any
         // Exit to: (bytGsmStateAfterDelay)
         // Associated routine: gsmSetStateDelay
-        if (wrdGsmDelayTmr >= wrdGsmDelayTime) {
+        if ((wrdGsmDelayTmr >= wrdGsmDelayTime) && gsmUartTxComplete()) {
           #ifdef gsm_debug_state
           strcpy(gsmDebugStateStrPtr, "Delay complete\r\n");
           gsmDebugStateStrReady();
@@ -1041,107 +2912,38 @@ void gsmPoll() {
       case gsmstGetDateTimePre:
         // Entry from: (diversion)
         // Exit to: gsmstGetDateTimeQuery
-        bytGsmGPCtr = 0; // Reset the general-purpose counter
+        gsmStateDefRestart();
         gsmSetStateNext(gsmstGetDateTimeQuery, 0);
         break;
-      case gsmstGetDateTimeQuery:
-        // -- Get date/time from the GSM module --
-        // Entry from: gsmstGetDateTimePre, (timeout set by gsmstGetDateTimeQuery)
-        // Exit to: gsmstGetDateTimeResponse, (return from diversion)
-        gsmUartRxLineClear(); // Make sure new UART data will be received
-        if (bytGsmGPCtr < 3) { // If we have been trying this for less than
-                            // 3 times then
-          gsmUART_Write_Text((char *)strAT);      // Request date/time
-          gsmUART_Write_Text((char *)strCCLK);    // from the GSM module
-          gsmUART_Write('?');
-          gsmUART_Write_Text((char *)strNewLine);
-          gsmSetStateNext(gsmstGetDateTimeResponse, 0); // then wait for a response
-          gsmSetStateTimeout(500, gsmstGetDateTimeQuery); // for 500ms before asking
-                                                       // again
-        } else { // Otherwise (trying this for more than 3 times)
-          gsmCancelStateTimeout(); // Cancel timeout (if applicable)
-          gsmSetStateNext(bytGsmStateAfterDivert, 0); // Give up and carry on
-          //bitGsmDateTimeReadPending = 0;
-        }
-        bytGsmGPCtr++;
-        break;
-      case gsmstGetDateTimeResponse:
-        // -- Interpret response to date/time request --
-        // Entry from: gsmstGetDateTimeQuery
-        // Exit to: (return from diversion (after OK)), gsmstGetDateTimeQuery
-        // Timeout to: gsmstGetDateTimeQuery
-        if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
-          wrdGsmTimeoutTmr = 0; //Reset timeout timer
-          if (memcmp(&strGsmUartRxBuff, &strCCLK, 5) == 0) { // If it's the type
-                                                          // of communication
-                                                          // we're looking for
-                                                          // then
-            gsmCancelStateTimeout(); //Cancel timeout
-            gsmExtractDateTime(&strGsmUartRxBuff[6]); //Extract date/time
-            //if (dtmGsmEvent.Year > 10 && dtmGsmEvent.Month <= 12 && dtmGsmEvent.Day <= 31 &&
-            //    dtmGsmEvent.Hour <= 24 && dtmGsmEvent.Minute <= 60 && dtmGsmEvent.Second <= 60) {
-              // If the date/time extracted seem ok
-              gsmEvent(gsmevntDateTimeRead); // Call the external routine
-              bitGsmDateTimeReadPending = 0;
-              // Proceed to next gsmst after "OK"
-              gsmSetStateWaitOK(bytGsmStateAfterDivert, 250, bytGsmStateAfterDivert);
-            //} else { // Otherwise
-            //  // Try again
-            //  //gsmSetStateNext(gsmstGetDateTimeQuery, 0);
-            //  //gsmSetStateDelay(50, gsmstGetDateTimeQuery);
-            //  gsmSetStateWaitOK(gsmstGetDateTimeQuery, 50, gsmstGetDateTimeQuery);
-            //  // (delay / wait for ok to allow the GSM module to finish it's transmission)
-            //}
-          }
-          gsmUartRxLineProcessed(); // Allow the next line of comms to be received
-        }
-        break;
       // --- End of GetDateTime Diversion ---
       // --- SetDateTime Diversion ---
       case gsmstSetDateTimePre:
         // Entry from: (diversion)
         // Exit to: gsmstSetDateTime
-        bytGsmGPCtr = 0; // Reset the general-purpose counter
+        gsmStateDefRestart();
         gsmSetStateNext(gsmstSetDateTime, 0);
         break;
-      case gsmstSetDateTime:
-        // Entry from: gsmstSetDateTimePre
-        // Exit to: (return from diversion), gsmstSetDateTime
-        if (bytGsmGPCtr < 3) { // If we have been trying this for less than
-                            // 3 times then
-          gsmEvent(gsmevntDateTimeWrite); // Request the date/time to read
-          // Build the command string
-          pstrGsmGP = &strGsmGP[0];
-          gsmRTCC_GenerateDigits(dtmGsmEvent.Year, pstrGsmGP, '/');
-          pstrGsmGP += 3;
-          gsmRTCC_GenerateDigits(dtmGsmEvent.Month, pstrGsmGP, '/');
-          pstrGsmGP += 3;
-          gsmRTCC_GenerateDigits(dtmGsmEvent.Day, pstrGsmGP, ',');
-          pstrGsmGP += 3;
-          gsmRTCC_GenerateDigits(dtmGsmEvent.Hour, pstrGsmGP, ':');
-          pstrGsmGP += 3;
-          gsmRTCC_GenerateDigits(dtmGsmEvent.Minute, pstrGsmGP, ':');
-          pstrGsmGP += 3;
-          gsmRTCC_GenerateDigits(dtmGsmEvent.Second, pstrGsmGP, '+');
-          pstrGsmGP += 3;
-          strcpy(pstrGsmGP, "00"); // Ignoring time-zone
-          pstrGsmGP += 3;
-          *pstrGsmGP = 0; // Mark end of string
-          // Send the command
-          gsmUART_Write_Text((char *)strAT);
-          gsmUART_Write_Text((char *)strCCLK);
-          gsmUART_Write('=');
-          gsmUART_Write('"');
-          gsmUART_Write_Text((char *)strGsmGP);
-          gsmUART_Write('"');
-          gsmUART_Write_Text((char *)strNewLine);
-          gsmSetStateWaitOK(bytGsmStateAfterDivert, 250, gsmstSetDateTime);
-          bitGsmDateTimeWritePending = 0;
-        } else {
-          bitGsmDateTimeWritePending = 1;
-          gsmSetStateNext(bytGsmStateAfterDivert, 0); // Give up and carry on
+      case gsmstSetDateTimeDone:
+        // Entry from: gsmstSetDateTime (after "OK")
+        // Exit to: (return from diversion)
+        gsmRequestsFinish(gsmreqDateTimeWrite, gsmresOK); // (only once written)
+        gsmSetStateNext(bytGsmStateAfterDivert, 0);
+        break;
+      case gsmstSetDateTimeFail:
+        // Entry from: gsmstSetDateTime ("ERROR" or no "OK")
+        // Exit to: (return from diversion)
+        idx = gsmRequestFind(gsmreqDateTimeWrite);
+        if (idx) {
+          GsmRequests[idx - 1].Tries++;
+          if (GsmRequests[idx - 1].Tries < 3) {
+            // Give up for now and carry on (the request is qued again,
+            // behind the others, to be tried later)
+            gsmRequestRequeue(idx - 1);
+          } else {
+            gsmRequestsFinish(gsmreqDateTimeWrite, gsmresFailed);
+          }
         }
-        bytGsmGPCtr++;
+        gsmSetStateNext(bytGsmStateAfterDivert, 0);
         break;
       // --- End of SetDateTime Diversion ---
       case gsmstPwrGsmOffPre:
@@ -1151,10 +2953,10 @@ void gsmPoll() {
         // Exit to: gsmstPwrGsmOff
         bytGsmGPCtr = 0;
         #ifdef gsm_reset_en
-        if (GSM_Reset->IDR & GSM_Reset_Pin) == GPIO_PIN_SET)) {
+        if (pGsm->Pins.ResetPort->IDR & pGsm->Pins.ResetPin) == GPIO_PIN_SET)) {
           // Reset pin was activated (see gsmstPwringGsmOff),
           // deactivate it and then wait for the reset to be handled by the module
-          GSM_Reset->BRR = GSM_Reset_Pin;
+          pGsm->Pins.ResetPort->BRR = pGsm->Pins.ResetPin;
           gsmSetStateDelay(1000, gsmstPwrGsmOff);
         } else
         #endif
@@ -1166,9 +2968,9 @@ void gsmPoll() {
         // -- Check if GSM module is powered off / start power-off procedure --
         // Entry from: gsmstPwrGsmOffPre, gsmstPwringGsmOff
         // Exit to: gsmstPwrGsmOn
-        if ((bit)(GSM_Stat->IDR & GSM_Stat_Pin) == bitGSM_Stat_On_State) { // If the GSM module is on then
+        if ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) == bitGSM_Stat_On_State) { // If the GSM module is on then
           bitExpectGSM_On = 0;
-          GSM_Pwr_Key->BSRR = GSM_Pwr_Key_Pin; // "Press" the Pwr_Key button
+          pGsm->Pins.PwrKeyPort->BSRR = pGsm->Pins.PwrKeyPin; // "Press" the Pwr_Key button
           dwdGsmGPTmr = 0;
           bitGsmGPFlag = 0;
           //gsmSetStateDelay(1500, gsmstPwringGsmOff); // for at least 1 second,
@@ -1188,11 +2990,11 @@ void gsmPoll() {
         // Entry from: gsmstPwrGsmOff
         // Exit to: gsmstPwrGsmOff
         // (After delay)
-        if ((GSM_Pwr_Key->IDR & GSM_Pwr_Key_Pin) == GPIO_PIN_SET) { // If the Pwr_Key button is "pressed" then
-          if ((bitGsmGPFlag && ((bit)(GSM_Stat->IDR & GSM_Stat_Pin) != bitGSM_Stat_On_State) && (wrdGsmGPTmr > 100)) || (dwdGsmGPTmr > 1500)) {
-            GSM_Pwr_Key->BRR = GSM_Pwr_Key_Pin; // "Release" the Pwr_Key button
+        if ((pGsm->Pins.PwrKeyPort->IDR & pGsm->Pins.PwrKeyPin) == GPIO_PIN_SET) { // If the Pwr_Key button is "pressed" then
+          if ((bitGsmGPFlag && ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) != bitGSM_Stat_On_State) && (wrdGsmGPTmr > 100)) || (dwdGsmGPTmr > 1500)) {
+            pGsm->Pins.PwrKeyPort->BRR = pGsm->Pins.PwrKeyPin; // "Release" the Pwr_Key button
             dwdGsmGPTmr = 0; // Reset the general-purpose timer (integer type)
-          } else if ((bit)(GSM_Stat->IDR & GSM_Stat_Pin) != bitGSM_Stat_On_State) {
+          } else if ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) != bitGSM_Stat_On_State) {
             if (!bitGsmGPFlag) {
               bitGsmGPFlag = 1;
               wrdGsmGPTmr = 0;
@@ -1201,7 +3003,7 @@ void gsmPoll() {
             bitGsmGPFlag = 0;
           }
         } else { // If the Pwr_Key button has already been released then
-          if ((bit)(GSM_Stat->IDR & GSM_Stat_Pin) != bitGSM_Stat_On_State) { // If the module is now off then
+          if ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) != bitGSM_Stat_On_State) { // If the module is now off then
             gsmSetStateDelay(5000, gsmstPwrGsmOff); // give it 5 seconds to rest
                                                  // then go back to the
                                                  // "check" routine (which
@@ -1219,7 +3021,7 @@ void gsmPoll() {
               bytGsmGPCtr++;
             #ifdef gsm_reset_en
             } else { // Already tried powering off for 3 times, reset the module
-              GSM_Reset->BSRR = GSM_Reset_Pin;
+              pGsm->Pins.ResetPort->BSRR = pGsm->Pins.ResetPin;
               gsmSetStateDelay(500, gsmstPwrGsmOffPre);
             }
             #endif
@@ -1230,11 +3032,11 @@ void gsmPoll() {
         // -- Check if GSM module is powered on / start power-on procedure --
         // Entry from: (startup), gsmstPwrGsmOff, gsmstPwringGsmOn,
         //             (unexpected module power-off)
-        // Exit to: gsmstPwringGsmOn, gsmstIMEIPre
+        // Exit to: gsmstPwringGsmOn, gsmstBaudProbe / gsmstEchoOff
         if (bitGSM_PowerOff) {
           gsmSetStateNext(gsmstPwrGsmOff, 0);
-        } else if ((bit)(GSM_Stat->IDR & GSM_Stat_Pin) != bitGSM_Stat_On_State) { // If the GSM module is off
-          GSM_Pwr_Key->BSRR = GSM_Pwr_Key_Pin; // "Press" the Pwr_Key button
+        } else if ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) != bitGSM_Stat_On_State) { // If the GSM module is off
+          pGsm->Pins.PwrKeyPort->BSRR = pGsm->Pins.PwrKeyPin; // "Press" the Pwr_Key button
           gsmSetStateDelay(1000, gsmstPwringGsmOn); // for 1 second, then check if
                                                  // the module has turned on
         } else { // If the GSM module is already on then
@@ -1247,9 +3049,16 @@ void gsmPoll() {
           bitGsmGprsRestartFlag = 1;
           bitGsmGprsInProgress = 0; // Failsafe (shouldn't be necessary)
           bitGSM_Ready = 0;
+          gsmUrcCallEnded();
           dwdGsmGPTmr = 0; // Reset the general-purpose timer (long type)
           // skip to next step
-          gsmSetStateNext(gsmstIMEIPre, 1);
+          #ifdef gsm_uart_baud_high
+          dwdGsmUartBaudPrev = dwdGsmUartBaud;
+          bytGsmGPCtr = 0;
+          gsmSetStateNext(gsmstBaudProbe, 1);
+          #else
+          gsmSetStateNext(gsmstEchoOff, 1);
+          #endif
         }
         break;
       case gsmstPwringGsmOn:
@@ -1257,11 +3066,11 @@ void gsmPoll() {
         // Entry from: gsmstPwrGsmOn
         // Exit to: gsmstPwrGsmOn
         // (After delay)
-        if ((GSM_Pwr_Key->IDR & GSM_Pwr_Key_Pin) == GPIO_PIN_SET) { // If the Pwr_Key button is "pressed" then
-          GSM_Pwr_Key->BRR = GSM_Pwr_Key_Pin; // "Release" the Pwr_Key button
+        if ((pGsm->Pins.PwrKeyPort->IDR & pGsm->Pins.PwrKeyPin) == GPIO_PIN_SET) { // If the Pwr_Key button is "pressed" then
+          pGsm->Pins.PwrKeyPort->BRR = pGsm->Pins.PwrKeyPin; // "Release" the Pwr_Key button
           wrdGsmGPTmr = 0; // Reset the general-purpose timer (integer type)
         } else { // If the Pwr_Key button has already been released then
-          if ((bit)(GSM_Stat->IDR & GSM_Stat_Pin) == bitGSM_Stat_On_State) { // If the module is now on then
+          if ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) == bitGSM_Stat_On_State) { // If the module is now on then
             gsmSetStateDelay(10000, gsmstPwrGsmOn); // give it 10 seconds to
                                                  // stabilise before
                                                  // going back to the "check"
@@ -1276,104 +3085,105 @@ void gsmPoll() {
           }
         }
         break;
-      case gsmstIMEIPre:
-        // Entry from: gsmstPwrGsmOn
-        // Exit to: gsmstIMEIQuery
-        bytGsmGPCtr = 0; // Reset the general-purpose counter
-        gsmSetStateNext(gsmstIMEIQuery, 0);
-        break;
-      case gsmstIMEIQuery:
-        // Entry from: gsmstIMEIPre, (timeout set by gsmstIMEIQuery)
-        // Exit to: gsmstIMEIResponse, gsmstPinChkPre
-        gsmUartRxLineClear(); // Make sure new UART data will be received
-        if (bytGsmGPCtr < 3) { // If we have been trying this for less than
-                            // 3 times then
-          gsmUART_Write_Text((char *)strAT);      // Request IMEI
-          gsmUART_Write_Text("+CGSN");    // from the GSM module
-          gsmUART_Write_Text((char *)strNewLine);
-          gsmSetStateNext(gsmstIMEIResponse, 0); // then wait for a response
-          gsmSetStateTimeout(500, gsmstIMEIQuery); // for 500ms before asking
-                                                       // again
-        } else { // Otherwise (trying this for more than 3 times)
-          gsmCancelStateTimeout(); // Cancel timeout (if applicable)
-          gsmSetStateNext(gsmstPinChkPre, 0); // Give up and carry on
+      #ifdef gsm_uart_baud_high
+      case gsmstBaudProbe:
+        // -- Find the baud rate the module is running at --
+        // Entry from: gsmstPwrGsmOn, (timeout set by gsmstBaudProbe)
+        // Exit to: gsmstBaudSet (after gsmstWaitOK), gsmstEchoOff (not found)
+        if (!gsmUartTxComplete()) {
+          break; // The rate can only be changed once the UART Tx is idle
         }
-        bytGsmGPCtr++;
-        break;
-      case gsmstIMEIResponse:
-        // Entry from: gsmstIMEIQuery
-        // Exit to: gsmstPinChkPre, gsmstIMEIQuery
-        // Timeout to: gsmstIMEIQuery
-        if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
-          wrdGsmTimeoutTmr = 0; //Reset timeout timer
-          if (isnumeric((char *)strGsmUartRxBuff)) { // If it's numeric then
-            gsmCancelStateTimeout(); //Cancel timeout
-            pstrGsmEventData = (char *)strGsmUartRxBuff;
-            gsmEvent(gsmevntIMEI_Read); // Call the external routine
-            // Proceed to next gsmst after "OK"
-            gsmSetStateWaitOK(gsmstPinChkPre, 250, gsmstPinChkPre);
+        if (bytGsmGPCtr < 6) { // Each candidate rate is tried twice
+          gsmUartBaudSet(gsmUartBaudCandidate(bytGsmGPCtr >> 1));
+          if (!gsmCmdBegin()) {
+            break; // UART Tx busy, try again
           }
-          gsmUartRxLineProcessed(); // Allow the next line of comms to be received
+          gsmCmdText((char *)strAT);
+          gsmCmdCommit();
+          gsmSetStateWaitOK(gsmstBaudSet, 300, gsmstBaudProbe);
+          bytGsmGPCtr++;
+        } else {
+          gsmUartBaudSet(dwdGsmUartBaudPrev);
+          gsmSetStateNext(gsmstEchoOff, 1);
         }
         break;
-      case gsmstPinChkPre:
-        // Entry from: gsmstIMEIQuery, gsmstIMEIResponse
-        // Exit to: gsmstIMEIQuery
-        bytGsmGPCtr = 0; // Reset the general-purpose counter
-        gsmSetStateNext(gsmstPinChkQuery, 0);
+      case gsmstBaudSet:
+        // -- Move the module up to gsm_uart_baud_high --
+        // Entry from: gsmstBaudProbe (after gsmstWaitOK), gsmstBaudVerify,
+        //             gsmstBaudSave, gsmstBaudSaved,
+        //             (timeout set by gsmstBaudSet)
+        // Exit to: gsmstBaudSwitch (after gsmstWaitOK), gsmstEchoOff
+        if ((dwdGsmUartBaud == gsm_uart_baud_high) || bitGsmUartBaudFailed) {
+          gsmEvent(gsmevntUartBaud); // Working rate, to be saved
+          gsmSetStateNext(gsmstEchoOff, 1);
+        } else {
+          if (!gsmCmdBegin()) {
+            break; // UART Tx busy, try again
+          }
+          gsmCmdText("AT+IPR="); // Fixed rate (only saved in the module's
+          gsmCmdInt(gsm_uart_baud_high); // profile once verified)
+          gsmCmdCommit();
+          bitGsmUartBaudFailed = 1; // Unless the module accepts it
+          gsmSetStateWaitOK(gsmstBaudSwitch, 1000, gsmstBaudSet);
+        }
         break;
-      case gsmstPinChkQuery:
-        // Entry from: gsmstPinChkPre
-        // Exit to: gsmstPinChkResponse, gsmstPwrGsmOffPre
-        gsmUartRxLineClear(); // Make sure new UART data will be received
-        if (bytGsmGPCtr < 3) { // If we have been trying this for less than
-                            // 3 times then
-          gsmUART_Write_Text((char *)strAT);      // Request PIN status
-          gsmUART_Write_Text((char *)strCPIN);    // from the GSM module
-          gsmUART_Write('?');
-          gsmUART_Write_Text((char *)strNewLine);
-          gsmSetStateNext(gsmstPinChkResponse, 0); // then wait for a response
-          gsmSetStateTimeout(500, gsmstPinChkQuery); // for 500ms before asking
-                                                       // again
-        } else { // Otherwise (trying this for more than 3 times)
-          gsmCancelStateTimeout(); // Cancel timeout (if applicable)
-          gsmSetStateNext(gsmstPwrGsmOffPre, 0); // Restart the module
+      case gsmstBaudSwitch:
+        // Entry from: gsmstBaudSet (after gsmstWaitOK)
+        // Exit to: gsmstBaudVerify (after delay)
+        if (!gsmUartTxComplete()) {
+          break; // The rate can only be changed once the UART Tx is idle
         }
-        bytGsmGPCtr++;
+        bitGsmUartBaudFailed = 0;
+        dwdGsmUartBaudPrev = dwdGsmUartBaud;
+        gsmUartBaudSet(gsm_uart_baud_high);
+        bytGsmGPCtr = 0;
+        gsmSetStateDelay(100, gsmstBaudVerify);
         break;
-      case gsmstPinChkResponse:
-        // Entry from: gsmstPinChkQuery
-        // Exit to: gsmstSetup_MSHI, gsmstPinPre, gsmstPwrGsmOffPre
-        // Timeout to: gsmstPinChkQuery
-        if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
-          wrdGsmTimeoutTmr = 0; //Reset timeout timer
-          if (memcmp(&strGsmUartRxBuff, &strCPIN, 5) == 0) { // If it's the type
-                                                          // of communication
-                                                          // we're looking for
-                                                          // then
-            gsmCancelStateTimeout(); //Cancel timeout
-            if (memcmp(&strGsmUartRxBuff + 7, &strREADY, 5) == 0) {
-              // No PIN required
-              // Proceed to next gsmst after "OK"
-              gsmSetStateWaitOK(gsmstSetup_MSHI, 250, gsmstSetup_MSHI);
-            } else if (memcmp(&strGsmUartRxBuff + 11, "PIN", 3) == 0) {
-              // PIN must be entered
-              gsmSetStateWaitOK(gsmstPinPre, 250, gsmstPinPre); // Enter PIN
-            } else if (memcmp(&strGsmUartRxBuff + 11, "PUK", 3) == 0) {
-              // PUK required
-              // (User should remove the SIM card, unblock the PUK, and try again)
-              gsmSetStateWaitOK(gsmstPwrGsmOffPre, 250, gsmstPwrGsmOffPre);
-            } else {
-              // Unrecognised response
-              // Try again
-              gsmSetStateWaitOK(gsmstPinChkQuery, 250, gsmstPinChkQuery);
-            }
+      case gsmstBaudVerify:
+        // -- Check that the module answers at the new rate --
+        // Entry from: gsmstBaudSwitch, (timeout set by gsmstBaudVerify)
+        // Exit to: gsmstBaudSave (after gsmstWaitOK, gsmstBaudSet if already
+        //          saved), gsmstBaudSet (falling back to the previous rate)
+        if (!gsmUartTxComplete()) {
+          break; // The rate can only be changed once the UART Tx is idle
+        }
+        if (bytGsmGPCtr < 3) { // If we have tried this less than 3 times then
+          if (!gsmCmdBegin()) {
+            break; // UART Tx busy, try again
           }
-          gsmUartRxLineProcessed(); // Allow the next line of comms to be received
+          gsmCmdText((char *)strAT);
+          gsmCmdCommit();
+          gsmStateDefRestart(); // (gsmstBaudSave)
+          gsmSetStateWaitOK((dwdGsmUartBaudSaved == gsm_uart_baud_high) ?
+                            gsmstBaudSet : gsmstBaudSave, 300, gsmstBaudVerify);
+          bytGsmGPCtr++;
+        } else {
+          bitGsmUartBaudFailed = 1;
+          gsmUartBaudSet(dwdGsmUartBaudPrev); // Fall back (the module still
+          gsmSetStateNext(gsmstBaudSet, 0);   // has its saved rate)
         }
         break;
+      case gsmstBaudSaved:
+        // Entry from: gsmstBaudSave (table-driven, AT&W)
+        // Exit to: gsmstBaudSet
+        dwdGsmUartBaudSaved = dwdGsmUartBaud; // Where the module restarts
+        gsmSetStateNext(gsmstBaudSet, 0);
+        break;
+      #endif
+      case gsmstIMEIPre:
+        // Entry from: gsmstEchoOff, gsmstFlowCtl
+        // Exit to: gsmstIMEIQuery
+        gsmStateDefRestart();
+        gsmSetStateNext(gsmstIMEIQuery, 0);
+        break;
+      case gsmstPinChkPre:
+        // Entry from: gsmstIMEIQuery
+        // Exit to: gsmstPinChkQuery
+        gsmStateDefRestart();
+        gsmSetStateNext(gsmstPinChkQuery, 0);
+        break;
       case gsmstPinPre:
-        // Entry from: gsmstPinChkResponse
+        // Entry from: gsmstPinChkQuery
         // Exit to: gsmstIMEIQuery
         bytGsmGPCtr = 0; // Reset the general-purpose counter
         gsmSetStateNext(gsmstPinCmd, 0);
@@ -1384,14 +3194,17 @@ void gsmPoll() {
         gsmUartRxLineClear(); // Make sure new UART data will be received
         if (bytGsmGPCtr < 3) { // If we have been trying this for less than
                             // 3 times then
+          if (!gsmCmdBegin()) {
+            break; // UART Tx busy, try again
+          }
           strGsmGP[0] = 0;
           pstrGsmEventData = (char *)strGsmGP;
           gsmEvent(gsmevntPIN_Request);    // Event to request PIN
-          gsmUART_Write_Text((char *)strAT);      // Enter
-          gsmUART_Write_Text((char *)strCPIN);    // PIN
-          gsmUART_Write('=');
-          gsmUART_Write_Text(pstrGsmEventData);
-          gsmUART_Write_Text((char *)strNewLine);
+          gsmCmdText((char *)strAT);      // Enter
+          gsmCmdText((char *)strCPIN);    // PIN
+          gsmCmdChar('=');
+          gsmCmdText(pstrGsmEventData);
+          gsmCmdCommit();
           gsmSetStateNext(gsmstPinResponse, 0); // then wait for a response
           gsmSetStateTimeout(2500, gsmstPinCmd); // for 2500ms before trying
                                                        // again
@@ -1407,13 +3220,14 @@ void gsmPoll() {
         // Timeout to: gsmstPinCmd
         if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
           wrdGsmTimeoutTmr = 0; //Reset timeout timer
-          if (memcmp(&strGsmUartRxBuff, &strOK, 2) == 0) {
+          if (bytGsmUartRxLineRsp == gsmrspOK) {
             // PIN OK
             gsmCancelStateTimeout(); //Cancel timeout
             //gsmSetStateNext(gsmstSetup_MSHI, 1);
             gsmSetStateDelay(5000, gsmstSetup_MSHI); // Give SIM time to initialise
             gsmSetStateNext(gsmstDelay, 1); // Allow divert
-          } else if (memcmp(&strGsmUartRxBuff, &strERROR, 5) == 0) {
+          } else if ((bytGsmUartRxLineRsp == gsmrspERROR) ||
+                     (bytGsmUartRxLineRsp == gsmrspCME_ERROR)) {
             // PIN incorrect
             gsmCancelStateTimeout(); //Cancel timeout
             gsmEvent(gsmevntPIN_Fail); // Event to notify pin fail
@@ -1424,32 +3238,31 @@ void gsmPoll() {
         break;
       case gsmstSetup_MSHI:
         // * Module-specific code hook in *
-        // Entry from: gsmstPinChkResponse, gsmstPinResponse
+        // Entry from: gsmstPinChkQuery, gsmstPinResponse
         // Exit to: gsmstSetup_MSHO
         gsmSetStateNext(gsmstSetup_MSHO, 1);
         break;
       case gsmstSetup_MSHO:
         // * Module-specific code hook out *
         // Entry from: gsmstSetup_MSHI
-        // Exit to: gsmstEnableCLIP
+        // Exit to: gsmstSetupBatch, gsmstEnableCLIP
+        #ifdef gsm_setup_batch
+        if (!bitGsmSetupBatchFailed) {
+          gsmSetStateNext(gsmstSetupBatch, 1);
+          break;
+        }
+        #endif
         gsmSetStateNext(gsmstEnableCLIP, 1);
         break;
-      case gsmstEnableCLIP:
-        // -- Turn on CLIP (Caller Line Identity Presentation) --
-        // Entry from: gsmstSetup_MSHO,
-        //             (timeout set by gsmstEnableCLIP)
-        // Exit to: gsmstSetMsgFrmtToTxt (after gsmstWaitOK)
-        strcpy((char *)strGsmGP, (char *)strAT); // Send the command to turn CLIP on
-        strcpy((char *)strGsmGP +2, (char *)strCLIP);
-        strcpy((char *)strGsmGP +7, (char *)strSetOn);
-        gsmSetStateCmdOK((char *)strGsmGP, gsmstSetMsgFrmtToTxt, 0);
-        break;
-      case gsmstSetMsgFrmtToTxt:
-        // -- Set SMS format to text mode --
-        // Entry from: gsmstEnableCLIP, (timeout set by gsmstSetMsgFrmtToTxt)
-        // Exit to: gsmstSetMsgAlertOn (after gsmstWaitOK)
-        gsmSetStateCmdOK("AT+CMGF=1", gsmstSetMsgAlertOnPre, 0); // Set SMS format to text mode
+      #ifdef gsm_setup_batch
+      case gsmstSetupBatchFail:
+        // Entry from: gsmstSetupBatch (table: "ERROR", no "OK" or too long)
+        // Exit to: gsmstSetup_MSHI (one command at a time)
+        bitGsmSetupBatchFailed = 1;
+        bytGsmSetupBatchCount = 0;
+        gsmSetStateNext(gsmstSetup_MSHI, 1);
         break;
+      #endif
       case gsmstSetMsgAlertOnPre:
         // Entry from: gsmstSetMsgFrmtToTxt
         // Exit to: gsmstSetMsgAlertOn
@@ -1476,9 +3289,10 @@ void gsmPoll() {
         break;
       case gsmstWaitRegPre:
         // Entry from: gsmstSetMsgAlertOn, gsmstStandby, gsmstDeleteMsg,
-        //             gsmstWriteMsgAbortWtngOK, any
+        //             gsmstWriteMsgAbortWtngOK, gsmstFlow, any
         // Exit to: gsmstWaitRegQuery
         dwdGsmGPTmr = 0; // Reset the general-purpose timer (long type)
+        gsmStateDefRestart();
         gsmSetStateNext(gsmstWaitRegQuery, 0);
         if (bytGsmStateAfterReg == 0) {
           bytGsmStateAfterReg = gsmstStandbyPre;
@@ -1486,98 +3300,58 @@ void gsmPoll() {
           //bytGsmStateAfterReg = gsmstReadMsgRequest;
         }
         break;
-      case gsmstWaitRegQuery:
-        // -- Request network registration status --
-        // Entry from: gsmstWaitRegPre, (timeout set by gsmstWaitRegQuery)
-        // Exit to: gsmstWaitRegResponse, gsmstPwrGsmOffPre
-        gsmUartRxLineClear(); // Make sure new UART data will be received
-        if (dwdGsmGPTmr < 60000) { // If we have been trying this for less than a
-                                // minute then
-          gsmUART_Write_Text((char *)strAT);     // Request network registration
-          gsmUART_Write_Text((char *)strCREG);   // status from the GSM module
-          gsmUART_Write('?');
-          gsmUART_Write_Text((char *)strNewLine);
-          gsmSetStateNext(gsmstWaitRegResponse, 0); // then wait for a response
-          gsmSetStateTimeout(500, gsmstWaitRegQuery); // for 500ms before asking
-                                                   // again
-        } else { // Otherwise (trying this for longer than a minute)
-          gsmCancelStateTimeout(); // Cancel timeout (if applicable)
-          gsmSetStateNext(gsmstPwrGsmOffPre, 0); // Restart the module
-        }
-        break;
-      case gsmstWaitRegResponse:
-        // -- Process response to network registration status request --
-        // Entry from: gsmstWaitRegQuery
-        // Exit to: (bytGsmStateAfterReg) - gsmstStandbyPre by default,
-        //          gsmstWaitRegQuery
-        // Timeout to: gsmstWaitRegQuery
-        if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
-          wrdGsmTimeoutTmr = 0; //Reset timeout timer
-          if (memcmp(&strGsmUartRxBuff, &strCREG, 5) == 0) { // If it's the type
-                                                        // of communication
-                                                        // we're looking for
-                                                        // then
-            gsmCancelStateTimeout(); //Cancel timeout
-            if ((*((char *)strGsmUartRxBuff + 9) == '1') ||
-                (*((char *)strGsmUartRxBuff + 9) == '5')) {
-              // If registered then proceed to next gsmst, after "OK"
-              gsmSetStateWaitOK(bytGsmStateAfterReg, 250, bytGsmStateAfterReg);
-              bytGsmStateAfterReg = 0; // Reset to default
-              bitGSM_Ready = 1;
-            } else { // If not registered then
-              gsmSetStateDelay(5000, gsmstWaitRegQuery); // wait 5 seconds before
-                                                      // checking again
-              bitGSM_Ready = 0;
-            }
-          }
-          gsmUartRxLineProcessed(); // Allow the next line of comms to be received
-        }
-        break;
       case gsmstStandbyPre:
-        // Entry from: gsmstWaitingCLIP, (timeout set by gsmstStandby),
-        //             (timeout set by gsmstWaitingCLIP), gsmstSendMsg,
-        //             gsmstWaitingNO_CARRIER, gsmstReadMsgHeader
+        // Entry from: gsmstSendMsg, gsmstWaitingNO_CARRIER, gsmstReadMsgHeader
         //             (timeout set by gsmstReadMsgRequest),
         //             (timeout set by gsmstReadMsgHeader),
         //             gsmstReadMsgWaitingBlank, gsmstReadMsgWaitingOK,
-        //             gsmstWaitRegResponse
-        // Exit to: gsmstStandby
+        //             gsmstWaitRegQuery, gsmstMsgHook, gsmstGPRS_Hook,
+        //             gsmstFlow
+        // Exit to: gsmstStandby, gsmstMsgHook, gsmstGPRS_Hook (next job qued)
         wrdGsmGPTmr = 0;
         dwdGsmGPTmr = 0;
         bitGsmMsgJustArrived = 0;
         bitGsmGprsInProgress = 0; // Failsafe (shouldn't be necessary)
+        bytGsmRequestPriority = gsmprioIdle;
+        gsmRequestDone(gsmresEnded); // (if the module has not reported it)
+        if (!bitGsmCallRinging && !gsmMsgPending() && !bitGsmGprsPending) {
+          // Run the next job straight away (without going through standby)
+          stateNext = gsmRequestStart();
+          if (stateNext) {
+            gsmSetStateNext(stateNext, 1);
+            break;
+          }
+        }
         gsmSetStateNext(gsmstStandby, 0);
         break;
       case gsmstStandby:
         // -- Wait for activity --
         // Entry from: gsmstStandbyPre
-        // Exit to: gsmstWaitingCLIP, gsmstReadMsgRequest, gsmstWriteMsgPre,
-        //          gsmstSendMsgPre, gsmstDeleteMsgPre, gsmstWaitRegPre
+        // Exit to: gsmstWaitingNO_CARRIER, gsmstMsgHook, gsmstGPRS_Hook,
+        //          gsmstWaitRegPre, gsmstFlow
         // Note that the order of the items in the if .. else if block
         // is important
-        if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
+        // RING, +CLIP and +CMTI are handled by gsmUrcDispatch()
+        if (bitGsmCallRinging) { // Incoming call
+          gsmSetStateNext(gsmstWaitingNO_CARRIER, 0); // Wait for end of call
+        } else if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
           dwdGsmGPTmr = 0; // Reset the general-purpose timer (long type)
-          if (strcmp((char *)strGsmUartRxBuff, (char *)strRING) == 0) { // If "RING" was received
-            gsmSetStateNext(gsmstWaitingCLIP, 0); // Check for caller ID
-            gsmSetStateTimeout(500, gsmstStandbyPre); // for up to 500ms, before
-                                                   // coming back to standby
-          } else if (memcmp(&strGsmUartRxBuff, &strCMTI, 5) == 0) { // If msg arrvd
-            if (!gsmMsgPending()) {
-              bitGsmMsgJustArrived = 1;
-              bitGsmMsgReadPending = 1;
-              gsmSetStateNext(gsmstMsgHook, 0); // Read the message
-            }
-          }
-          gsmUartRxLineProcessed(); // Allow new comms to be received
+          gsmUartRxLineProcessed(); // Not expected here, discard it
         } else if (gsmMsgPending()) {
-          // Message (SMS) action pending
+          // Message (SMS) action pending (read / delete)
           gsmSetStateNext(gsmstMsgHook, 1);
         } else if (bitGsmGprsPending) {
           // GPRS
           gsmSetStateNext(gsmstGPRS_Hook, 1);
+        } else if ((stateNext = gsmRequestStart()) != 0) {
+          // Job (SMS, GPRS) qued
+          gsmSetStateNext(stateNext, 1);
         } else if (gsmCheckStateDivert()) {
           // Divert pending
           gsmSetStateNext(gsmstWaitRegPre, 1);
+        } else if (pGsmFlows) {
+          // Flows running
+          gsmSetStateNext(gsmstFlow, 1);
         } else if (dwdGsmGPTmr >= 60000) { // If there is no activity for more
                                         // than a minute then
           gsmSetStateNext(gsmstWaitRegPre, 1);   // Check that we're still registered
@@ -1588,48 +3362,33 @@ void gsmPoll() {
           wrdGsmGPTmr = 0;
         }*/
         break;
-      case gsmstWaitingCLIP:
-        // -- Check for CLIP --
+      case gsmstFlow:
+        // -- Run the flows (gsmFlowStart()) --
         // Entry from: gsmstStandby
-        // Exit to: gsmstWaitingNO_CARRIER
-        // Timeout to: gsmstStandbyPre
-        if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
-          if (memcmp(&strGsmUartRxBuff, &strCLIP, 5) == 0) { // If it's "+CLIP"
-            // Try to extract the caller ID
-            if (gsmExtractCallerId((char *)strGsmUartRxBuff, (char *)strGsmOrigOrDestID) == 1) {
-              #ifdef gsm_debug_state
-              strcpy(gsmDebugStateStrPtr, "Incoming call from ");
-              strcat(gsmDebugStateStrPtr, &strGsmOrigOrDestID);
-              strcat(gsmDebugStateStrPtr, &strNewLine);
-              gsmDebugStateStrReady();
-              #endif
-              gsmCancelStateTimeout();
-              /*// Check if the caller ID is what we expected
-              if (strcmp((char *)strGsmOrigOrDestID, (char *)strExpectedOriginatorID) == 0) {
-                LATD0_bit = !LATD0_bit; // Toggle PortD.0
-              }*/
-              pstrGsmEventOriginatorID = (char *)strGsmOrigOrDestID;
-              gsmEvent(gsmevntMissedCall); // Call the external routine
-              gsmSetStateNext(gsmstWaitingNO_CARRIER, 0); // Wait for end of call
-              gsmSetStateTimeout(5000, gsmstStandbyPre);
-            }
+        // Exit to: gsmstStandbyPre (no flows left, or other work pending
+        //          between flow commands), gsmstWaitRegPre (registration
+        //          check)
+        gsmFlowRunAll();
+        if (!pGsmFlows) {
+          gsmSetStateNext(gsmstStandbyPre, 1);
+        } else if (!pGsmFlowOwner) { // Not between a command and its response
+          if (bitGsmCallRinging || gsmMsgPending() || bitGsmGprsPending ||
+              gsmRequestNext(1) || gsmCheckStateDivert()) {
+            gsmSetStateNext(gsmstStandbyPre, 1); // (back here afterwards)
+          } else if (dwdGsmGPTmr >= 60000) {
+            gsmSetStateNext(gsmstWaitRegPre, 1); // Still registered?
           }
-          gsmUartRxLineProcessed(); // Allow new comms to be received
         }
         break;
       case gsmstWaitingNO_CARRIER:
         // -- Wait for ringing to end --
-        // Entry from: gsmstWaitingCLIP
+        // Entry from: gsmstStandby
         // Exit to: gsmstStandbyPre
-        // Timeout to: gsmstStandbyPre
-        if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
-          if (strcmp((char *)strGsmUartRxBuff, (char *)strRING) == 0) { // If still ringing
-            wrdGsmTimeoutTmr = 0; // Reset timeout
-          } else if (strcmp((char *)strGsmUartRxBuff, (char *)strNOCARRIER) == 0) {
-            // If "NO CARRIER" received then
-            gsmSetStateNext(gsmstStandbyPre, 1); // Go back to standby
-            gsmCancelStateTimeout(); // Cancel the timeout
-          }
+        // bitGsmCallRinging is cleared by gsmUrcDispatch() on "NO CARRIER",
+        // or if no RING is received for cGsmCallRingTimeout
+        if (!bitGsmCallRinging) {
+          gsmSetStateNext(gsmstStandbyPre, 1); // Go back to standby
+        } else if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
           gsmUartRxLineProcessed(); // Allow new comms to be received
         }
         break;
@@ -1639,6 +3398,7 @@ void gsmPoll() {
         // Exit to: gsmstStandbyPre
         if (bitGsmMsgWritePending) {
           gsmEvent(gsmevntMsgDiscarded); // Fail if the module does not hook in
+          gsmRequestDone(gsmresFailed);
         }
         bitGsmMsgWritePending = 0;
         bitGsmMsgReadPending = 0;
@@ -1651,6 +3411,7 @@ void gsmPoll() {
         // Entry from: gsmstStandby
         // Exit to: gsmstStandbyPre
         gsmEvent(gsmevntGprsFailed); // Fail if the module does not hook in
+        gsmRequestDone(gsmresFailed);
         bitGsmGprsPending = 0;
         gsmSetStateNext(gsmstStandbyPre, 1);
         break;
@@ -1660,7 +3421,7 @@ void gsmPoll() {
         // Exit to: (bytGsmStateAfterOK)
         // Timeout to: (bytGsmStateAfterTimeout)
         if (bitGsmUartRxLineReady) { // If a line of communication has been rcvd
-          if (strcmp((char *)strGsmUartRxBuff,(char *) strOK) == 0) { // If "OK" was received
+          if (bytGsmUartRxLineRsp == gsmrspOK) { // If "OK" was received
             gsmSetStateNext(bytGsmStateAfterOK, 0);
             gsmCancelStateTimeout(); // Cancel timeout (if applicable)
           }
@@ -1676,9 +3437,11 @@ void gsmPoll() {
         //if (dwdGsmGPTmr < 10000) { // If we have been trying this for less than
         //                           // 10 seconds then
         if (bytGsmCmdOKCtr < 3) { // If we have tried this less than 3 times then
-          //gsmUART_Write_Text((char *)strAT); // Send the command
-          gsmUART_Write_Text((char *)pstrGsmCommand);
-          gsmUART_Write_Text((char *)strNewLine);
+          if (!gsmCmdBegin()) {
+            break; // UART Tx busy, try again
+          }
+          gsmCmdText((char *)pstrGsmCommand); // Send the command
+          gsmCmdCommit();
           // then wait for a response for 1 second before trying again
           gsmSetStateWaitOK(bytGsmStateAfterOK, 1000, gsmstCmdOK);
           bytGsmCmdOKCtr++;
@@ -1704,7 +3467,7 @@ void gsmPoll() {
     } // End of state machine switch
   }
   // Restart if the GSM module is powered down
-  if (bitExpectGSM_On && ((bit)(GSM_Stat->IDR & GSM_Stat_Pin) != bitGSM_Stat_On_State)) {
+  if (bitExpectGSM_On && ((bit)(pGsm->Pins.StatPort->IDR & pGsm->Pins.StatPin) != bitGSM_Stat_On_State)) {
     if (bytGSM_StatTmr > 100) {
       bitExpectGSM_On = 0;
       gsmSetStateDelay(2500, gsmstPwrGsmOn);
@@ -1727,35 +3490,176 @@ void gsmPoll() {
   }
 }
 
+static void gsmPollRun() {
+  #ifdef gsm_poll_budget
+  unsigned long start;
+  start = DWT->CYCCNT;
+  gsmPollStep();
+  dwdGsmPollCycles = DWT->CYCCNT - start;
+  if (dwdGsmPollCycles > dwdGsmPollCyclesMax) {
+    dwdGsmPollCyclesMax = dwdGsmPollCycles;
+  }
+  #else
+  gsmPollStep();
+  #endif
+}
+
+void gsmInstancePoll(TGsmContext *ctx) {
+  gsmCtxEnter(ctx);
+  gsmPollRun();
+  gsmCtxLeave();
+}
+
+void gsmPoll() {
+  gsmInstancePoll(&GsmContextDefault);
+}
+
+unsigned long gsmInstanceNextDeadline(TGsmContext *ctx) {
+  // Returns the time (ms) until gsmInstancePoll() next has work to do, or 0
+  // if it has work to do now
+  // gsmInstancePoll() must also be called after any GSM UART / DMA interrupt
+  unsigned long deadline;
+  gsmCtxEnter(ctx);
+  deadline = gsmNextDeadlineRun();
+  gsmCtxLeave();
+  return deadline;
+}
+
+unsigned long gsmNextDeadline() {
+  return gsmInstanceNextDeadline(&GsmContextDefault);
+}
+
+#ifdef gsm_poll_budget
+char gsmInstancePollFor(TGsmContext *ctx, unsigned long max_us) {
+  // Calls gsmInstancePoll() while there is work to do, for up to max_us
+  // Returns 1 if there is still work to do (call again soon), 0 if not
+  unsigned long start;
+  unsigned long budget;
+  char more = 1;
+  gsmCtxEnter(ctx);
+  start = DWT->CYCCNT;
+  budget = max_us * (SystemCoreClock / 1000000);
+  do {
+    gsmPollRun();
+    if (gsmNextDeadlineRun()) {
+      more = 0;
+      break;
+    }
+  } while ((DWT->CYCCNT - start) + dwdGsmPollCyclesMax <= budget);
+  gsmCtxLeave();
+  return more;
+}
+
+char gsmPollFor(unsigned long max_us) {
+  return gsmInstancePollFor(&GsmContextDefault, max_us);
+}
+#endif
+
 void gsmPowerSetOnOff(char power_on) {
   if (power_on) { bitGSM_PowerOff = 0; } else { bitGSM_PowerOff = 1; }
 }
 
+void gsmInstancePowerSetOnOff(TGsmContext *ctx, char power_on) {
+  gsmCtxEnter(ctx);
+  gsmPowerSetOnOff(power_on);
+  gsmCtxLeave();
+}
+
+char gsmInstanceReady(TGsmContext *ctx) {
+  char ready;
+  gsmCtxEnter(ctx);
+  ready = gsmReady();
+  gsmCtxLeave();
+  return ready;
+}
+
+TGsmHandle gsmInstanceRequestSubmit(TGsmContext *ctx, char kind,
+                                    char priority, unsigned long timeout,
+                                    char *text, char *dest,
+                                    TGsmRequestDone done, void *user) {
+  TGsmHandle handle;
+  gsmCtxEnter(ctx);
+  handle = gsmRequestSubmit(kind, priority, timeout, text, dest, done, user);
+  gsmCtxLeave();
+  return handle;
+}
+
+char gsmInstanceRequestAbort(TGsmContext *ctx, TGsmHandle handle) {
+  char found;
+  gsmCtxEnter(ctx);
+  found = gsmRequestAbort(handle);
+  gsmCtxLeave();
+  return found;
+}
+
+char gsmInstanceRequestActive(TGsmContext *ctx, TGsmHandle handle) {
+  char active;
+  gsmCtxEnter(ctx);
+  active = gsmRequestActive(handle);
+  gsmCtxLeave();
+  return active;
+}
+
+char gsmInstanceFlowStart(TGsmContext *ctx, TGsmFlow *flow,
+                          char (*run)(TGsmFlow *flow)) {
+  char started;
+  gsmCtxEnter(ctx);
+  started = gsmFlowStart(flow, run);
+  gsmCtxLeave();
+  return started;
+}
+
+void gsmInstanceFlowAbort(TGsmContext *ctx, TGsmFlow *flow) {
+  gsmCtxEnter(ctx);
+  gsmFlowAbort(flow);
+  gsmCtxLeave();
+}
+
 char gsmReady() { // Indicates if the module is registered on the network
   //return bitGSM_Ready;
   if (bitGSM_Ready) { return 1; } else { return 0; }
 }
 
 void gsmDateTimeRead() {
-  bitGsmDateTimeReadPending = 1;
+  if (!gsmRequestFind(gsmreqDateTimeRead)) {
+    gsmRequestAdd(gsmreqDateTimeRead, gsmprioNormal, 0, 0, 0);
+  }
+}
+
+TGsmHandle gsmDateTimeReadEx(TGsmRequestDone done, void *user) {
+  // (date/time reads qued together are answered by the one read)
+  return gsmRequestSubmit(gsmreqDateTimeRead, gsmprioNormal, 0, 0, 0, done,
+                          user);
 }
 
 void gsmDateTimeWrite() {
-  bitGsmDateTimeWritePending = 1;
+  if (!gsmRequestFind(gsmreqDateTimeWrite)) {
+    gsmRequestAdd(gsmreqDateTimeWrite, gsmprioNormal, 0, 0, 0);
+  }
 }
 
 void gsmMsgSend(char *Message, char *DestinationID) {
-  pstrGsmMsgSendTxt = Message;
-  pstrGsmMsgSendNum = DestinationID;
-  bitGsmMsgWritePending = 1;
+  gsmMsgSendEx(Message, DestinationID, 0, 0);
+}
+
+TGsmHandle gsmMsgSendEx(char *Message, char *DestinationID,
+                        TGsmRequestDone done, void *user) {
+  TGsmHandle handle;
+  handle = gsmRequestSubmit(gsmreqMsgSend, gsmprioUrgent, 0, Message,
+                            DestinationID, done, user);
+  if (!handle) {
+    gsmEvent(gsmevntMsgDiscarded); // Queue full
+  }
+  return handle;
 }
 
 char gsmMsgSendPending() {
   //return bitGsmMsgWritePending;
-  if (bitGsmMsgWritePending) { return 1; } else { return 0; }
+  if (bitGsmMsgWritePending || gsmRequestFind(gsmreqMsgSend)) { return 1; } else { return 0; }
 }
 
 void gsmMsgSendCancel() {
+  gsmRequestCancel(gsmreqMsgSend);
   bitGsmMsgWritePending = 0;
 }
 
@@ -1765,37 +3669,106 @@ char gsmMsgJustArrived() {
 }
 
 char gsmGprsHttpGet(char* url) {
-  if (!bitGsmGprsInProgress) {
-    pstrGsmGprsURL = url;
-    wrdGsmGprsDataSize = 0;
-    bitGsmGprsPending = 1;
-    return 1;
-  } else {
-    return 0;
-  }
+  return gsmRequestAdd(gsmreqGprs, gsmprioBulk, 0, url, 0);
 }
 
 char gsmGprsHttpPost(char* url, char* postdata) {
-  if (!bitGsmGprsInProgress) {
-    pstrGsmGprsURL = url;
-    pstrGsmGprsData = postdata;
-    wrdGsmGprsDataSize = strlen(postdata);
-    bitGsmGprsPending = 1;
-    return 1;
-  } else {
-    return 0;
-  }
+  return gsmRequestAdd(gsmreqGprs, gsmprioBulk, 0, url, postdata);
+}
+
+TGsmHandle gsmGprsHttpGetEx(char *url, TGsmRequestDone done, void *user) {
+  return gsmRequestSubmit(gsmreqGprs, gsmprioBulk, 0, url, 0, done, user);
+}
+
+TGsmHandle gsmGprsHttpPostEx(char *url, char *postdata, TGsmRequestDone done,
+                             void *user) {
+  return gsmRequestSubmit(gsmreqGprs, gsmprioBulk, 0, url, postdata, done,
+                          user);
 }
 
 char gsmGprsPending() {
   //return bitGsmGprsPending;
-  if (bitGsmGprsPending || bitGsmGprsInProgress) { return 1; } else { return 0; }
+  if (bitGsmGprsPending || bitGsmGprsInProgress || gsmRequestFind(gsmreqGprs)) { return 1; } else { return 0; }
 }
 
 void gsmGprsCancel() {
+  gsmRequestCancel(gsmreqGprs);
   bitGsmGprsPending = 0;
 }
 
 void gsmGprsSetHttpKeepAlive(char keepalive) {
   if (keepalive) { bitGsmGprsHttpKeepAlive = 1; } else { bitGsmGprsHttpKeepAlive = 0; }
+}
+
+void gsmInstanceDateTimeRead(TGsmContext *ctx) {
+  gsmCtxEnter(ctx);
+  gsmDateTimeRead();
+  gsmCtxLeave();
+}
+
+void gsmInstanceDateTimeWrite(TGsmContext *ctx) {
+  gsmCtxEnter(ctx);
+  gsmDateTimeWrite();
+  gsmCtxLeave();
+}
+
+void gsmInstanceMsgSend(TGsmContext *ctx, char *Message,
+                        char *DestinationID) {
+  gsmCtxEnter(ctx);
+  gsmMsgSend(Message, DestinationID);
+  gsmCtxLeave();
+}
+
+char gsmInstanceGprsHttpGet(TGsmContext *ctx, char *url) {
+  char added;
+  gsmCtxEnter(ctx);
+  added = gsmGprsHttpGet(url);
+  gsmCtxLeave();
+  return added;
+}
+
+char gsmInstanceGprsHttpPost(TGsmContext *ctx, char *url, char *postdata) {
+  char added;
+  gsmCtxEnter(ctx);
+  added = gsmGprsHttpPost(url, postdata);
+  gsmCtxLeave();
+  return added;
+}
+
+TGsmHandle gsmInstanceDateTimeReadEx(TGsmContext *ctx, TGsmRequestDone done,
+                                     void *user) {
+  TGsmHandle handle;
+  gsmCtxEnter(ctx);
+  handle = gsmDateTimeReadEx(done, user);
+  gsmCtxLeave();
+  return handle;
+}
+
+TGsmHandle gsmInstanceMsgSendEx(TGsmContext *ctx, char *Message,
+                                char *DestinationID, TGsmRequestDone done,
+                                void *user) {
+  TGsmHandle handle;
+  gsmCtxEnter(ctx);
+  handle = gsmMsgSendEx(Message, DestinationID, done, user);
+  gsmCtxLeave();
+  return handle;
+}
+
+TGsmHandle gsmInstanceGprsHttpGetEx(TGsmContext *ctx, char *url,
+                                    TGsmRequestDone done, void *user) {
+  TGsmHandle handle;
+  gsmCtxEnter(ctx);
+  handle = gsmGprsHttpGetEx(url, done, user);
+  gsmCtxLeave();
+  return handle;
+}
+
+TGsmHandle gsmInstanceGprsHttpPostEx(TGsmContext *ctx, char *url,
+                                     char *postdata, TGsmRequestDone done,
+                                     void *user) {
+  TGsmHandle handle;
+  gsmCtxEnter(ctx);
+  handle = gsmGprsHttpPostEx(url, postdata, done, user);
+  gsmCtxLeave();
+  return handle;
 }
\ No newline at end of file
@@ -2,6 +2,31 @@
 #define __GSM_H
 //#define gsm_echo_int_rx // Enable echoing of communication with the GSM module to the external interface
 //#define gsm_debug_state // Enable outputting of state machine debug msgs
+#define gsm_dma_uart_rx // Receive from the GSM module using circular DMA
+                        // (new characters are published on UART idle line)
+#define gsm_dma_uart_tx // Transmit to the GSM module using DMA
+                        // (straight out of the UART Tx ring)
+//#define gsm_blocking_uart_tx //Remove for Non-blocking UART Tx
+//#define gsm_uart_hw_flow_ctl // RTS/CTS flow control with the GSM module
+                             // (CTS handled by the UART, RTS driven from the
+                             // fill level of the receive ring buffer)
+#define gsm_setup_batch // Send the setup commands as one command line
+                        // (one at a time if the module rejects it)
+#define gsm_uart_baud_high 115200 // Baud rate negotiated (AT+IPR) after
+                                  // power-on (stays at USART_GSM_BAUDRATE
+                                  // if not defined)
+#define gsm_uart_rx_line_gap 100 // Discard a partial line if no character is
+                                 // received for this long (ms, 1 - 254)
+//#define gsm_tickless // Timers advanced from gsm_tick() by gsmPoll(), rather
+                     // than by gsm1msPing() every ms (see gsmNextDeadline())
+#define gsm_tick() HAL_GetTick() // Monotonic ms timestamp (gsm_tickless)
+//#define gsm_poll_budget // gsmPollFor() and gsmPoll() duration measurement
+                        // (DWT cycle counter, enabled by gsmInit())
+//#define gsm_rtos // Run the library from a FreeRTOS task (GSM_RTOS.c), woken
+                 // by the GSM UART / DMA interrupts (use with gsm_tickless)
+//#define str_scan_swar // Scan 4 characters (one 32-bit word) at a time in
+                        // strScanChar(), rather than one at a time (no
+                        // faster in Host/bench_scan, measure before use)
 
 //#define gsm_reset_en
 
@@ -12,22 +37,23 @@
 
 #include "stm32l4xx_hal.h"
 #include "string.h"
+#ifdef gsm_rtos
+#include "FreeRTOS.h"
+#include "task.h"
+#endif
 
 #define GPIO_GSM_Pwr_Key_CLK_ENABLE()   __HAL_RCC_GPIOE_CLK_ENABLE()
 #define GSM_Pwr_Key_Port GPIOE
 #define GSM_Pwr_Key_Pin  GPIO_PIN_10 //this will use GPIOB Pin8 as the handler
-extern volatile GPIO_TypeDef *GSM_Pwr_Key;// = (GPIO_TypeDef *)(GSM_Pwr_Key_Port);
 
 #ifdef gsm_reset_en
 #define GPIO_GSM_Reset_CLK_ENABLE() __HAL_RCC_GPIOE_CLK_ENABLE()
 #define GSM_Reset_Port GPIOE
 #define GSM_Reset_Pin  GPIO_PIN_11 //this will use GPIOB Pin9 as the handler
-extern volatile GPIO_TypeDef *GSM_Reset;// = (GPIO_TypeDef *)(GSM_Reset_Port);
 #endif
 #define GPIO_GSM_Stat_CLK_ENABLE()   __HAL_RCC_GPIOE_CLK_ENABLE() // Indicates if the module is powered on
 #define GSM_Stat_Port GPIOE
 #define GSM_Stat_Pin  GPIO_PIN_12 //this will use GPIOB Pin7 as the handler
-extern volatile GPIO_TypeDef *GSM_Stat;// = (GPIO_TypeDef *)(GSM_Stat_Port);
 
 #define USART_GSM          UART4     
 #define USART_GSM_BAUDRATE 9600
@@ -45,94 +71,96 @@ extern UART_HandleTypeDef UartGSMHandle;
 #define USART_GSM_RX_GPIO_PORT              GPIOA
 #define USART_GSM_TX_AF                     GPIO_AF8_UART4
 #define USART_GSM_RX_AF                     GPIO_AF8_UART4
+#ifdef gsm_uart_hw_flow_ctl
+#define USART_GSM_CTS_GPIO_CLK_ENABLE()     __HAL_RCC_GPIOB_CLK_ENABLE()
+#define USART_GSM_CTS_PIN                   GPIO_PIN_7
+#define USART_GSM_CTS_GPIO_PORT             GPIOB
+#define USART_GSM_CTS_AF                    GPIO_AF8_UART4
+#define USART_GSM_RTS_GPIO_CLK_ENABLE()     __HAL_RCC_GPIOA_CLK_ENABLE()
+#define USART_GSM_RTS_PIN                   GPIO_PIN_15 // Plain output (active low)
+#define USART_GSM_RTS_GPIO_PORT             GPIOA
+#endif
+#define USART_GSM_IRQn                      UART4_IRQn
+#define USART_GSM_IRQHandler                UART4_IRQHandler
 
-#ifdef __GNUC__
-extern const char gsmevntDateTimeRead;
-extern const char gsmevntDateTimeWrite;
-extern const char gsmevntSignalQualityRead;
-extern const char gsmevntIMEI_Read;
-extern const char gsmevntPIN_Request;
-extern const char gsmevntPIN_Fail;
-extern const char gsmevntMissedCall;
-extern const char gsmevntMsgRcvd;
-extern const char gsmevntMsgDrafted;
-extern const char gsmevntMsgDiscarded;
-extern const char gsmevntMsgSent;
-extern const char gsmevntMsgSendFailed;
-extern const char gsmevntGprsFailed;
-extern const char gsmevntGprsHttpResultErr;
-extern const char gsmevntGprsHttpResponseLine;
-
-#ifndef struct_DateTime
-typedef struct DateTime {
-  char Year, Month, Day, Hour, Minute, Second;
-} TDateTime;
-#define struct_DateTime
+#if defined(gsm_dma_uart_rx) || defined(gsm_dma_uart_tx)
+#define USART_GSM_DMA_CLK_ENABLE()          __HAL_RCC_DMA2_CLK_ENABLE()
 #endif
-extern void gsmEvent(char GsmEventType);
-extern char* pstrGsmEventOriginatorID;
-extern char* pstrGsmEventData;
-extern TDateTime dtmGsmEvent;
 
-extern void gsmInit();
-extern void gsm1msPing();
-extern void gsmPoll();
-extern void gsmPowerSetOnOff(char power_on);
-extern char gsmReady();
-extern void gsmDateTimeRead();
-extern void gsmDateTimeWrite();
-extern void gsmMsgSend(char *Message, char *DestinationID);
-extern char gsmMsgSendPending();
-extern void gsmMsgSendCancel();
-extern char gsmMsgJustArrived();
-extern char gsmGprsHttpGet(char* url);
-extern char gsmGprsHttpPost(char* url, char* postdata);
-extern char gsmGprsPending();
-extern void gsmGprsCancel();
-extern void gsmGprsSetHttpKeepAlive(char keepalive);
+#ifdef gsm_dma_uart_rx
+#define USART_GSM_RX_DMA_CHANNEL            DMA2_Channel5
+#define USART_GSM_RX_DMA_REQUEST            DMA_REQUEST_2
+#define USART_GSM_RX_DMA_IRQn               DMA2_Channel5_IRQn
+#define USART_GSM_RX_DMA_IRQHandler         DMA2_Channel5_IRQHandler
 
-#ifdef gsm_debug_state
-extern char *gsmDebugStateStrPtr;
-extern void gsmDebugStateStrReady();
+extern DMA_HandleTypeDef hdmaGsmRx;
+extern void gsmUartRxDmaStart(void);
+extern void gsmUartRxPublish(UART_HandleTypeDef *uart);
+extern void gsmUartRxDmaError(UART_HandleTypeDef *uart);
+#endif
+
+#ifdef gsm_dma_uart_tx
+#define USART_GSM_TX_DMA_CHANNEL            DMA2_Channel3
+#define USART_GSM_TX_DMA_REQUEST            DMA_REQUEST_2
+#define USART_GSM_TX_DMA_IRQn               DMA2_Channel3_IRQn
+#define USART_GSM_TX_DMA_IRQHandler         DMA2_Channel3_IRQHandler
+
+typedef struct GsmUartTxSeg {
+  char *Data;
+  unsigned int Length; // 0 if Data is a null-terminated string
+} TGsmUartTxSeg;
+struct GsmContext;
+
+extern DMA_HandleTypeDef hdmaGsmTx;
+extern char gsmUartTxSend(TGsmUartTxSeg *segs, char count,
+                          void (*done)(struct GsmContext *ctx));
+extern void gsmUartTxDmaDone(UART_HandleTypeDef *uart);
 #endif
 
-extern const char gsmevntMsgRcvd;
-extern const char gsmevntMsgDrafted;
-extern const char gsmevntMsgDiscarded;
-extern const char gsmevntMsgSent;
-extern const char gsmevntMsgSendFailed;
-
-extern const char gsmstPwrGsmOffPre;
-extern const char gsmstPwrGsmOff;
-extern const char gsmstPwringGsmOff;
-extern const char gsmstPwrGsmOn;
-extern const char gsmstPwringGsmOn;
-extern const char gsmstPinChkPre;
-extern const char gsmstPinChkQuery;
-extern const char gsmstSetup_MSHI;
-extern const char gsmstSetup_MSHO;
-extern const char gsmstWaitRegPre;
-extern const char gsmstStandbyPre;
-extern const char gsmstMsgHook;
-extern const char gsmstGPRS_Hook;
-
-#else
-
-#define gsmevntDateTimeRead             150
-#define gsmevntDateTimeWrite            151
-#define gsmevntSignalQualityRead        152
-#define gsmevntIMEI_Read                20
-#define gsmevntPIN_Request              30
-#define gsmevntPIN_Fail                 31
-#define gsmevntMissedCall               70
-#define gsmevntMsgRcvd                  80
-#define gsmevntMsgDrafted               81
-#define gsmevntMsgDiscarded             82
-#define gsmevntMsgSent                  83
-#define gsmevntMsgSendFailed            84
-#define gsmevntGprsFailed               110
-#define gsmevntGprsHttpResultErr        111
-#define gsmevntGprsHttpResponseLine     112
+// --- Instances ---
+typedef struct GsmPins {
+  GPIO_TypeDef *PwrKeyPort;
+  uint16_t PwrKeyPin;
+  GPIO_TypeDef *ResetPort;  // (gsm_reset_en)
+  uint16_t ResetPin;
+  GPIO_TypeDef *StatPort;
+  uint16_t StatPin;
+  GPIO_TypeDef *RtsPort;    // (gsm_uart_hw_flow_ctl)
+  uint16_t RtsPin;
+} TGsmPins;
+typedef struct GsmContext TGsmContext; // (see "Instance Context" below)
+extern TGsmContext GsmContextDefault;
+extern const TGsmPins GsmPinsDefault;
+
+// --- Events ---
+// Entries: name, event number (passed to gsmEvent())
+#define gsm_event_table(X) \
+  X(DateTimeRead,         150) \
+  X(DateTimeWrite,        151) \
+  X(SignalQualityRead,    152) \
+  X(IMEI_Read,            20)  \
+  X(UartBaud,             25)  \
+  X(PIN_Request,          30)  \
+  X(PIN_Fail,             31)  \
+  X(MissedCall,           70)  \
+  X(MsgRcvd,              80)  \
+  X(MsgDrafted,           81)  \
+  X(MsgDiscarded,         82)  \
+  X(MsgSent,              83)  \
+  X(MsgSendFailed,        84)  \
+  X(GprsFailed,           110) \
+  X(GprsHttpResultErr,    111) \
+  X(GprsHttpResponseLine, 112)
+// gsmevntMsgDrafted: message written to SIM card
+// gsmevntMsgDiscarded: gave up on writing it to the SIM card (memory full?)
+// gsmevntMsgSendFailed: gave up on sending it (no airtime?)
+
+#define gsm_event_enum(name, id) gsmevnt##name = id,
+enum {
+  gsm_event_table(gsm_event_enum)
+  gsmevntLast
+};
+#undef gsm_event_enum
 
 #ifndef struct_DateTime
 typedef struct DateTime {
@@ -143,11 +171,18 @@ typedef struct DateTime {
 extern void gsmEvent(char GsmEventType);
 extern char* pstrGsmEventOriginatorID;
 extern char* pstrGsmEventData;
+extern unsigned int wrdGsmEventDataLen;
 extern TDateTime dtmGsmEvent;
 
 extern void gsmInit();
+extern void gsmInstanceInit(TGsmContext *ctx, UART_HandleTypeDef *uart,
+                            const TGsmPins *pins);
 extern void gsm1msPing();
 extern void gsmPoll();
+extern unsigned long gsmNextDeadline();
+#ifdef gsm_poll_budget
+extern char gsmPollFor(unsigned long max_us);
+#endif
 extern void gsmPowerSetOnOff(char power_on);
 extern char gsmReady();
 extern void gsmDateTimeRead();
@@ -161,110 +196,214 @@ extern char gsmGprsHttpPost(char* url, char* postdata);
 extern char gsmGprsPending();
 extern void gsmGprsCancel();
 extern void gsmGprsSetHttpKeepAlive(char keepalive);
+extern char gsmRequestAdd(char kind, char priority, unsigned long timeout,
+                          char *text, char *dest);
+extern char gsmRequestPending(char kind);
+extern void gsmRequestCancel(char kind);
+extern char gsmRequestPreempt();
 
 #ifdef gsm_debug_state
 extern char *gsmDebugStateStrPtr;
 extern void gsmDebugStateStrReady();
 #endif
 
-#define gsmstDelay  1
-#define gsmstWaitingOK  2
-#define gsmstCmdOK  3
-#define gsmstDie  9
-// Diversions
-#define gsmstGetDateTimePre  150
-#define gsmstGetDateTimeQuery  151
-#define gsmstGetDateTimeResponse  152
-#define gsmstSetDateTimePre  160
-#define gsmstSetDateTime     161
-
-#define gsmstPwrGsmOffPre       10
-#define gsmstPwrGsmOff          11
-#define gsmstPwringGsmOff       12
-#define gsmstPwrGsmOn           13
-#define gsmstPwringGsmOn        14
-
-#define gsmstIMEIPre  20
-#define gsmstIMEIQuery  21
-#define gsmstIMEIResponse  22
-
-#define gsmstPinChkPre          30
-#define gsmstPinChkQuery        31
-#define gsmstPinChkResponse  32
-#define gsmstPinPre  33
-#define gsmstPinCmd  34
-#define gsmstPinResponse  35
-
-#define gsmstSetup_MSHI         40
-#define gsmstSetup_MSHO         41
-#define gsmstEnableCLIP  42
-#define gsmstSetMsgFrmtToTxt  43
-#define gsmstSetMsgAlertOnPre  44
-#define gsmstSetMsgAlertOn  45
-
-
-#define gsmstWaitRegPre         50
-#define gsmstWaitRegQuery  51
-#define gsmstWaitRegResponse  52
-
-#define gsmstStandbyPre         60
-#define gsmstStandby  61
-
-#define gsmstWaitingCLIP  70
-#define gsmstWaitingNO_CARRIER  71
-
-#define gsmstMsgHook            109
-#define gsmstGPRS_Hook          110
-#endif /* __GNUC__ */
+// --- States ---
+// Entries: name, state number. Numbers: 1-9 general-purpose, 10-19 power
+// and echo, 20-29 info and baud rate, 30-39 PIN, 40-49 module setup, 50-59
+// network registration, 60-79 standby and call, 80-109 text messages,
+// 110-139 GPRS, 150-199 diversions, 200+ module specific (GSM_MS_Xxx.c).
+// Names (gsmst + name) are at most 26 characters (gsm_debug_state output).
+#define gsm_state_table(X) \
+  X(Delay,              1)   \
+  X(WaitingOK,          2)   \
+  X(CmdOK,              3)   \
+  X(Die,                9)   \
+  X(GetDateTimePre,     150) \
+  X(GetDateTimeQuery,   151) \
+  X(SetDateTimePre,     160) \
+  X(SetDateTime,        161) \
+  X(SetDateTimeDone,    162) \
+  X(SetDateTimeFail,    163) \
+  X(PwrGsmOffPre,       10)  \
+  X(PwrGsmOff,          11)  \
+  X(PwringGsmOff,       12)  \
+  X(PwrGsmOn,           13)  \
+  X(PwringGsmOn,        14)  \
+  X(EchoOff,            16)  \
+  X(FlowCtl,            17)  \
+  X(BaudProbe,          25)  \
+  X(BaudSet,            26)  \
+  X(BaudSwitch,         27)  \
+  X(BaudVerify,         28)  \
+  X(BaudSave,           29)  \
+  X(BaudSaved,          24)  \
+  X(IMEIPre,            20)  \
+  X(IMEIQuery,          21)  \
+  X(PinChkPre,          30)  \
+  X(PinChkQuery,        31)  \
+  X(PinPre,             33)  \
+  X(PinCmd,             34)  \
+  X(PinResponse,        35)  \
+  X(Setup_MSHI,         40)  \
+  X(Setup_MSHO,         41)  \
+  X(EnableCLIP,         42)  \
+  X(SetMsgFrmtToTxt,    43)  \
+  X(SetMsgAlertOnPre,   44)  \
+  X(SetMsgAlertOn,      45)  \
+  X(SetupBatch,         46)  \
+  X(SetupBatchFail,     47)  \
+  X(WaitRegPre,         50)  \
+  X(WaitRegQuery,       51)  \
+  X(StandbyPre,         60)  \
+  X(Standby,            61)  \
+  X(Flow,               62)  \
+  X(WaitingNO_CARRIER,  71)  \
+  X(MsgHook,            109) \
+  X(GPRS_Hook,          110)
+
+#define gsm_state_enum(name, id) gsmst##name = id,
+enum {
+  gsm_state_table(gsm_state_enum)
+  gsmstLast
+};
+#undef gsm_state_enum
+
+// --- Requests ---
+// Kinds (gsmRequestAdd())
+#define gsmreqDateTimeRead  1
+#define gsmreqDateTimeWrite 2
+#define gsmreqMsgSend       3 // text: message, dest: destination ID
+#define gsmreqGprs          4 // text: URL, dest: POST data (0 for GET)
+#define gsmreqJobs          3 // Kinds from here on are run from standby
+// Priorities (lower runs first)
+#define gsmprioUrgent       0 // e.g. alarms (gsmMsgSend())
+#define gsmprioNormal       1 // (gsmDateTimeRead() / gsmDateTimeWrite())
+#define gsmprioBulk         2 // e.g. telemetry (gsmGprsHttpGet() / Post())
+#define gsmprioIdle         255
+// Result statuses (TGsmResult)
+#define gsmresOK            0 // Done (for a job: as reported by the module)
+#define gsmresFailed        1
+#define gsmresExpired       2 // Deadline passed before it was run
+#define gsmresCancelled     3
+#define gsmresEnded         4 // Job finished without the module reporting
+                              // the outcome (see gsmEvent())
+#define gsmresData          5 // Part of the result (e.g. an HTTP response
+                              // line), more to follow
+typedef unsigned int TGsmHandle; // Identifies a request (0: not qued)
+typedef struct GsmResult {
+  struct GsmContext *Ctx;   // Instance the request was qued on
+  TGsmHandle Handle;
+  char Kind;                // gsmreqXxx
+  char Status;              // gsmresXxx
+  void *User;               // As given with the request
+  union {
+    TDateTime DateTime;     // gsmreqDateTimeRead / Write
+    struct {
+      char *Message;
+      char *DestinationID;
+    } Msg;                  // gsmreqMsgSend
+    struct {
+      char *URL;
+      char *PostData;       // (0 for GET)
+      unsigned int HttpStatus; // (set by the GPRS module, 0 if unknown)
+      char *Data;           // gsmresData: the part received
+      unsigned int DataLen;
+    } Gprs;                 // gsmreqGprs
+  } Data;
+} TGsmResult;
+typedef void (*TGsmRequestDone)(TGsmResult *result);
+typedef struct GsmRequest {
+  char Kind;
+  char Priority;
+  unsigned long Deadline;   // dwdGsmMsTmr value (0 for none)
+  char *Text;
+  char *Dest;
+  TGsmHandle Handle;
+  TGsmRequestDone Done;     // (0 for none)
+  void *User;
+  char Tries;               // (date/time writes: tries which failed)
+} TGsmRequest;
+extern TGsmHandle gsmRequestSubmit(char kind, char priority,
+                                   unsigned long timeout, char *text,
+                                   char *dest, TGsmRequestDone done,
+                                   void *user);
+extern char gsmRequestAbort(TGsmHandle handle);
+extern char gsmRequestActive(TGsmHandle handle);
+extern TGsmHandle gsmMsgSendEx(char *Message, char *DestinationID,
+                               TGsmRequestDone done, void *user);
+extern TGsmHandle gsmGprsHttpGetEx(char *url, TGsmRequestDone done,
+                                   void *user);
+extern TGsmHandle gsmGprsHttpPostEx(char *url, char *postdata,
+                                    TGsmRequestDone done, void *user);
+extern TGsmHandle gsmDateTimeReadEx(TGsmRequestDone done, void *user);
+// (for the SMS / GPRS modules, about the job in progress)
+extern TGsmResult *gsmRequestResult();
+extern void gsmRequestData(char *data, unsigned int length);
+extern void gsmRequestDone(char status);
+
+// --- Response Types ---
+// Every line received is classified (once) by its token - the text up to ':'
+// or the end of the line - into one of the gsmrspXxx values below.
+// Entries: name, token, character at token[length / 3], last character
+// (the two characters feed the hash, so they must match the token).
+#define gsm_rsp_table(X) \
+  X(OK,         "OK",          'O', 'K') \
+  X(ERROR,      "ERROR",       'R', 'R') \
+  X(CME_ERROR,  "+CME ERROR",  'E', 'R') \
+  X(CMS_ERROR,  "+CMS ERROR",  'S', 'R') \
+  X(CPIN,       "+CPIN",       'C', 'N') \
+  X(CREG,       "+CREG",       'C', 'G') \
+  X(CCLK,       "+CCLK",       'C', 'K') \
+  X(CSQ,        "+CSQ",        'C', 'Q') \
+  X(CLIP,       "+CLIP",       'C', 'P') \
+  X(CMTI,       "+CMTI",       'C', 'I') \
+  X(RING,       "RING",        'I', 'G') \
+  X(NOCARRIER,  "NO CARRIER",  'C', 'R') \
+  X(CONNECT,    "CONNECT",     'N', 'T') \
+  X(BUSY,       "BUSY",        'U', 'Y') \
+  X(NOANSWER,   "NO ANSWER",   'A', 'R') \
+  X(NODIALTONE, "NO DIALTONE", 'D', 'E')
+
+#define gsm_rsp_enum(name, token, mid, last) gsmrsp##name,
+enum {
+  gsmrspNone = 0, // Not a known response (e.g. data)
+  gsm_rsp_table(gsm_rsp_enum)
+  gsmrspCount
+};
+#undef gsm_rsp_enum
 
 char UART_Tx_Idle(void);
 void UART_Write(char *pData);
+void UART_Write_Char(char data_);
 char UART_Read(void);
 bit UART_Data_Ready(void);
 void UART_GSM_Init(void);
 
-extern unsigned int wrdGsmGPTmr;
-extern unsigned long dwdGsmGPTmr;
-extern char bytGsmGPCtr;
-extern bit bitGsmGPFlag;
-extern char strGsmGP[];
-extern char* pstrGsmGP;
-extern char charGsmUartRx;
-extern char strGsmUartRxBuff[];
-extern bit bitGsmUartRxLineReady;
-extern char bytGsmUartRxQuietTimer;
-extern char bytGsmState;
-extern unsigned int wrdGsmTimeoutTime;
-extern unsigned int wrdGsmTimeoutTmr;
-extern char bytGsmStateAfterTimeout;
 extern char strAT[];
 extern char strOK[];
 extern char strERROR[];
 extern char strNewLine[];
-extern bit bitGSM_Stat_On_State;
-extern char *pstrGsmMsgSendTxt;
-extern char *pstrGsmMsgSendNum;
-extern bit bitGsmMsgDelPending;
-extern bit bitGsmMsgWritePending;
-extern bit bitGsmMsgReadPending;
-extern bit bitGsmMsgSendPending;
-extern bit bitGsmMsgJustArrived;
-extern bit bitGsmGprsPending;
-extern bit bitGsmGprsInProgress;
-extern char *pstrGsmGprsURL;
-extern char *pstrGsmGprsData;
-extern unsigned int wrdGsmGprsDataSize;
-extern bit bitGsmGprsHttpKeepAlive;
-extern bit bitGsmGprsRestartFlag;
-extern char strGsmOrigOrDestID[];
-extern bit bitGSM_PowerOff;
-extern bit bitExpectGSM_On;
-extern bit bitGSM_Stat_On_State;
 
 extern void gsmUartRxLineClear();
 extern void gsmUartRxLineProcessed();
-extern void gsmUART_Write_Text(char *UART_text);
-extern void gsmUART_Write(char data_);
+extern char *gsmUartRxLinePeek(char index, unsigned int *length);
+extern char gsmRspClassify(char *line, unsigned int length);
+extern void gsmUartRxRawExpect(char *header);
+extern void gsmUartRxRawStart(unsigned int length, char *dest,
+                              void (*consumer)(char *data, unsigned int length));
+extern unsigned int gsmUartRxRawPending();
+extern char gsmUrcRegister(char *prefix,
+                           char (*handler)(char *line, unsigned int length));
+extern char gsmUART_Write_Text(char *UART_text);
+extern char gsmUART_Write(char data_);
+extern char gsmUartTxComplete();
+extern char gsmCmdBegin();
+extern void gsmCmdChar(char data_);
+extern void gsmCmdText(char *text);
+extern void gsmCmdQuoted(char *text);
+extern void gsmCmdInt(long value);
+extern void gsmCmdDigits2(char value);
+extern char gsmCmdCommit();
 extern void gsmSetStateNext(char stateNext, char allowDivert);
 extern void gsmSetStateTimeout(unsigned int time_ms, char stateAfterTimeout);
 extern void gsmCancelStateTimeout();
@@ -273,25 +412,368 @@ extern void gsmSetStateCmdOK(char* cmd, char stateAfterOK, char stateAfterFail);
 extern void gsmSetStateWaitOK(char stateAfterOK, unsigned int timeout,
                               char stateAfterTimeout);
 extern void gsmSetStateWaitReg(char stateAfterReg);
+typedef struct GsmStateDef {
+  char State;
+  char *Cmd;                // Command sent on entry (if Compose is 0)
+  char (*Compose)(void);    // Composes and commits the command (gsmCmdXxx()),
+                            // returning 0 if it could not be sent
+  char Rsp;                 // Response which completes the state (gsmrspXxx)
+                            // (or which is handed to Parse)
+  char (*Parse)(char *line, unsigned int length); // Returns the state to go
+                            // to after "OK" (or 0 if not the line expected)
+  unsigned int Timeout;     // ms to wait for Rsp before trying again
+  char Tries;
+  char NextOK;              // State after Rsp
+  char NextError;           // State after ERROR / +CME / +CMS ERROR
+                            // (0 to keep waiting)
+  char NextFail;            // State once out of tries (0: gsmstPwrGsmOffPre)
+  unsigned int Latency;     // (set by the engine, see gsmStateLatency())
+} TGsmStateDef;
+#define cGsmStateAfterDivert 255 // Next state: return from the diversion
+extern char gsmStateDefine(TGsmStateDef *def);
+extern void gsmStateDefRestart();
+extern unsigned int gsmStateLatency(char state);
+extern char gsmSetupBatchAdd(char *cmd);
 extern void gsmExtractDateTime(char *source);
 
+// --- Flows ---
+// Multi-step modem flows written as one routine (stackless coroutines, run in
+// gsmstFlow; see "Flows" in GSM.c). A flow routine is:
+//   static char flowCsq(TGsmFlow *f) {
+//     gsmFlowBegin(f);
+//     gsmFlowSend(f, "AT+CSQ");
+//     gsmFlowAwait(f, gsmrspCSQ, 300);
+//     if (f->Rsp == gsmrspCSQ) { /* parse gsmUartRxLinePeek(0, &len) */ }
+//     gsmFlowAwait(f, gsmrspOK, 300); // (at once if it came instead)
+//     gsmFlowEnd(f);
+//   }
+// Local variables are not kept across the gsmFlowXxx() waits (use Data),
+// and the waits can not be used from within a switch.
+#define gsmflowWaiting 0
+#define gsmflowDone    1
+typedef struct GsmFlow {
+  unsigned int Lc;          // Where to resume (source line, 0 at the start)
+  char (*Run)(struct GsmFlow *flow); // Returns gsmflowWaiting / gsmflowDone
+  void *Data;               // (for the flow's own use)
+  char Rsp;                 // Response awaited, then the one received
+                            // (gsmrspXxx, gsmrspNone on a timeout)
+  char Final;               // Final response to the last command sent
+                            // (gsmrspNone until it has been received)
+  unsigned long Start;      // dwdGsmMsTmr when the wait started
+  unsigned long Timeout;    // Wait (ms, 0 if waiting on a condition)
+  struct GsmFlow *pNext;    // Next flow running
+} TGsmFlow;
+#define gsmFlowBegin(f) switch ((f)->Lc) { case 0:
+#define gsmFlowEnd(f) } return gsmflowDone
+#define gsmFlowExit(f) return gsmflowDone
+#define gsmFlowWaitUntil(f, cond) \
+  gsmFlowWaitStart(f, gsmrspNone, 0); (f)->Lc = __LINE__; case __LINE__: \
+  if (!(cond)) return gsmflowWaiting
+#define gsmFlowYield(f) \
+  gsmFlowWaitStart(f, gsmrspNone, 0); (f)->Lc = __LINE__; return gsmflowWaiting; \
+  case __LINE__:
+#define gsmFlowDelay(f, time_ms) \
+  gsmFlowWaitStart(f, gsmrspNone, time_ms); (f)->Lc = __LINE__; case __LINE__: \
+  if (!gsmFlowWaitDone(f)) return gsmflowWaiting
+#define gsmFlowSend(f, cmd) \
+  gsmFlowWaitUntil(f, gsmFlowCmdSend(f, cmd))
+#define gsmFlowAwait(f, rsp, timeout_ms) \
+  gsmFlowWaitStart(f, rsp, timeout_ms); (f)->Lc = __LINE__; case __LINE__: \
+  if (!gsmFlowAwaitDone(f)) return gsmflowWaiting
+extern char gsmFlowStart(TGsmFlow *flow, char (*run)(TGsmFlow *flow));
+extern void gsmFlowAbort(TGsmFlow *flow);
+extern char gsmFlowRunning(TGsmFlow *flow);
+extern char gsmFlowCmdSend(TGsmFlow *flow, char *cmd);
+extern void gsmFlowWaitStart(TGsmFlow *flow, char rsp, unsigned long timeout);
+extern char gsmFlowWaitDone(TGsmFlow *flow);
+extern char gsmFlowAwaitDone(TGsmFlow *flow);
+
+// --- Instance Context ---
+// Everything kept for one module (see gsmInstanceInit()); the library refers
+// to the members by name through GSM_Ctx.h (private to the library and its
+// modules)
+#ifndef gsm_blocking_uart_tx
+#define cGsmUartTxRingSize  256 // Must be a power of two
+#endif
+#define cGsmUartTxCmdSize   48 // Longer command lines are not filtered (echo)
+#define cGsmCmdMaxSize      126
+#define cGsmUartRxRingSize  256 // Must be a power of two
+#define cGsmUartRxLinesMax  8 // Must be a power of two
+#define cGsmStateDefMax     16
+#define cGsmRequestMax      8
+#define cGsmSetupBatchMax   4 // Module-specific setup commands
+#define cGsmUrcMax          12 // Maximum number of registered URC prefixes
+typedef struct GsmUartRxLine {
+  unsigned int Offset; // Start of the line within strGsmUartRxBuff
+  unsigned int Length; // Length of the line (excluding the null terminator)
+  char Rsp; // Response type (gsmrspXxx)
+} TGsmUartRxLine;
+typedef struct {
+  char *Prefix;
+  char PrefixLen;
+  char (*Handler)(char *line, unsigned int length); // Returns 1 if consumed
+} TGsmUrc;
+struct GsmContext {
+  UART_HandleTypeDef *pUart;
+  TGsmPins Pins;
+  struct GsmContext *pNext; // Next instance set up
+  // UART Tx
+  unsigned long dwdGsmUartBaud; // Current baud rate
+  #ifndef gsm_blocking_uart_tx
+  char strGsmUartTxRing[cGsmUartTxRingSize];
+  unsigned int wrdGsmUartTxRingHead; // Free-running write position
+  volatile unsigned int wrdGsmUartTxRingTail; // Free-running read position
+  #ifdef gsm_dma_uart_tx
+  volatile unsigned int wrdGsmUartTxDmaLen; // Length of the transfer
+  volatile bit bitGsmUartTxDmaBusy; // Transfer in progress
+  void (*p_gsmUartTxDmaDone)(TGsmContext *ctx); // Called once the ring has
+                                                // been sent
+  unsigned int wrdGsmUartTxDmaDoneAt; // up to this position
+  #ifdef gsm_tickless
+  volatile unsigned long dwdGsmUartTxDoneTick; // End of the last transfer
+  #endif
+  #endif
+  #endif
+  // Back-pressure statistics (for sizing cGsmUartTxRingSize)
+  unsigned int wrdGsmUartTxFullCtr; // Writes / commands refused (no room)
+  unsigned int wrdGsmUartTxPeak; // Highest fill level of the ring
+  // Command echo
+  char strGsmUartTxCmd[cGsmUartTxCmdSize]; // Command line being queued
+  char bytGsmUartTxCmdLen;
+  char strGsmUartTxCmdEcho[cGsmUartTxCmdSize]; // Last command line queued
+  char bytGsmUartTxCmdEchoLen; // Length of the echo expected (0 if none)
+  // Command composer
+  #ifdef gsm_blocking_uart_tx
+  char strGsmUartTxFrame[cGsmCmdMaxSize + 3]; // + Cr Lf and null terminator
+  #endif
+  unsigned int wrdGsmCmdLen;
+  bit bitGsmCmdOverflow; // Command did not fit, it will not be sent
+  // UART Rx
+  char charGsmUartRx; // Received character
+  char strGsmUartRxRing[cGsmUartRxRingSize]; // Characters waiting to be framed
+  volatile unsigned int wrdGsmUartRxRingHead; // Producer position
+  volatile unsigned int wrdGsmUartRxRingTail; // Consumer position
+  char strGsmUartRxBuff[256]; // Lines of data / communication which have been rcvd
+  unsigned int wrdGsmUartRxLineStart; // Start of the line being received
+  unsigned int wrdGsmUartRxLinePos; // Current pos. within strGsmUartRxBuff
+  TGsmUartRxLine GsmUartRxLines[cGsmUartRxLinesMax]; // Line descriptor queue
+  char bytGsmUartRxLinesHead; // Next descriptor to be filled
+  char bytGsmUartRxLinesTail; // Oldest descriptor (first line ready)
+  char bytGsmUartRxLinesReady; // Number of lines ready
+  char *pstrGsmUartRxLine; // First line ready
+  unsigned int wrdGsmUartRxLineLen; // Length of the first line ready
+  char bytGsmUartRxLineRsp; // Response type of the first line ready
+  bit bitGsmUartRxReset; // Inter-byte gap elapsed, discard the partial line
+  #ifdef gsm_debug_state
+  bit bitGsmUartRxCharsLost;
+  bit bitGsmUartRxBuffCleared;
+  bit bitGsmUartRxLineDiscarded;
+  #endif
+  bit bitGsmUartRxLineReady; // Indicates that a "line" of communcation has been
+                             // received, and is ready to be inspected / processed.
+                             // Should be reset / cleared after the communication
+                             // has been inspected / processed, in order to allow
+                             // further communication to be received.
+  bit bitGsmUartRxLineUrcChecked; // First line ready has been through gsmUrcDispatch()
+  char bytGsmUartRxQuietTimer;
+  // Raw (binary) reception, bypassing line framing
+  unsigned int wrdGsmUartRxRawLeft; // Characters still to be handed over
+  char *pstrGsmUartRxRawDest; // Caller-supplied buffer (if no consumer)
+  void (*p_gsmUartRxRawConsumer)(char *data, unsigned int length);
+  char *pstrGsmUartRxRawHeader; // Framing halts after a line starting with this
+  bit bitGsmUartRxRawHalt; // Framing halted, waiting for gsmUartRxRawStart()
+  #ifdef gsm_uart_hw_flow_ctl
+  volatile bit bitGsmUartRxRtsOff; // RTS deasserted, the module should not send
+  #endif
+  #ifdef gsm_dma_uart_rx
+  bit bitGsmUartRxDmaRestart; // DMA reception was stopped by a UART error
+  #endif
+  // General Purpose
+  unsigned int wrdGsmGPTmr; // General-purpose timer (integer)
+  unsigned long dwdGsmGPTmr; // General-purpose timer (long)
+  char bytGsmGPCtr; // General-purpose counter
+  bit bitGsmGPFlag; // General-purpose flag
+  char strGsmGP[22]; // General-purpose string
+  char* pstrGsmGP;
+  // State Machine
+  char bytGsmState;
+  #ifdef gsm_debug_state
+  char (*p_gsm_MS_strcatState)(char *to, char state);
+  #endif
+  char (*p_gsm_MS_ProcessState)(char dummy);
+  // State Machine Delay
+  char bytGsmStateAfterDelay;
+  unsigned int wrdGsmDelayTime;
+  unsigned int wrdGsmDelayTmr;
+  // State Machine Timeout
+  char bytGsmStateAfterTimeout;
+  unsigned int wrdGsmTimeoutTime;
+  unsigned int wrdGsmTimeoutTmr;
+  // State Machine Divert
+  char bytGsmStateAfterDivert;
+  // State Machine Table
+  TGsmStateDef GsmStateDefs[cGsmStateDefMax];
+  char bytGsmStateDefCount;
+  char bytGsmStateDefIdx[256]; // State -> GsmStateDefs index + 1 (0 if none)
+  bit bitGsmStateDefSent; // Command sent, waiting for the response
+  char bytGsmStateDefTries;
+  char bytGsmStateDefLast; // Table-driven state the tries are counted for
+  unsigned int wrdGsmStateDefTmr; // Time since the command was qued
+  // State Machine SMS
+  #ifdef gsm_debug_state
+  char (*p_gsm_Msg_strcatState)(char *to, char state);
+  #endif
+  char (*p_gsm_Msg_ProcessState)(char dummy);
+  char *pstrGsmMsgSendTxt;
+  char *pstrGsmMsgSendNum;
+  bit bitGsmMsgDelPending;
+  bit bitGsmMsgWritePending;
+  bit bitGsmMsgReadPending;
+  bit bitGsmMsgSendPending;
+  bit bitGsmMsgJustArrived;
+  // State Machine GPRS
+  #ifdef gsm_debug_state
+  char (*p_gsm_GPRS_strcatState)(char *to, char state);
+  #endif
+  char (*p_gsm_GPRS_ProcessState)(char dummy);
+  bit bitGsmGprsPending;
+  bit bitGsmGprsInProgress;
+  char *pstrGsmGprsURL;
+  char *pstrGsmGprsData;
+  unsigned int wrdGsmGprsDataSize;
+  bit bitGsmGprsHttpKeepAlive;
+  bit bitGsmGprsRestartFlag; // Informs the GPRS module that the system has restarted
+  // Request Queue
+  TGsmRequest GsmRequests[cGsmRequestMax]; // In the order qued
+  char bytGsmRequestCount;
+  char bytGsmRequestPriority; // Priority of the job in progress
+  unsigned long dwdGsmMsTmr; // Free-running, for request deadlines
+  TGsmHandle wrdGsmRequestSeq; // Last handle given out
+  TGsmResult GsmRequestJob; // Result of the job in progress (Kind 0: none)
+  TGsmRequestDone pGsmRequestJobDone;
+  // State Machine Other
+  bit bitExpectGSM_On;
+  bit bitGSM_PowerOff; // Instructs the library to power the GSM module off
+  char bytGsmStateAfterOK;
+  char bytGsmCmdOKCtr;
+  char bytGsmStateAfterReg;
+  char *pstrGsmCommand;
+  char bytGsmStateAfterCmdFail;
+  // Batched Module Setup
+  char *pstrGsmSetupBatch[cGsmSetupBatchMax];
+  char bytGsmSetupBatchCount;
+  bit bitGsmSetupBatchFailed; // Setup one command at a time (until gsmInit())
+  char strGsmOrigOrDestID[15];
+  char bytGSM_StatTmr; // GSM_Stat can sometimes dip off very briefly
+                       // This is used to avoid "false" off readings
+  // Misc
+  bit bitGSM_Stat_On_State; // Determines what state of GSM_Stat is considered "on"
+  bit bitGSM_Ready; // Indicates if the module is registered on the network
+  // Baud Rate
+  #ifdef gsm_uart_baud_high
+  unsigned long dwdGsmUartBaudPrev; // Rate to fall back to
+  unsigned long dwdGsmUartBaudSaved; // Rate saved in the module's profile
+                                     // (AT&W), 0 if not known
+  bit bitGsmUartBaudFailed; // Stay at the current rate (until gsmInit())
+  #endif
+  // URC Dispatch
+  TGsmUrc GsmUrcs[cGsmUrcMax];
+  char bytGsmUrcCount;
+  bit bitGsmCallRinging; // Incoming call ringing
+  bit bitGsmCallIdReported; // Caller ID of the current call has been reported
+  unsigned int wrdGsmCallRingTmr; // Time since the last RING / +CLIP
+  // Timers
+  #ifdef gsm_tickless
+  unsigned long dwdGsmTick; // gsm_tick() when the timers were advanced
+  unsigned long dwdGsmTickTx; // (the same, for the Tx-gated timers)
+  #endif
+  // Flows
+  TGsmFlow *pGsmFlows; // Flows running (gsmFlowStart())
+  TGsmFlow *pGsmFlowOwner; // Flow which has sent a command (until its final
+                           // response)
+  TGsmFlow *pGsmFlowHolder; // Flow given the line ready (kept until its next
+                            // wait)
+  // Poll Budget
+  #ifdef gsm_poll_budget
+  unsigned long dwdGsmPollCycles; // Duration of the last gsmPoll() call
+  unsigned long dwdGsmPollCyclesMax; // and the longest (DWT cycles)
+  #endif
+};
+
+// --- Instance API ---
+// Entry points for an instance set up with gsmInstanceInit(); the routines
+// without a context (gsmPoll(), gsmMsgSend(), ...) act on the default
+// instance, or on the instance being run when called from within gsmEvent(),
+// a request / flow callback or a module.
+extern void gsmInstancePoll(TGsmContext *ctx);
+extern unsigned long gsmInstanceNextDeadline(TGsmContext *ctx);
+#ifdef gsm_poll_budget
+extern char gsmInstancePollFor(TGsmContext *ctx, unsigned long max_us);
+#endif
+extern char gsmInstanceReady(TGsmContext *ctx);
+extern void gsmInstancePowerSetOnOff(TGsmContext *ctx, char power_on);
+extern TGsmHandle gsmInstanceRequestSubmit(TGsmContext *ctx, char kind,
+                                           char priority, unsigned long timeout,
+                                           char *text, char *dest,
+                                           TGsmRequestDone done, void *user);
+extern char gsmInstanceRequestAbort(TGsmContext *ctx, TGsmHandle handle);
+extern char gsmInstanceRequestActive(TGsmContext *ctx, TGsmHandle handle);
+extern char gsmInstanceFlowStart(TGsmContext *ctx, TGsmFlow *flow,
+                                 char (*run)(TGsmFlow *flow));
+extern void gsmInstanceFlowAbort(TGsmContext *ctx, TGsmFlow *flow);
+extern void gsmInstanceDateTimeRead(TGsmContext *ctx);
+extern void gsmInstanceDateTimeWrite(TGsmContext *ctx);
+extern void gsmInstanceMsgSend(TGsmContext *ctx, char *Message,
+                               char *DestinationID);
+extern char gsmInstanceGprsHttpGet(TGsmContext *ctx, char *url);
+extern char gsmInstanceGprsHttpPost(TGsmContext *ctx, char *url,
+                                    char *postdata);
+extern TGsmHandle gsmInstanceDateTimeReadEx(TGsmContext *ctx,
+                                            TGsmRequestDone done, void *user);
+extern TGsmHandle gsmInstanceMsgSendEx(TGsmContext *ctx, char *Message,
+                                       char *DestinationID,
+                                       TGsmRequestDone done, void *user);
+extern TGsmHandle gsmInstanceGprsHttpGetEx(TGsmContext *ctx, char *url,
+                                           TGsmRequestDone done, void *user);
+extern TGsmHandle gsmInstanceGprsHttpPostEx(TGsmContext *ctx, char *url,
+                                            char *postdata,
+                                            TGsmRequestDone done, void *user);
+extern TGsmContext *gsmEventInstance();
+
+// --- RTOS ---
+#ifdef gsm_rtos
+#define cGsmRtosEventDataMax 63
+#define cGsmRtosHandle 0x8000 // (set in the handles given by gsmRtosRequest())
+typedef struct GsmRtosEvent {
+  TGsmContext *Ctx;         // Instance the event is from
+  char Type;                // gsmevntXxx
+  char OriginatorID[16];    // (pstrGsmEventOriginatorID)
+  char Data[cGsmRtosEventDataMax + 1]; // (pstrGsmEventData, null-terminated)
+  unsigned int DataLen;     // (wrdGsmEventDataLen, at most cGsmRtosEventDataMax)
+  TDateTime DateTime;       // (dtmGsmEvent)
+} TGsmRtosEvent;
+extern TaskHandle_t hGsmTask;
+extern char gsmRtosStart(UBaseType_t priority);
+extern void gsmRtosNotifyFromISR();
+extern TGsmHandle gsmRtosRequest(TGsmContext *ctx, char kind, char priority,
+                                 unsigned long timeout, char *text, char *dest,
+                                 TGsmRequestDone done, void *user,
+                                 TickType_t wait);
+extern TGsmHandle gsmRtosMsgSend(TGsmContext *ctx, char *Message,
+                                 char *DestinationID, TGsmRequestDone done,
+                                 void *user);
+extern TGsmHandle gsmRtosHttpGet(TGsmContext *ctx, char *url,
+                                 TGsmRequestDone done, void *user);
+extern TGsmHandle gsmRtosHttpPost(TGsmContext *ctx, char *url, char *postdata,
+                                  TGsmRequestDone done, void *user);
+extern char gsmRtosEventPost(char GsmEventType);
+extern char gsmRtosEventGet(TGsmRtosEvent *event, TickType_t wait);
+#endif
+
 // --- Modules ---
 
 extern void gsm_MS_Init();
-extern char (*p_gsm_MS_ProcessState)(char dummy);
-#ifdef gsm_debug_state
-extern char (*p_gsm_MS_strcatState)(char *to, char state);
-#endif
-
+extern void gsm_MS_InstanceInit(TGsmContext *ctx);
 extern void gsm_Msg_Init();
-extern char (*p_gsm_Msg_ProcessState)(char dummy);
-#ifdef gsm_debug_state
-extern char (*p_gsm_Msg_strcatState)(char *to, char state);
-#endif
-
 extern void gsm_GPRS_Init();
-extern char (*p_gsm_GPRS_ProcessState)(char dummy);
-#ifdef gsm_debug_state
-extern char (*p_gsm_GPRS_strcatState)(char *to, char state);
-#endif
 #endif /*#ifndef __GSM_H*/
\ No newline at end of file
@@ -0,0 +1,143 @@
+// GSM library instance context aliases (GSM.c and the GSM modules only)
+// The library's routines refer to the members of the instance being run by
+// their names (bytGsmState, bitGSM_Ready, ...) through pGsm. The public entry
+// points taking a context (gsmInstancePoll(), ...) set pGsm for the duration
+// of the call and restore it, so it is the default instance otherwise.
+// Routines run from interrupts never change it: they declare their own pGsm
+// (the instance of the interrupt), which the names below then refer to.
+#ifndef __GSM_CTX_H
+#define __GSM_CTX_H
+#include "GSM.h"
+
+extern TGsmContext *pGsm;
+extern TGsmContext *pGsmFirst;
+
+// Runs the enclosing entry point on ctx (gsmCtxLeave() before each return)
+#define gsmCtxEnter(ctx) TGsmContext *pGsmSaved = pGsm; pGsm = (ctx)
+#define gsmCtxLeave() pGsm = pGsmSaved
+
+#define dwdGsmUartBaud (pGsm->dwdGsmUartBaud)
+#define strGsmUartTxRing (pGsm->strGsmUartTxRing)
+#define wrdGsmUartTxRingHead (pGsm->wrdGsmUartTxRingHead)
+#define wrdGsmUartTxRingTail (pGsm->wrdGsmUartTxRingTail)
+#define wrdGsmUartTxDmaLen (pGsm->wrdGsmUartTxDmaLen)
+#define bitGsmUartTxDmaBusy (pGsm->bitGsmUartTxDmaBusy)
+#define p_gsmUartTxDmaDone (pGsm->p_gsmUartTxDmaDone)
+#define wrdGsmUartTxDmaDoneAt (pGsm->wrdGsmUartTxDmaDoneAt)
+#define dwdGsmUartTxDoneTick (pGsm->dwdGsmUartTxDoneTick)
+#define wrdGsmUartTxFullCtr (pGsm->wrdGsmUartTxFullCtr)
+#define wrdGsmUartTxPeak (pGsm->wrdGsmUartTxPeak)
+#define strGsmUartTxCmd (pGsm->strGsmUartTxCmd)
+#define bytGsmUartTxCmdLen (pGsm->bytGsmUartTxCmdLen)
+#define strGsmUartTxCmdEcho (pGsm->strGsmUartTxCmdEcho)
+#define bytGsmUartTxCmdEchoLen (pGsm->bytGsmUartTxCmdEchoLen)
+#define strGsmUartTxFrame (pGsm->strGsmUartTxFrame)
+#define wrdGsmCmdLen (pGsm->wrdGsmCmdLen)
+#define bitGsmCmdOverflow (pGsm->bitGsmCmdOverflow)
+#define charGsmUartRx (pGsm->charGsmUartRx)
+#define strGsmUartRxRing (pGsm->strGsmUartRxRing)
+#define wrdGsmUartRxRingHead (pGsm->wrdGsmUartRxRingHead)
+#define wrdGsmUartRxRingTail (pGsm->wrdGsmUartRxRingTail)
+#define strGsmUartRxBuff (pGsm->strGsmUartRxBuff)
+#define wrdGsmUartRxLineStart (pGsm->wrdGsmUartRxLineStart)
+#define wrdGsmUartRxLinePos (pGsm->wrdGsmUartRxLinePos)
+#define GsmUartRxLines (pGsm->GsmUartRxLines)
+#define bytGsmUartRxLinesHead (pGsm->bytGsmUartRxLinesHead)
+#define bytGsmUartRxLinesTail (pGsm->bytGsmUartRxLinesTail)
+#define bytGsmUartRxLinesReady (pGsm->bytGsmUartRxLinesReady)
+#define pstrGsmUartRxLine (pGsm->pstrGsmUartRxLine)
+#define wrdGsmUartRxLineLen (pGsm->wrdGsmUartRxLineLen)
+#define bytGsmUartRxLineRsp (pGsm->bytGsmUartRxLineRsp)
+#define bitGsmUartRxReset (pGsm->bitGsmUartRxReset)
+#define bitGsmUartRxCharsLost (pGsm->bitGsmUartRxCharsLost)
+#define bitGsmUartRxBuffCleared (pGsm->bitGsmUartRxBuffCleared)
+#define bitGsmUartRxLineDiscarded (pGsm->bitGsmUartRxLineDiscarded)
+#define bitGsmUartRxLineReady (pGsm->bitGsmUartRxLineReady)
+#define bitGsmUartRxLineUrcChecked (pGsm->bitGsmUartRxLineUrcChecked)
+#define bytGsmUartRxQuietTimer (pGsm->bytGsmUartRxQuietTimer)
+#define wrdGsmUartRxRawLeft (pGsm->wrdGsmUartRxRawLeft)
+#define pstrGsmUartRxRawDest (pGsm->pstrGsmUartRxRawDest)
+#define p_gsmUartRxRawConsumer (pGsm->p_gsmUartRxRawConsumer)
+#define pstrGsmUartRxRawHeader (pGsm->pstrGsmUartRxRawHeader)
+#define bitGsmUartRxRawHalt (pGsm->bitGsmUartRxRawHalt)
+#define bitGsmUartRxRtsOff (pGsm->bitGsmUartRxRtsOff)
+#define bitGsmUartRxDmaRestart (pGsm->bitGsmUartRxDmaRestart)
+#define wrdGsmGPTmr (pGsm->wrdGsmGPTmr)
+#define dwdGsmGPTmr (pGsm->dwdGsmGPTmr)
+#define bytGsmGPCtr (pGsm->bytGsmGPCtr)
+#define bitGsmGPFlag (pGsm->bitGsmGPFlag)
+#define strGsmGP (pGsm->strGsmGP)
+#define pstrGsmGP (pGsm->pstrGsmGP)
+#define bytGsmState (pGsm->bytGsmState)
+#define p_gsm_MS_strcatState (pGsm->p_gsm_MS_strcatState)
+#define p_gsm_MS_ProcessState (pGsm->p_gsm_MS_ProcessState)
+#define bytGsmStateAfterDelay (pGsm->bytGsmStateAfterDelay)
+#define wrdGsmDelayTime (pGsm->wrdGsmDelayTime)
+#define wrdGsmDelayTmr (pGsm->wrdGsmDelayTmr)
+#define bytGsmStateAfterTimeout (pGsm->bytGsmStateAfterTimeout)
+#define wrdGsmTimeoutTime (pGsm->wrdGsmTimeoutTime)
+#define wrdGsmTimeoutTmr (pGsm->wrdGsmTimeoutTmr)
+#define bytGsmStateAfterDivert (pGsm->bytGsmStateAfterDivert)
+#define GsmStateDefs (pGsm->GsmStateDefs)
+#define bytGsmStateDefCount (pGsm->bytGsmStateDefCount)
+#define bytGsmStateDefIdx (pGsm->bytGsmStateDefIdx)
+#define bitGsmStateDefSent (pGsm->bitGsmStateDefSent)
+#define bytGsmStateDefTries (pGsm->bytGsmStateDefTries)
+#define bytGsmStateDefLast (pGsm->bytGsmStateDefLast)
+#define wrdGsmStateDefTmr (pGsm->wrdGsmStateDefTmr)
+#define p_gsm_Msg_strcatState (pGsm->p_gsm_Msg_strcatState)
+#define p_gsm_Msg_ProcessState (pGsm->p_gsm_Msg_ProcessState)
+#define pstrGsmMsgSendTxt (pGsm->pstrGsmMsgSendTxt)
+#define pstrGsmMsgSendNum (pGsm->pstrGsmMsgSendNum)
+#define bitGsmMsgDelPending (pGsm->bitGsmMsgDelPending)
+#define bitGsmMsgWritePending (pGsm->bitGsmMsgWritePending)
+#define bitGsmMsgReadPending (pGsm->bitGsmMsgReadPending)
+#define bitGsmMsgSendPending (pGsm->bitGsmMsgSendPending)
+#define bitGsmMsgJustArrived (pGsm->bitGsmMsgJustArrived)
+#define p_gsm_GPRS_strcatState (pGsm->p_gsm_GPRS_strcatState)
+#define p_gsm_GPRS_ProcessState (pGsm->p_gsm_GPRS_ProcessState)
+#define bitGsmGprsPending (pGsm->bitGsmGprsPending)
+#define bitGsmGprsInProgress (pGsm->bitGsmGprsInProgress)
+#define pstrGsmGprsURL (pGsm->pstrGsmGprsURL)
+#define pstrGsmGprsData (pGsm->pstrGsmGprsData)
+#define wrdGsmGprsDataSize (pGsm->wrdGsmGprsDataSize)
+#define bitGsmGprsHttpKeepAlive (pGsm->bitGsmGprsHttpKeepAlive)
+#define bitGsmGprsRestartFlag (pGsm->bitGsmGprsRestartFlag)
+#define GsmRequests (pGsm->GsmRequests)
+#define bytGsmRequestCount (pGsm->bytGsmRequestCount)
+#define bytGsmRequestPriority (pGsm->bytGsmRequestPriority)
+#define dwdGsmMsTmr (pGsm->dwdGsmMsTmr)
+#define wrdGsmRequestSeq (pGsm->wrdGsmRequestSeq)
+#define GsmRequestJob (pGsm->GsmRequestJob)
+#define pGsmRequestJobDone (pGsm->pGsmRequestJobDone)
+#define bitExpectGSM_On (pGsm->bitExpectGSM_On)
+#define bitGSM_PowerOff (pGsm->bitGSM_PowerOff)
+#define bytGsmStateAfterOK (pGsm->bytGsmStateAfterOK)
+#define bytGsmCmdOKCtr (pGsm->bytGsmCmdOKCtr)
+#define bytGsmStateAfterReg (pGsm->bytGsmStateAfterReg)
+#define pstrGsmCommand (pGsm->pstrGsmCommand)
+#define bytGsmStateAfterCmdFail (pGsm->bytGsmStateAfterCmdFail)
+#define pstrGsmSetupBatch (pGsm->pstrGsmSetupBatch)
+#define bytGsmSetupBatchCount (pGsm->bytGsmSetupBatchCount)
+#define bitGsmSetupBatchFailed (pGsm->bitGsmSetupBatchFailed)
+#define strGsmOrigOrDestID (pGsm->strGsmOrigOrDestID)
+#define bytGSM_StatTmr (pGsm->bytGSM_StatTmr)
+#define bitGSM_Stat_On_State (pGsm->bitGSM_Stat_On_State)
+#define bitGSM_Ready (pGsm->bitGSM_Ready)
+#define dwdGsmUartBaudPrev (pGsm->dwdGsmUartBaudPrev)
+#define dwdGsmUartBaudSaved (pGsm->dwdGsmUartBaudSaved)
+#define bitGsmUartBaudFailed (pGsm->bitGsmUartBaudFailed)
+#define GsmUrcs (pGsm->GsmUrcs)
+#define bytGsmUrcCount (pGsm->bytGsmUrcCount)
+#define bitGsmCallRinging (pGsm->bitGsmCallRinging)
+#define bitGsmCallIdReported (pGsm->bitGsmCallIdReported)
+#define wrdGsmCallRingTmr (pGsm->wrdGsmCallRingTmr)
+#define dwdGsmTick (pGsm->dwdGsmTick)
+#define dwdGsmTickTx (pGsm->dwdGsmTickTx)
+#define pGsmFlows (pGsm->pGsmFlows)
+#define pGsmFlowOwner (pGsm->pGsmFlowOwner)
+#define pGsmFlowHolder (pGsm->pGsmFlowHolder)
+#define dwdGsmPollCycles (pGsm->dwdGsmPollCycles)
+#define dwdGsmPollCyclesMax (pGsm->dwdGsmPollCyclesMax)
+
+#endif /*#ifndef __GSM_CTX_H*/
@@ -1,4 +1,5 @@
 #include "GSM.h"
+#include "GSM_Ctx.h"
 #include "Str.h"
 
 // -- Constants --
@@ -7,43 +8,34 @@
 //       (when gsm_debug_state is defined)
 //       state names should not be longer than 26 characters
 //       i.e. last char here -----> x
-#ifdef __GNUC__
-const char gsmstEnableLTS = 200;
-#else
 #define gsmstEnableLTS 200
-#endif /*__GNUC__*/
-
-#ifdef gsm_debug_state
-#ifdef __GNUC__
-const char cstr_gsmstEnableLTS[] = "gsmstEnableLTS";
-#else
-#define cstr_gsmstEnableLTS[]  "gsmstEnableLTS"
-#endif
-#endif
 
 #ifdef gsm_debug_state
 static char gsm_MS_strcatState(char *to, char state) {
   switch (state) {
-    case gsmstEnableLTS: strcat(to, RomTxt30(&cstr_gsmstEnableLTS)); break;
+    case gsmstEnableLTS: strcat(to, RomTxt30("gsmstEnableLTS")); break;
     default: return 0; break;
   }
   return 1;
 }
 #endif
 
+static char gsm_MS_UrcReady(char *line, unsigned int length) {
+  // "Call Ready" / "SMS Ready" - sent by the module once it has started up
+  return 1; // Nothing to do, keep it away from the current state
+}
+
 static char gsm_MS_ProcessState(char dummy) {
   switch (bytGsmState) {
     case gsmstSetup_MSHI:
       // Entry from: (overload)
-      // Exit to: gsmstEnableLTS
-      gsmSetStateNext(gsmstEnableLTS, 1);
-      break;
-    case gsmstEnableLTS:
-      // -- Turn on LTS (Local TimeStamp) (Receive Time from Network) --
-      // Entry from: gsmstSetup_MSHI,
-      //             (timeout set by gsmstEnableLTS)
-      // Exit to: gsmstSetup_MSHO (after gsmstWaitOK)
-      gsmSetStateCmdOK("AT+CTZU=2", gsmstSetup_MSHO, 0); // Send the command to turn LTS on
+      // Exit to: gsmstSetup_MSHO (LTS added to the batched setup),
+      //          gsmstEnableLTS
+      if (gsmSetupBatchAdd("+CTZU=2")) {
+        gsmSetStateNext(gsmstSetup_MSHO, 1);
+      } else {
+        gsmSetStateNext(gsmstEnableLTS, 1);
+      }
       break;
     default:
       return 0; // State was not processed here
@@ -52,9 +44,32 @@ static char gsm_MS_ProcessState(char dummy) {
   return 1; // State was processed here
 }
 
-void gsm_MS_Init() {
+void gsm_MS_InstanceInit(TGsmContext *ctx) {
+  // Registers the module's states and URCs with an instance (after
+  // gsmInstanceInit())
+  TGsmStateDef def;
+  gsmCtxEnter(ctx);
   p_gsm_MS_ProcessState = &gsm_MS_ProcessState;
+  // -- Turn on LTS (Local TimeStamp) (Receive Time from Network) --
+  def.State = gsmstEnableLTS;
+  def.Cmd = "AT+CTZU=2";
+  def.Compose = 0;
+  def.Parse = 0;
+  def.Rsp = gsmrspOK;
+  def.Timeout = 1000;
+  def.Tries = 3;
+  def.NextOK = gsmstSetup_MSHO;
+  def.NextError = 0;
+  def.NextFail = 0;
+  gsmStateDefine(&def);
+  gsmUrcRegister("Call Ready", &gsm_MS_UrcReady);
+  gsmUrcRegister("SMS Ready", &gsm_MS_UrcReady);
   #ifdef gsm_debug_state
   p_gsm_MS_strcatState = &gsm_MS_strcatState;
   #endif
+  gsmCtxLeave();
+}
+
+void gsm_MS_Init() {
+  gsm_MS_InstanceInit(&GsmContextDefault);
 }
\ No newline at end of file
@@ -0,0 +1,250 @@
+// GSM library FreeRTOS port (gsm_rtos, see "RTOS" in GSM.c)
+// The library is run by one task, which polls every instance and blocks in
+// between on a task notification (from the GSM UART / DMA interrupts, or a
+// request from another task) or the next deadline (gsmNextDeadline()).
+#include "GSM.h"
+#include "GSM_Ctx.h"
+
+#ifdef gsm_rtos
+#include "queue.h"
+
+#define cGsmRtosStackSize     512 // Words
+#define cGsmRtosRequestQueLen 8
+#define cGsmRtosEventQueLen   8
+#define cGsmRtosSleepMax      1000 // Longest block without a notification (ms)
+#define cGsmRtosBusyMax       8 // Passes with work to do before giving up a tick
+
+typedef struct GsmRtosRequest {
+  TGsmContext *Ctx;
+  char Kind;
+  char Priority;
+  unsigned long Timeout;
+  char *Text;
+  char *Dest;
+  TGsmHandle Handle;
+  TGsmRequestDone Done;
+  void *User;
+} TGsmRtosRequest;
+
+TaskHandle_t hGsmTask = 0;
+QueueHandle_t hGsmRtosRequests = 0;
+QueueHandle_t hGsmRtosEvents = 0;
+static TGsmHandle wrdGsmRtosHandleSeq = 0; // Last handle given out
+
+static void gsmRtosRequestFailed(TGsmRtosRequest *req) {
+  // Reports a request which could not be qued on its instance (queue full)
+  TGsmResult result;
+  if (req->Kind == gsmreqMsgSend) {
+    gsmEvent(gsmevntMsgDiscarded);
+  } else if (req->Kind == gsmreqGprs) {
+    gsmEvent(gsmevntGprsFailed);
+  }
+  if (!req->Done) {
+    return;
+  }
+  memset(&result, 0, sizeof(result));
+  result.Ctx = req->Ctx;
+  result.Handle = req->Handle;
+  result.Kind = req->Kind;
+  result.Status = gsmresFailed;
+  result.User = req->User;
+  if (req->Kind == gsmreqMsgSend) {
+    result.Data.Msg.Message = req->Text;
+    result.Data.Msg.DestinationID = req->Dest;
+  } else if (req->Kind == gsmreqGprs) {
+    result.Data.Gprs.URL = req->Text;
+    result.Data.Gprs.PostData = req->Dest;
+  }
+  req->Done(&result);
+}
+
+static void gsmRtosRequestsTake() {
+  // Moves the requests qued by other tasks to their instance's request queue
+  TGsmRtosRequest req;
+  while (xQueueReceive(hGsmRtosRequests, &req, 0) == pdPASS) {
+    gsmCtxEnter(req.Ctx);
+    if (gsmRequestSubmit(req.Kind, req.Priority, req.Timeout, req.Text,
+                         req.Dest, req.Done, req.User)) {
+      // Keep the handle given to the other task (gsmRequestSubmit() adds
+      // the request at the end)
+      GsmRequests[bytGsmRequestCount - 1].Handle = req.Handle;
+    } else {
+      gsmRtosRequestFailed(&req);
+    }
+    gsmCtxLeave();
+  }
+}
+
+static void gsmRtosTask(void *argument) {
+  TGsmContext *ctx;
+  unsigned long wait;
+  unsigned long deadline;
+  TickType_t ticks;
+  char busy = 0;
+  for (;;) {
+    gsmRtosRequestsTake();
+    wait = cGsmRtosSleepMax;
+    for (ctx = pGsmFirst; ctx; ctx = ctx->pNext) {
+      gsmInstancePoll(ctx);
+      deadline = gsmInstanceNextDeadline(ctx);
+      if (deadline < wait) {
+        wait = deadline;
+      }
+    }
+    if (wait) {
+      busy = 0;
+      ticks = pdMS_TO_TICKS(wait);
+      if (!ticks) {
+        ticks = 1; // (tick longer than 1ms)
+      }
+      ulTaskNotifyTake(pdTRUE, ticks);
+    } else if (++busy >= cGsmRtosBusyMax) {
+      // Let lower priority tasks run (states which poll for something only
+      // they know about always report work to do)
+      busy = 0;
+      ulTaskNotifyTake(pdTRUE, 1);
+    }
+  }
+}
+
+char gsmRtosStart(UBaseType_t priority) {
+  // Creates the GSM task (after gsmInit() / gsmInstanceInit() and the module
+  // Init routines), from which the library is run from then on
+  // Returns 1 if successful, 0 if out of memory
+  hGsmRtosRequests = xQueueCreate(cGsmRtosRequestQueLen, sizeof(TGsmRtosRequest));
+  hGsmRtosEvents = xQueueCreate(cGsmRtosEventQueLen, sizeof(TGsmRtosEvent));
+  if (!hGsmRtosRequests || !hGsmRtosEvents) {
+    return 0;
+  }
+  if (xTaskCreate(&gsmRtosTask, "GSM", cGsmRtosStackSize, 0, priority,
+                  &hGsmTask) != pdPASS) {
+    return 0;
+  }
+  return 1;
+}
+
+void gsmRtosNotifyFromISR() {
+  // Wakes the GSM task (from the GSM UART / DMA interrupts)
+  BaseType_t woken = pdFALSE;
+  if (hGsmTask) {
+    vTaskNotifyGiveFromISR(hGsmTask, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+}
+
+TGsmHandle gsmRtosRequest(TGsmContext *ctx, char kind, char priority,
+                          unsigned long timeout, char *text, char *dest,
+                          TGsmRequestDone done, void *user, TickType_t wait) {
+  // Ques a request (see gsmRequestSubmit()) for an instance (0 for the
+  // default one) from another task, waiting up to wait ticks for room
+  // done (if not 0) is called from the GSM task, also with gsmresFailed if
+  // the instance's request queue is full; text and dest must stay valid
+  // until then (or, without done, until the request has been run)
+  // Returns the request's handle, 0 if the queue stayed full (or the GSM
+  // task has not been started)
+  TGsmRtosRequest req;
+  if (!hGsmRtosRequests) {
+    return 0;
+  }
+  req.Ctx = ctx ? ctx : &GsmContextDefault;
+  req.Kind = kind;
+  req.Priority = priority;
+  req.Timeout = timeout;
+  req.Text = text;
+  req.Dest = dest;
+  req.Done = done;
+  req.User = user;
+  taskENTER_CRITICAL();
+  wrdGsmRtosHandleSeq = (wrdGsmRtosHandleSeq + 1) & ~cGsmRtosHandle;
+  if (!wrdGsmRtosHandleSeq) {
+    wrdGsmRtosHandleSeq = 1;
+  }
+  req.Handle = wrdGsmRtosHandleSeq | cGsmRtosHandle;
+  taskEXIT_CRITICAL();
+  if (xQueueSend(hGsmRtosRequests, &req, wait) != pdPASS) {
+    return 0;
+  }
+  xTaskNotifyGive(hGsmTask);
+  return req.Handle;
+}
+
+// The requests below keep the caller's strings, which the GSM task reads
+// when it runs them: done is required, and the strings must stay valid until
+// it has been called (returns 0 without done)
+
+TGsmHandle gsmRtosMsgSend(TGsmContext *ctx, char *Message, char *DestinationID,
+                          TGsmRequestDone done, void *user) {
+  if (!done) {
+    return 0;
+  }
+  return gsmRtosRequest(ctx, gsmreqMsgSend, gsmprioUrgent, 0, Message,
+                        DestinationID, done, user, portMAX_DELAY);
+}
+
+TGsmHandle gsmRtosHttpGet(TGsmContext *ctx, char *url, TGsmRequestDone done,
+                          void *user) {
+  if (!done) {
+    return 0;
+  }
+  return gsmRtosRequest(ctx, gsmreqGprs, gsmprioBulk, 0, url, 0, done, user,
+                        portMAX_DELAY);
+}
+
+TGsmHandle gsmRtosHttpPost(TGsmContext *ctx, char *url, char *postdata,
+                           TGsmRequestDone done, void *user) {
+  if (!done) {
+    return 0;
+  }
+  return gsmRtosRequest(ctx, gsmreqGprs, gsmprioBulk, 0, url, postdata, done,
+                        user, portMAX_DELAY);
+}
+
+char gsmRtosEventPost(char GsmEventType) {
+  // Copies the event (and its data) for the other tasks (gsmRtosEventGet())
+  // Called from gsmEvent(), in the GSM task
+  // Returns 0 if the event queue is full (the event is lost)
+  // (the variables only hold data for the events which set them, see
+  // gsmEvent() in GSM.c; the data need not be null-terminated)
+  TGsmRtosEvent event;
+  event.Ctx = pGsm;
+  event.Type = GsmEventType;
+  event.OriginatorID[0] = 0;
+  event.DataLen = 0;
+  switch (GsmEventType) {
+    case gsmevntMissedCall:
+      if (pstrGsmEventOriginatorID) {
+        strncpy(event.OriginatorID, pstrGsmEventOriginatorID,
+                sizeof(event.OriginatorID) - 1);
+        event.OriginatorID[sizeof(event.OriginatorID) - 1] = 0;
+      }
+      break;
+    case gsmevntIMEI_Read:
+    case gsmevntGprsHttpResultErr:
+    case gsmevntGprsHttpResponseLine:
+      if (pstrGsmEventData) {
+        event.DataLen = wrdGsmEventDataLen;
+        if (event.DataLen > cGsmRtosEventDataMax) {
+          event.DataLen = cGsmRtosEventDataMax;
+        }
+        memcpy(event.Data, pstrGsmEventData, event.DataLen);
+      }
+      break;
+  }
+  event.Data[event.DataLen] = 0;
+  event.DateTime = dtmGsmEvent;
+  if (xQueueSend(hGsmRtosEvents, &event, 0) != pdPASS) {
+    return 0;
+  }
+  return 1;
+}
+
+char gsmRtosEventGet(TGsmRtosEvent *event, TickType_t wait) {
+  // Takes the oldest event posted (gsmRtosEventPost()), waiting up to wait
+  // ticks for one
+  // Returns 1 if successful, 0 if there was none
+  if (xQueueReceive(hGsmRtosEvents, event, wait) != pdPASS) {
+    return 0;
+  }
+  return 1;
+}
+#endif
@@ -0,0 +1,101 @@
+// Benchmark of the per-line cost of gsmRspClassify() against a chain of
+// memcmp() calls over the same tokens (as the states compared the lines
+// before), on the lines of the trace (trace_m95.h).
+// Usage: bench_rsp [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "GSM.h"
+#include "trace_m95.h"
+
+#define cBenchLinesMax 64
+
+typedef struct {
+  char *Text;
+  unsigned int Length;
+} TBenchLine;
+
+#define bench_rsp_token(name, token, mid, last) {token, sizeof(token) - 1},
+static const struct {
+  char *Token;
+  unsigned int Length;
+} BenchRsps[] = {{"", 0}, gsm_rsp_table(bench_rsp_token)};
+#undef bench_rsp_token
+
+static TBenchLine BenchLines[cBenchLinesMax];
+static char strBenchTrace[sizeof(strTraceM95)];
+
+__attribute__((noinline))
+static char benchClassifyChain(char *line, unsigned int length) {
+  // The response type by comparing the line with each token in turn
+  char rsp;
+  unsigned int len;
+  for (rsp = 1; rsp < gsmrspCount; rsp++) {
+    len = BenchRsps[(unsigned char)rsp].Length;
+    if ((length >= len) && (memcmp(line, BenchRsps[(unsigned char)rsp].Token, len) == 0) &&
+        ((length == len) || (line[len] == ':'))) {
+      return rsp;
+    }
+  }
+  return gsmrspNone;
+}
+
+static unsigned int benchLinesSplit() {
+  // Splits the trace into its (non-empty) lines, null-terminated as framed
+  unsigned int count = 0;
+  char *pos = strBenchTrace, *end;
+  memcpy(strBenchTrace, strTraceM95, sizeof(strBenchTrace));
+  while ((end = strstr(pos, "\r\n")) && (count < cBenchLinesMax)) {
+    *end = 0;
+    if (end != pos) {
+      BenchLines[count].Text = pos;
+      BenchLines[count].Length = end - pos;
+      count++;
+    }
+    pos = end + 2;
+  }
+  return count;
+}
+
+static double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long benchRun(const char *name,
+                              char (*classify)(char *line, unsigned int length),
+                              unsigned int lines, unsigned long rounds) {
+  // Returns a sum of the types found
+  unsigned long r, sum = 0;
+  unsigned int i;
+  double start, secs;
+  start = benchNow();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < lines; i++) {
+      sum += classify(BenchLines[i].Text, BenchLines[i].Length);
+    }
+  }
+  secs = benchNow() - start;
+  printf("rsp: %-8s %.1f ns/line\n", name, secs * 1e9 / ((double)rounds * lines));
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  unsigned long rounds = (argc > 1) ? atol(argv[1]) : 200000;
+  unsigned int lines = benchLinesSplit();
+  unsigned int i;
+  int failed = 0;
+  for (i = 0; i < lines; i++) {
+    if (gsmRspClassify(BenchLines[i].Text, BenchLines[i].Length) !=
+        benchClassifyChain(BenchLines[i].Text, BenchLines[i].Length)) {
+      printf("rsp: FAILED, types differ for [%s]\n", BenchLines[i].Text);
+      failed = 1;
+    }
+  }
+  benchRun("hash", &gsmRspClassify, lines, rounds);
+  benchRun("memcmp", &benchClassifyChain, lines, rounds);
+  return failed;
+}
@@ -0,0 +1,89 @@
+// Benchmark of the receive path: the trace (trace_m95.h) is delivered through
+// the circular DMA in bursts, each followed by the idle line interrupt
+// (HostUartRx()), and gsmPoll() frames the lines and hands them to the URC
+// table, in standby.
+// Usage: bench_rx [burst size (characters, default 64)] [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "GSM.h"
+#include "trace_m95.h"
+
+static unsigned long dwdLines;
+
+static char benchUrcCount(char *line, unsigned int length) {
+  // Sees every line (registered last, with an empty prefix)
+  dwdLines++;
+  return 0;
+}
+
+static unsigned long benchTraceLines() {
+  // Lines in the trace (empty ones included, as they are framed)
+  unsigned long lines = 0;
+  unsigned int i;
+  for (i = 1; i < sizeof(strTraceM95) - 1; i++) {
+    if ((strTraceM95[i] == '\n') && (strTraceM95[i - 1] == '\r')) {
+      lines++;
+    }
+  }
+  return lines;
+}
+
+static double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void benchPollIdle() {
+  // Polls until there is nothing left to do
+  char i;
+  for (i = 0; (i < 64) && !gsmNextDeadline(); i++) {
+    gsmPoll();
+  }
+}
+
+static void benchRound(unsigned int burst) {
+  // Delivers the trace once, in bursts
+  unsigned int length = sizeof(strTraceM95) - 1;
+  unsigned int pos, count;
+  for (pos = 0; pos < length; pos += count) {
+    count = (length - pos < burst) ? length - pos : burst;
+    HostUartRx(&UartGSMHandle, strTraceM95 + pos, count);
+    benchPollIdle();
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned int burst = (argc > 1) ? atoi(argv[1]) : 64;
+  unsigned long rounds = (argc > 2) ? atol(argv[2]) : 2000;
+  unsigned int length = sizeof(strTraceM95) - 1;
+  unsigned long r, expect;
+  double start, secs;
+  if (!burst) {
+    burst = 64;
+  }
+  UART_GSM_Init();
+  gsmInit();
+  gsm_MS_Init();
+  gsmUrcRegister("", &benchUrcCount);
+  GsmContextDefault.bytGsmState = gsmstStandby; // (module ready)
+  expect = benchTraceLines();
+  benchRound(burst); // (warms up)
+  dwdLines = 0;
+  start = benchNow();
+  for (r = 0; r < rounds; r++) {
+    benchRound(burst);
+  }
+  secs = benchNow() - start;
+  printf("rx: %lu rounds of %u characters in bursts of %u: %.1f ns/character, "
+         "%.1f ns/line\n", rounds, length, burst, secs * 1e9 / (rounds * length),
+         secs * 1e9 / (rounds * expect));
+  if ((dwdLines != rounds * expect) ||
+      (GsmContextDefault.wrdGsmUartRxRingHead != GsmContextDefault.wrdGsmUartRxRingTail)) {
+    printf("rx: FAILED, %lu lines of %lu\n", dwdLines, rounds * expect);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+// Micro-benchmark of strScanChar() (with str_scan_swar if it is defined, see
+// GSM.h) against the per-character scan (strScanChar() without it) and
+// memchr(), on the trace (trace_m95.h), scanned for the line ends as the
+// line framing does and for the ':' ending the response tokens.
+// Usage: bench_scan [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "GSM.h"
+#include "Str.h"
+#include "trace_m95.h"
+
+#ifdef str_scan_swar
+#define cBenchScanName "swar"
+#else
+#define cBenchScanName "strScan"
+#endif
+
+typedef unsigned int (*TBenchScan)(char *buf, unsigned int len, char c);
+
+__attribute__((noinline))
+static unsigned int benchScanBytes(char *buf, unsigned int len, char c) {
+  // strScanChar() without str_scan_swar
+  unsigned int pos = 0;
+  while (pos < len) {
+    if (buf[pos] == c) {
+      return pos;
+    }
+    pos++;
+  }
+  return len;
+}
+
+__attribute__((noinline))
+static unsigned int benchScanMemchr(char *buf, unsigned int len, char c) {
+  char *found = memchr(buf, c, len);
+  return found ? found - buf : len;
+}
+
+static double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long benchRun(const char *name, TBenchScan scan, char c,
+                              unsigned long rounds) {
+  // Scans the trace from each occurrence of c to the next (as the framing
+  // does for the line ends), returning the number found
+  static char trace[sizeof(strTraceM95)];
+  unsigned int length = sizeof(strTraceM95) - 1;
+  unsigned int pos;
+  unsigned long r, found = 0;
+  double start, secs;
+  memcpy(trace, strTraceM95, sizeof(trace));
+  start = benchNow();
+  for (r = 0; r < rounds; r++) {
+    for (pos = 0; pos < length; pos++) {
+      pos += scan(trace + pos, length - pos, c);
+      found += (pos < length);
+    }
+  }
+  secs = benchNow() - start;
+  printf("scan '%s': %-8s %.2f ns/character\n", c == 10 ? "\\n" : ":", name,
+         secs * 1e9 / ((double)rounds * length));
+  return found;
+}
+
+int main(int argc, char **argv) {
+  unsigned long rounds = (argc > 1) ? atol(argv[1]) : 20000;
+  unsigned long found;
+  char chars[2] = {10, ':'};
+  char i;
+  int failed = 0;
+  for (i = 0; i < 2; i++) {
+    found = benchRun("bytes", &benchScanBytes, chars[i], rounds);
+    if ((benchRun(cBenchScanName, &strScanChar, chars[i], rounds) != found) ||
+        (benchRun("memchr", &benchScanMemchr, chars[i], rounds) != found)) {
+      printf("scan: FAILED, results differ\n");
+      failed = 1;
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,64 @@
+// Host counterpart of the GSM parts of stm32l4xx_it.c and
+// stm32l4xx_hal_msp.c: routes the HAL stand-in's interrupts and callbacks to
+// the library's entry points (for every instance, as the library ignores the
+// UARTs no instance uses).
+
+#include "GSM.h"
+
+#pragma weak gsmEvent // (the host program's, if it has one)
+void gsmEvent(char GsmEventType) {}
+
+void HAL_UART_MspInit(UART_HandleTypeDef *huart) {
+  // Links the GSM UART's DMA channels (further instances link their own)
+  if (huart == &UartGSMHandle) {
+    #ifdef gsm_dma_uart_rx
+    hdmaGsmRx.Instance = USART_GSM_RX_DMA_CHANNEL;
+    hdmaGsmRx.Init.Request = USART_GSM_RX_DMA_REQUEST;
+    hdmaGsmRx.Init.Mode = DMA_CIRCULAR;
+    hdmaGsmRx.Parent = huart;
+    huart->hdmarx = &hdmaGsmRx;
+    #endif
+    #ifdef gsm_dma_uart_tx
+    hdmaGsmTx.Instance = USART_GSM_TX_DMA_CHANNEL;
+    hdmaGsmTx.Init.Request = USART_GSM_TX_DMA_REQUEST;
+    hdmaGsmTx.Init.Mode = DMA_NORMAL;
+    hdmaGsmTx.Parent = huart;
+    huart->hdmatx = &hdmaGsmTx;
+    #endif
+  }
+}
+
+void SysTick_Handler(void) {
+  HAL_IncTick();
+  gsm1msPing();
+}
+
+#ifdef gsm_dma_uart_rx
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+  gsmUartRxPublish(huart);
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {
+  gsmUartRxPublish(huart);
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+  gsmUartRxDmaError(huart);
+}
+#endif
+
+#ifdef gsm_dma_uart_tx
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+  gsmUartTxDmaDone(huart);
+}
+#endif
+
+void HostUartIRQHandler(UART_HandleTypeDef *huart) {
+  // (USART_GSM_IRQHandler())
+  #ifdef gsm_dma_uart_rx
+  if (__HAL_UART_GET_FLAG(huart, UART_FLAG_IDLE) != RESET) {
+    __HAL_UART_CLEAR_IDLEFLAG(huart);
+    gsmUartRxPublish(huart);
+  }
+  #endif
+}
@@ -0,0 +1,179 @@
+#ifndef __STM32L4xx_HAL_H
+#define __STM32L4xx_HAL_H
+// Host stand-in for the parts of the STM32L4 HAL which the GSM library uses,
+// so that it can be built and run on a Linux host (see Makefile).
+// The UARTs and DMA channels are plain structures; stm32l4xx_hal_host.c
+// implements the HAL routines on them and plays the role of the line and
+// of the interrupts (HostUartRx(), HostUartTxDmaDone(), HostTickAdd()).
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {HAL_OK = 0, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT} HAL_StatusTypeDef;
+typedef enum {RESET = 0, SET = !RESET} FlagStatus;
+typedef enum {GPIO_PIN_RESET = 0, GPIO_PIN_SET} GPIO_PinState;
+
+// -- Core --
+typedef struct {
+  volatile uint32_t CTRL;
+  volatile uint32_t CYCCNT;
+} DWT_Type;
+typedef struct {
+  volatile uint32_t DEMCR;
+} CoreDebug_Type;
+extern DWT_Type *HostDwt(void); // (CYCCNT follows the host clock)
+extern CoreDebug_Type HostCoreDebug;
+extern uint32_t SystemCoreClock;
+#define DWT       (HostDwt())
+#define CoreDebug (&HostCoreDebug)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk     (1UL << 0)
+
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+#define __DMB() __asm__ volatile("" ::: "memory")
+
+// -- GPIO --
+typedef struct {
+  volatile uint32_t IDR;
+  volatile uint32_t ODR;
+  volatile uint32_t BSRR;
+  volatile uint32_t BRR;
+} GPIO_TypeDef;
+extern GPIO_TypeDef HostGpioA, HostGpioB, HostGpioC, HostGpioE;
+#define GPIOA (&HostGpioA)
+#define GPIOB (&HostGpioB)
+#define GPIOC (&HostGpioC)
+#define GPIOE (&HostGpioE)
+#define GPIO_PIN_0  ((uint16_t)0x0001)
+#define GPIO_PIN_1  ((uint16_t)0x0002)
+#define GPIO_PIN_7  ((uint16_t)0x0080)
+#define GPIO_PIN_10 ((uint16_t)0x0400)
+#define GPIO_PIN_11 ((uint16_t)0x0800)
+#define GPIO_PIN_12 ((uint16_t)0x1000)
+#define GPIO_PIN_15 ((uint16_t)0x8000)
+#define __HAL_RCC_GPIOA_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_GPIOB_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_GPIOE_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_DMA2_CLK_ENABLE()  ((void)0)
+#define __HAL_RCC_UART4_CLK_ENABLE() ((void)0)
+
+// -- DMA --
+typedef struct {
+  volatile uint32_t CNDTR; // Transfers left (counts down, reloaded in
+                           // circular mode)
+} DMA_Channel_TypeDef;
+typedef struct {
+  uint32_t Request;
+  uint32_t Mode;
+} DMA_InitTypeDef;
+typedef struct __DMA_HandleTypeDef {
+  DMA_Channel_TypeDef *Instance;
+  DMA_InitTypeDef Init;
+  void *Parent;
+} DMA_HandleTypeDef;
+extern DMA_Channel_TypeDef HostDma2Channel3, HostDma2Channel5;
+#define DMA2_Channel3 (&HostDma2Channel3)
+#define DMA2_Channel5 (&HostDma2Channel5)
+#define DMA_REQUEST_2 2
+#define DMA_NORMAL    0
+#define DMA_CIRCULAR  1
+#define __HAL_DMA_GET_COUNTER(h) ((h)->Instance->CNDTR)
+
+// -- UART --
+typedef struct {
+  volatile uint32_t CR1;
+  volatile uint32_t ISR;
+  volatile uint32_t ICR;
+  volatile uint32_t RDR;
+  volatile uint32_t TDR;
+  // Host: characters on the line not yet read (polled reception)
+  uint8_t HostRx[256];
+  uint32_t HostRxHead;
+  uint32_t HostRxTail;
+} USART_TypeDef;
+extern USART_TypeDef HostUart4, HostUart5, HostLpuart1;
+#define UART4   (&HostUart4)
+#define UART5   (&HostUart5)
+#define LPUART1 (&HostLpuart1)
+typedef enum {UART4_IRQn = 52, UART5_IRQn = 53, LPUART1_IRQn = 70} IRQn_Type;
+
+typedef struct {
+  uint32_t BaudRate;
+  uint32_t WordLength;
+  uint32_t StopBits;
+  uint32_t Parity;
+  uint32_t Mode;
+  uint32_t HwFlowCtl;
+  uint32_t OverSampling;
+} UART_InitTypeDef;
+typedef struct __UART_HandleTypeDef {
+  USART_TypeDef *Instance;
+  UART_InitTypeDef Init;
+  uint8_t *pRxBuffPtr;
+  uint16_t RxXferSize;
+  DMA_HandleTypeDef *hdmatx;
+  DMA_HandleTypeDef *hdmarx;
+  volatile uint32_t gState;
+  volatile uint32_t RxState;
+  volatile uint32_t ErrorCode;
+} UART_HandleTypeDef;
+
+#define UART_WORDLENGTH_8B     0x00000000U
+#define UART_STOPBITS_1        0x00000000U
+#define UART_PARITY_NONE       0x00000000U
+#define UART_MODE_TX_RX        0x0000000CU
+#define UART_HWCONTROL_NONE    0x00000000U
+#define UART_HWCONTROL_RTS     0x00000100U
+#define UART_HWCONTROL_CTS     0x00000200U
+#define UART_HWCONTROL_RTS_CTS 0x00000300U
+#define HAL_UART_STATE_RESET   0x00000000U
+#define HAL_UART_STATE_READY   0x00000020U
+#define HAL_UART_STATE_BUSY_TX 0x00000021U
+#define HAL_UART_STATE_BUSY_RX 0x00000022U
+#define UART_FLAG_IDLE   0x00000010U
+#define UART_FLAG_RXNE   0x00000020U
+#define UART_FLAG_TC     0x00000040U
+#define UART_CLEAR_IDLEF 0x00000010U
+#define UART_IT_IDLE     0x00000010U
+#define UART_IT_RXNE     0x00000020U
+#define __HAL_UART_GET_FLAG(h, f)      ((((h)->Instance->ISR) & (f)) == (f))
+#define __HAL_UART_CLEAR_FLAG(h, f)    ((h)->Instance->ISR &= ~(uint32_t)(f))
+#define __HAL_UART_CLEAR_IDLEFLAG(h)   __HAL_UART_CLEAR_FLAG((h), UART_CLEAR_IDLEF)
+#define __HAL_UART_ENABLE_IT(h, i)     ((h)->Instance->CR1 |= (i))
+#define __HAL_UART_DISABLE_IT(h, i)    ((h)->Instance->CR1 &= ~(uint32_t)(i))
+#define __HAL_UART_GET_IT_SOURCE(h, i) ((((h)->Instance->CR1) & (i)) ? SET : RESET)
+
+extern HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+extern HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size, uint32_t Timeout);
+extern HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size, uint32_t Timeout);
+extern HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size);
+extern HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size);
+extern HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart);
+extern HAL_StatusTypeDef UART_CheckIdleState(UART_HandleTypeDef *huart);
+// Callbacks (weak, as in the HAL: the application's take their place)
+extern void HAL_UART_MspInit(UART_HandleTypeDef *huart);
+extern void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+extern void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+extern void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart);
+extern void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+// -- Tick --
+extern uint32_t HAL_GetTick(void);
+extern void HAL_Delay(uint32_t Delay);
+extern void HAL_IncTick(void);
+
+// -- Host side (the line and the interrupts) --
+extern void HostUartRx(UART_HandleTypeDef *huart, const char *data,
+                       unsigned int length);
+extern void HostUartIRQHandler(UART_HandleTypeDef *huart);
+extern void HostUartTxDmaDone(UART_HandleTypeDef *huart);
+extern void (*pHostUartTx)(UART_HandleTypeDef *huart, const uint8_t *data,
+                           uint16_t length);
+extern void HostTickAdd(uint32_t ms);
+
+#endif /*__STM32L4xx_HAL_H*/
@@ -0,0 +1,202 @@
+// Host implementation of the HAL stand-in (stm32l4xx_hal.h)
+// The UART line and the interrupts are played by the host program:
+// HostUartRx() delivers characters (through the circular DMA, with the half /
+// full transfer callbacks and the idle line interrupt, or to be read by
+// polling), HostTickAdd() lets time pass (SysTick_Handler() every ms, which
+// also ends the DMA transmissions under way).
+
+#include <time.h>
+#include "stm32l4xx_hal.h"
+
+#define cHostTxDmaMax 4
+
+DWT_Type HostDwtRegs;
+CoreDebug_Type HostCoreDebug;
+uint32_t SystemCoreClock = 80000000;
+GPIO_TypeDef HostGpioA, HostGpioB, HostGpioC, HostGpioE;
+DMA_Channel_TypeDef HostDma2Channel3, HostDma2Channel5;
+USART_TypeDef HostUart4, HostUart5, HostLpuart1;
+void (*pHostUartTx)(UART_HandleTypeDef *huart, const uint8_t *data,
+                    uint16_t length) = 0;
+
+static volatile uint32_t uwTick;
+static UART_HandleTypeDef *pHostTxDma[cHostTxDmaMax]; // Transmissions under way
+
+DWT_Type *HostDwt(void) {
+  // Cycle counter at SystemCoreClock, from the host's monotonic clock
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  HostDwtRegs.CYCCNT = (uint32_t)(((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) *
+                                  (SystemCoreClock / 1000000) / 1000);
+  return &HostDwtRegs;
+}
+
+// -- Weak callbacks (as in the HAL) --
+__attribute__((weak)) void HAL_UART_MspInit(UART_HandleTypeDef *huart) {}
+__attribute__((weak)) void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {}
+__attribute__((weak)) void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {}
+__attribute__((weak)) void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {}
+__attribute__((weak)) void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {}
+__attribute__((weak)) void HostUartIRQHandler(UART_HandleTypeDef *huart) {}
+__attribute__((weak)) void SysTick_Handler(void) {
+  HAL_IncTick();
+}
+
+// -- Tick --
+uint32_t HAL_GetTick(void) {
+  return uwTick;
+}
+
+void HAL_IncTick(void) {
+  uwTick++;
+}
+
+void HAL_Delay(uint32_t Delay) {
+  HostTickAdd(Delay);
+}
+
+// -- UART --
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart) {
+  if (huart->gState == HAL_UART_STATE_RESET) {
+    HAL_UART_MspInit(huart);
+  }
+  huart->gState = HAL_UART_STATE_READY;
+  huart->RxState = HAL_UART_STATE_READY;
+  huart->ErrorCode = 0;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef UART_CheckIdleState(UART_HandleTypeDef *huart) {
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+  if (pHostUartTx) {
+    pHostUartTx(huart, pData, Size);
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size) {
+  // Sent at once; the transfer complete callback follows with the next tick
+  // (or HostUartTxDmaDone())
+  char i;
+  if (huart->gState != HAL_UART_STATE_READY) {
+    return HAL_BUSY;
+  }
+  for (i = 0; (i < cHostTxDmaMax) && pHostTxDma[i]; i++);
+  if (i == cHostTxDmaMax) {
+    return HAL_BUSY;
+  }
+  pHostTxDma[i] = huart;
+  huart->gState = HAL_UART_STATE_BUSY_TX;
+  if (pHostUartTx) {
+    pHostUartTx(huart, pData, Size);
+  }
+  return HAL_OK;
+}
+
+void HostUartTxDmaDone(UART_HandleTypeDef *huart) {
+  // Ends the DMA transmission under way on huart (transfer complete interrupt)
+  char i;
+  for (i = 0; i < cHostTxDmaMax; i++) {
+    if (pHostTxDma[i] == huart) {
+      pHostTxDma[i] = 0;
+      huart->gState = HAL_UART_STATE_READY;
+      HAL_UART_TxCpltCallback(huart);
+      return;
+    }
+  }
+}
+
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+  USART_TypeDef *uart = huart->Instance;
+  while (Size) {
+    if (uart->HostRxTail == uart->HostRxHead) {
+      return HAL_TIMEOUT;
+    }
+    *pData++ = uart->HostRx[uart->HostRxTail++ % sizeof(uart->HostRx)];
+    Size--;
+  }
+  if (uart->HostRxTail == uart->HostRxHead) {
+    uart->ISR &= ~UART_FLAG_RXNE;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart,
+  uint8_t *pData, uint16_t Size) {
+  // (circular)
+  if (huart->RxState != HAL_UART_STATE_READY) {
+    return HAL_BUSY;
+  }
+  huart->pRxBuffPtr = pData;
+  huart->RxXferSize = Size;
+  huart->hdmarx->Instance->CNDTR = Size;
+  huart->RxState = HAL_UART_STATE_BUSY_RX;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart) {
+  char i;
+  for (i = 0; i < cHostTxDmaMax; i++) {
+    if (pHostTxDma[i] == huart) {
+      pHostTxDma[i] = 0;
+    }
+  }
+  huart->gState = HAL_UART_STATE_READY;
+  huart->RxState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+// -- The line and the interrupts --
+void HostUartRx(UART_HandleTypeDef *huart, const char *data,
+                unsigned int length) {
+  // Characters received on huart, after which the line goes idle
+  USART_TypeDef *uart = huart->Instance;
+  DMA_Channel_TypeDef *dma;
+  if ((huart->RxState == HAL_UART_STATE_BUSY_RX) && huart->hdmarx) {
+    dma = huart->hdmarx->Instance;
+    while (length--) {
+      huart->pRxBuffPtr[huart->RxXferSize - dma->CNDTR] = *data++;
+      dma->CNDTR--;
+      if (dma->CNDTR == huart->RxXferSize / 2) {
+        HAL_UART_RxHalfCpltCallback(huart);
+      } else if (dma->CNDTR == 0) {
+        dma->CNDTR = huart->RxXferSize; // (circular)
+        HAL_UART_RxCpltCallback(huart);
+      }
+    }
+  } else {
+    while (length--) {
+      if ((uart->HostRxHead - uart->HostRxTail) < sizeof(uart->HostRx)) {
+        uart->HostRx[uart->HostRxHead++ % sizeof(uart->HostRx)] = *data;
+      } // (else overrun)
+      data++;
+    }
+    if (uart->HostRxHead != uart->HostRxTail) {
+      uart->ISR |= UART_FLAG_RXNE;
+    }
+  }
+  uart->ISR |= UART_FLAG_IDLE;
+  if (uart->CR1 & UART_IT_IDLE) {
+    HostUartIRQHandler(huart);
+  }
+}
+
+void HostTickAdd(uint32_t ms) {
+  // Lets ms pass: the DMA transmissions under way end, then SysTick_Handler()
+  // runs every ms
+  char i;
+  while (ms--) {
+    for (i = 0; i < cHostTxDmaMax; i++) {
+      if (pHostTxDma[i]) {
+        HostUartTxDmaDone(pHostTxDma[i]);
+      }
+    }
+    SysTick_Handler();
+  }
+}
@@ -0,0 +1,65 @@
+// Flows: a burst holding a URC between a command's response lines, while a
+// flow awaits the final response. Checks that the URC still goes through the
+// URC table (RING sets bitGsmCallRinging) and that the flow gets its "OK".
+
+#include <stdio.h>
+#include <string.h>
+#include "GSM.h"
+
+#define check(cond) testCheck((cond), #cond, __LINE__)
+
+static int intFailed;
+static char bitCmdSent;
+static char bytRsp = gsmrspNone;
+static char bitFlowDone;
+static TGsmFlow FlowCsq;
+
+static void testCheck(char ok, const char *cond, int line) {
+  if (!ok) {
+    printf("flows: FAILED line %d: %s\n", line, cond);
+    intFailed++;
+  }
+}
+
+static void testUartTx(UART_HandleTypeDef *huart, const uint8_t *data,
+                       uint16_t length) {
+  if ((length >= 6) && (memcmp(data, "AT+CSQ", 6) == 0)) {
+    bitCmdSent = 1;
+  }
+}
+
+static char flowCsq(TGsmFlow *f) {
+  gsmFlowBegin(f);
+  gsmFlowSend(f, "AT+CSQ");
+  gsmFlowAwait(f, gsmrspOK, 300);
+  bytRsp = f->Rsp;
+  bitFlowDone = 1;
+  gsmFlowEnd(f);
+}
+
+int main() {
+  int ms;
+  pHostUartTx = &testUartTx;
+  UART_GSM_Init();
+  gsmInit();
+  gsm_MS_Init();
+  GsmContextDefault.bytGsmState = gsmstFlow;
+  check(gsmFlowStart(&FlowCsq, &flowCsq));
+  for (ms = 0; (ms < 1000) && !bitFlowDone; ms++) {
+    gsmPoll();
+    if (bitCmdSent) {
+      bitCmdSent = 0;
+      HostUartRx(&UartGSMHandle, "\r\n+CSQ: 20,0\r\n\r\nRING\r\n\r\nOK\r\n", 28);
+    }
+    HostTickAdd(1);
+  }
+  check(bitFlowDone);
+  check(bytRsp == gsmrspOK);
+  check(ms < 300); // (not the timeout)
+  check(GsmContextDefault.bitGsmCallRinging);
+
+  if (!intFailed) {
+    printf("flows: ok\n");
+  }
+  return intFailed != 0;
+}
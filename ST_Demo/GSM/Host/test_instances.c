@@ -0,0 +1,125 @@
+// Two instances side by side: the default one (UartGSMHandle, UART4) and
+// GsmModem2 (UART5). Checks that each instance's characters, lines, timers
+// and requests stay its own, that the interrupts arriving in the middle of
+// a gsmInstancePoll() of the other instance leave the instance being run
+// alone, and that gsmInstanceInit() on a live instance keeps what the
+// modules registered.
+
+#include <stdio.h>
+#include "GSM.h"
+
+#define check(cond) testCheck((cond), #cond, __LINE__)
+
+TGsmContext GsmModem2;
+UART_HandleTypeDef UartModem2;
+DMA_HandleTypeDef hdmaModem2Rx;
+DMA_Channel_TypeDef dmaModem2Rx;
+const TGsmPins GsmModem2Pins = {GPIOB, GPIO_PIN_0, GPIOB, GPIO_PIN_1,
+                                GPIOB, GPIO_PIN_7, GPIOB, GPIO_PIN_15};
+
+extern void testModuleInit(TGsmContext *ctx, char *prefix,
+                           char (*handler)(char *line, unsigned int length));
+
+static int intFailed;
+static unsigned int wrdLines[2];     // Lines seen (default, GsmModem2)
+static char bitInterruptedOk = 1;    // Interrupts left the instance alone
+
+static void testCheck(char ok, const char *cond, int line) {
+  if (!ok) {
+    printf("instances: FAILED line %d: %s\n", line, cond);
+    intFailed++;
+  }
+}
+
+static char testUrc(char *line, unsigned int length) {
+  TGsmContext *ctx = gsmEventInstance();
+  wrdLines[ctx == &GsmModem2]++;
+  if ((ctx == &GsmModem2) && (length == 4) && (memcmp(line, "+ISR", 4) == 0)) {
+    // Interrupts for the default instance in the middle of GsmModem2's poll
+    HostUartRx(&UartGSMHandle, "\r\n+CSQ: 9,0\r\n", 13);
+    HostTickAdd(2);
+    bitInterruptedOk = (gsmEventInstance() == &GsmModem2);
+  }
+  return 0;
+}
+
+static void testPollIdle(TGsmContext *ctx) {
+  char i;
+  for (i = 0; (i < 16) && !gsmInstanceNextDeadline(ctx); i++) {
+    gsmInstancePoll(ctx);
+  }
+}
+
+int main() {
+  TGsmHandle handle;
+  unsigned long ms1, ms2;
+  char urcs2;
+  UART_GSM_Init();
+  gsmInit();
+  gsm_MS_Init();
+  testModuleInit(&GsmContextDefault, "", &testUrc);
+  UartModem2.Instance = UART5;
+  UartModem2.Init.BaudRate = 9600;
+  HAL_UART_Init(&UartModem2);
+  hdmaModem2Rx.Instance = &dmaModem2Rx;
+  UartModem2.hdmarx = &hdmaModem2Rx;
+  gsmInstanceInit(&GsmModem2, &UartModem2, &GsmModem2Pins);
+  gsm_MS_InstanceInit(&GsmModem2);
+  testModuleInit(&GsmModem2, "", &testUrc);
+  check(gsmEventInstance() == &GsmContextDefault);
+  check(GsmModem2.bytGsmUrcCount == GsmContextDefault.bytGsmUrcCount);
+  GsmContextDefault.bytGsmState = gsmstStandby;
+  GsmModem2.bytGsmState = gsmstStandby;
+
+  // Characters and lines
+  HostUartRx(&UartModem2, "\r\n+CSQ: 20,0\r\n\r\nOK\r\n", 20);
+  check(GsmModem2.wrdGsmUartRxRingHead == 20);
+  check(GsmContextDefault.wrdGsmUartRxRingHead == 0);
+  testPollIdle(&GsmModem2);
+  check(wrdLines[1] == 4);
+  check(wrdLines[0] == 0);
+  testPollIdle(&GsmContextDefault);
+  check(wrdLines[0] == 0);
+
+  // Interrupts in the middle of the other instance's poll
+  HostUartRx(&UartModem2, "+ISR\r\n", 6);
+  ms1 = GsmContextDefault.dwdGsmMsTmr;
+  ms2 = GsmModem2.dwdGsmMsTmr;
+  testPollIdle(&GsmModem2);
+  check(bitInterruptedOk);
+  check(wrdLines[1] == 5);
+  check(GsmContextDefault.wrdGsmUartRxRingHead == 13);
+  check(GsmContextDefault.dwdGsmMsTmr == ms1 + 2);
+  check(GsmModem2.dwdGsmMsTmr == ms2 + 2);
+  check(gsmEventInstance() == &GsmContextDefault);
+  testPollIdle(&GsmContextDefault);
+  check(wrdLines[0] == 2);
+  check(wrdLines[1] == 5);
+
+  // Requests
+  handle = gsmInstanceRequestSubmit(&GsmModem2, gsmreqDateTimeRead,
+                                    gsmprioNormal, 0, 0, 0, 0, 0);
+  check(handle != 0);
+  check(gsmInstanceRequestActive(&GsmModem2, handle));
+  check(GsmModem2.bytGsmRequestCount == 1);
+  check(GsmContextDefault.bytGsmRequestCount == 0);
+  check(gsmInstanceRequestAbort(&GsmModem2, handle));
+  check(!gsmInstanceRequestActive(&GsmModem2, handle));
+  handle = gsmInstanceGprsHttpGetEx(&GsmModem2, "http://x/", 0, 0);
+  check(handle != 0);
+  check(GsmModem2.bytGsmRequestCount == 1);
+  check(GsmContextDefault.bytGsmRequestCount == 0);
+  check(gsmInstanceRequestAbort(&GsmModem2, handle));
+
+  // Restart of a live instance
+  urcs2 = GsmModem2.bytGsmUrcCount;
+  gsmInstanceInit(&GsmModem2, &UartModem2, &GsmModem2Pins);
+  check(GsmModem2.bytGsmUrcCount == urcs2);
+  check(GsmModem2.pNext == &GsmContextDefault);
+  check(GsmContextDefault.pNext == 0);
+
+  if (!intFailed) {
+    printf("instances: ok\n");
+  }
+  return intFailed != 0;
+}
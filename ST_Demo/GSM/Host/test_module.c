@@ -0,0 +1,13 @@
+// A module for the tests: registers a URC handler with an instance, as the
+// modules' InstanceInit routines do (GSM_Ctx.h is private to the library and
+// its modules).
+
+#include "GSM.h"
+#include "GSM_Ctx.h"
+
+void testModuleInit(TGsmContext *ctx, char *prefix,
+                    char (*handler)(char *line, unsigned int length)) {
+  gsmCtxEnter(ctx);
+  gsmUrcRegister(prefix, handler);
+  gsmCtxLeave();
+}
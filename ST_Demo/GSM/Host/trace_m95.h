@@ -0,0 +1,35 @@
+#ifndef __TRACE_M95_H
+#define __TRACE_M95_H
+// Responses received from a Quectel M95 in standby and while reading messages
+// and an HTTP response (captured, numbers and contents altered), as the
+// traffic the host benchmarks feed to the library.
+// None of the lines is a URC the library or GSM_MS_Quectel.c consumes.
+
+static const char strTraceM95[] =
+  "\r\n+CSQ: 23,0\r\n\r\nOK\r\n"
+  "\r\n+CCLK: \"17/03/21,10:15:40+08\"\r\n\r\nOK\r\n"
+  "\r\n+QNITZ: \"17/03/21,10:15:32+08,0\"\r\n"
+  "\r\n+CTZV: +08,0\r\n"
+  "\r\n+CMGL: 1,\"REC READ\",\"+27821234567\",\"\",\"17/03/21,09:12:01+08\"\r\n"
+  "Meter 0042 reading 12345.6 kWh, status OK, next report at 12:00\r\n"
+  "\r\n+CMGL: 2,\"REC UNREAD\",\"+27829876543\",\"\",\"17/03/21,09:40:17+08\"\r\n"
+  "SET INTERVAL 900;SET APN internet;REBOOT\r\n"
+  "\r\nOK\r\n"
+  "\r\n+CMGS: 17\r\n\r\nOK\r\n"
+  "\r\n+QIMUX: 0\r\n\r\nOK\r\n"
+  "\r\n+QHTTPURL: 0\r\n"
+  "\r\nCONNECT\r\n"
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Type: application/json\r\n"
+  "Content-Length: 180\r\n"
+  "{\"meter\":\"0042\",\"interval\":900,\"tariff\":[{\"from\":\"06:00\",\"rate\":1.82},"
+  "{\"from\":\"18:00\",\"rate\":2.41},{\"from\":\"22:00\",\"rate\":0.97}],\"fw\":\"1.4.2\"}\r\n"
+  "\r\nOK\r\n"
+  "\r\n+QHTTPREAD: 0\r\n"
+  "\r\n+COPS: 0,0,\"MTN-SA\"\r\n\r\nOK\r\n"
+  "\r\n+CBC: 0,87,4012\r\n\r\nOK\r\n"
+  "\r\n+CPMS: 3,30,3,30,3,30\r\n\r\nOK\r\n"
+  "\r\nERROR\r\n"
+  "\r\n+CME ERROR: 58\r\n";
+
+#endif /*__TRACE_M95_H*/
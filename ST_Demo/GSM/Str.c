@@ -1,3 +1,6 @@
+#include "string.h"
+#include "GSM.h" // (str_scan_swar)
+
 void strncpyExNewLine(char *to, char *from, char size) {
   // Copies characters from one string to another, looking for the
   // end of string or checking for a maximum size (maximum number of
@@ -100,4 +103,38 @@ char *RomTxt30(const char *ctxt) {
   }
   //for (b=0;txt[b]=ctxt[b];b++);
   return txt;
+}
+
+unsigned int strScanChar(char *buf, unsigned int len, char c) {
+  // Returns the position of the first "c" within the first "len"
+  // characters of buf (which need not be null-terminated),
+  // or len if it is not found
+  unsigned int pos = 0;
+  #ifdef str_scan_swar
+  unsigned int word;
+  unsigned int pattern;
+  // Check single characters until buf + pos is word-aligned
+  while ((pos < len) && ((unsigned long)(buf + pos) & 3)) {
+    if (buf[pos] == c) {
+      return pos;
+    }
+    pos++;
+  }
+  pattern = 0x01010101 * (unsigned char)c;
+  while (pos + 4 <= len) {
+    memcpy(&word, buf + pos, 4); // (single aligned load)
+    word ^= pattern; // Characters equal to c become zero
+    if ((word - 0x01010101) & ~word & 0x80808080) {
+      break; // Word contains c, find it below
+    }
+    pos += 4;
+  }
+  #endif
+  while (pos < len) {
+    if (buf[pos] == c) {
+      return pos;
+    }
+    pos++;
+  }
+  return len;
 }
\ No newline at end of file
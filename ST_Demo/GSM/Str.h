@@ -4,4 +4,5 @@ extern void lcase(char *string);
 char isnumeric(char *string);
 extern char StrToByte(char *input);
 extern unsigned int StrToWord(char *input);
-extern char *RomTxt30(const char *txt);
\ No newline at end of file
+extern char *RomTxt30(const char *txt);
+extern unsigned int strScanChar(char *buf, unsigned int len, char c);
\ No newline at end of file
@@ -83,23 +83,31 @@ int main(void)
     UART_Write("ATZ"); //reset config module sim
     HAL_UART_Receive(&UartGSMHandle,(uint8_t *) pDataRX,2,TimeOut_RX);
     HAL_Delay(100);
-    UART_Write("ATE"); //echo on
-    HAL_UART_Receive(&UartGSMHandle,(uint8_t *) pDataRX,2,TimeOut_RX);
-    HAL_Delay(100);
     UART_Write("AT+COPS?"); //check sim service provider 
     HAL_UART_Receive(&UartGSMHandle,(uint8_t *) pDataRX,100,TimeOut_RX);
     HAL_Delay(1000);
     UART_Write("AT+CSQ");//check signal quality
     HAL_UART_Receive(&UartGSMHandle,(uint8_t *) pDataRX,10,TimeOut_RX);
     HAL_Delay(1000);
-    UART_Write("ATEO"); //echo off
+    UART_Write("ATE0"); //echo off
     HAL_UART_Receive(&UartGSMHandle,(uint8_t *) pDataRX,2,TimeOut_RX);
     HAL_Delay(100);
 //    gsm_GPRS_Init();
+#ifdef gsm_rtos
+    /** 
+    The GSM task runs the library once the scheduler is started 
+    (freertos_main() below) 
+    */
+    if(!gsmRtosStart(tskIDLE_PRIORITY + 2))
+    {
+        Error_Handler();
+    }
+#else
     while(1){
       gsmPoll();
       HAL_Delay(10);
     }
+#endif
     /** 
     Initialize LED2. Used to report Error 
     */
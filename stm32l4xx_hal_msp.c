@@ -40,7 +40,13 @@
     
 extern void Error_Handler(void);
 /* USER CODE BEGIN 0 */
-
+#ifdef gsm_rtos
+/* The GSM interrupts wake the GSM task (gsmRtosNotifyFromISR()), so they may
+   not be more urgent than configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY */
+#define USART_GSM_IRQ_PRIORITY  configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY
+#else
+#define USART_GSM_IRQ_PRIORITY  2
+#endif
 /* USER CODE END 0 */
 /**
   * Initializes the Global MSP.
@@ -206,6 +212,79 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
 
       HAL_GPIO_Init(USART_GSM_RX_GPIO_PORT, &GPIO_InitStruct);      
       
+#ifdef gsm_uart_hw_flow_ctl
+      /* UART CTS GPIO pin configuration (from the module) */
+      USART_GSM_CTS_GPIO_CLK_ENABLE();
+      GPIO_InitStruct.Pin       = USART_GSM_CTS_PIN;
+      GPIO_InitStruct.Alternate = USART_GSM_CTS_AF;
+
+      HAL_GPIO_Init(USART_GSM_CTS_GPIO_PORT, &GPIO_InitStruct);
+
+      /* RTS GPIO pin configuration (to the module, driven by the GSM driver) */
+      USART_GSM_RTS_GPIO_CLK_ENABLE();
+      HAL_GPIO_WritePin(USART_GSM_RTS_GPIO_PORT, USART_GSM_RTS_PIN, GPIO_PIN_RESET);
+      GPIO_InitStruct.Pin       = USART_GSM_RTS_PIN;
+      GPIO_InitStruct.Mode      = GPIO_MODE_OUTPUT_PP;
+      GPIO_InitStruct.Pull      = GPIO_NOPULL;
+      GPIO_InitStruct.Alternate = 0;
+
+      HAL_GPIO_Init(USART_GSM_RTS_GPIO_PORT, &GPIO_InitStruct);
+#endif
+
+#if defined(gsm_dma_uart_rx) || defined(gsm_dma_uart_tx)
+      USART_GSM_DMA_CLK_ENABLE();
+#endif
+
+#ifdef gsm_dma_uart_rx
+      /*##-3- Configure the DMA ##################################################*/
+      /* Circular reception straight into the GSM driver's ring buffer */
+
+      hdmaGsmRx.Instance                 = USART_GSM_RX_DMA_CHANNEL;
+      hdmaGsmRx.Init.Request             = USART_GSM_RX_DMA_REQUEST;
+      hdmaGsmRx.Init.Direction           = DMA_PERIPH_TO_MEMORY;
+      hdmaGsmRx.Init.PeriphInc           = DMA_PINC_DISABLE;
+      hdmaGsmRx.Init.MemInc              = DMA_MINC_ENABLE;
+      hdmaGsmRx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+      hdmaGsmRx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+      hdmaGsmRx.Init.Mode                = DMA_CIRCULAR;
+      hdmaGsmRx.Init.Priority            = DMA_PRIORITY_HIGH;
+
+      HAL_DMA_Init(&hdmaGsmRx);
+
+      /* Associate the initialized DMA handle to the UART handle */
+      __HAL_LINKDMA(huart, hdmarx, hdmaGsmRx);
+
+      /*##-4- Configure the NVIC for DMA and UART ################################*/
+      /* NVIC for DMA half / full transfer and UART idle line */
+      HAL_NVIC_SetPriority(USART_GSM_RX_DMA_IRQn, USART_GSM_IRQ_PRIORITY, 0);
+      HAL_NVIC_EnableIRQ(USART_GSM_RX_DMA_IRQn);
+#endif
+
+#ifdef gsm_dma_uart_tx
+      /* Gathered transmissions from the GSM driver */
+      hdmaGsmTx.Instance                 = USART_GSM_TX_DMA_CHANNEL;
+      hdmaGsmTx.Init.Request             = USART_GSM_TX_DMA_REQUEST;
+      hdmaGsmTx.Init.Direction           = DMA_MEMORY_TO_PERIPH;
+      hdmaGsmTx.Init.PeriphInc           = DMA_PINC_DISABLE;
+      hdmaGsmTx.Init.MemInc              = DMA_MINC_ENABLE;
+      hdmaGsmTx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+      hdmaGsmTx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+      hdmaGsmTx.Init.Mode                = DMA_NORMAL;
+      hdmaGsmTx.Init.Priority            = DMA_PRIORITY_LOW;
+
+      HAL_DMA_Init(&hdmaGsmTx);
+
+      __HAL_LINKDMA(huart, hdmatx, hdmaGsmTx);
+
+      HAL_NVIC_SetPriority(USART_GSM_TX_DMA_IRQn, USART_GSM_IRQ_PRIORITY, 2);
+      HAL_NVIC_EnableIRQ(USART_GSM_TX_DMA_IRQn);
+#endif
+
+#if defined(gsm_dma_uart_rx) || defined(gsm_dma_uart_tx)
+      /* NVIC for UART idle line / transmission complete */
+      HAL_NVIC_SetPriority(USART_GSM_IRQn, USART_GSM_IRQ_PRIORITY, 1);
+      HAL_NVIC_EnableIRQ(USART_GSM_IRQn);
+#endif
     }
 }
 
@@ -81,6 +81,15 @@ void USARTx_PRINT_IRQHandler(void);
 void USARTx_EXTI_IRQHandler(void);
 void TIMx_IRQHandler(void);
 void TIMp_IRQHandler(void);
+#if defined(gsm_dma_uart_rx) || defined(gsm_dma_uart_tx)
+void USART_GSM_IRQHandler(void);
+#endif
+#ifdef gsm_dma_uart_rx
+void USART_GSM_RX_DMA_IRQHandler(void);
+#endif
+#ifdef gsm_dma_uart_tx
+void USART_GSM_TX_DMA_IRQHandler(void);
+#endif
 /* USER CODE END 0 */
 
 /* External variables --------------------------------------------------------*/
@@ -256,9 +265,32 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 */
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *UartHandleArg)
 {
+#ifdef gsm_dma_uart_rx
+    if (UartHandleArg == &UartGSMHandle)
+    {
+        gsmUartRxPublish(UartHandleArg);
+        return;
+    }
+#endif
     WiFi_HAL_UART_RxCpltCallback(UartHandleArg);
 }
 
+#ifdef gsm_dma_uart_rx
+/**
+* @brief  HAL_UART_RxHalfCpltCallback
+*         Rx Half Transfer completed callback (GSM UART circular DMA)
+* @param  UartHandleArg: UART handle 
+* @retval None
+*/
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *UartHandleArg)
+{
+    if (UartHandleArg == &UartGSMHandle)
+    {
+        gsmUartRxPublish(UartHandleArg);
+    }
+}
+#endif
+
 /**
 * @brief  HAL_UART_TxCpltCallback
 *         Tx Transfer completed callback
@@ -267,6 +299,13 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *UartHandleArg)
 */
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *UartHandleArg)
 {
+#ifdef gsm_dma_uart_tx
+    if (UartHandleArg == &UartGSMHandle)
+    {
+        gsmUartTxDmaDone(UartHandleArg);
+        return;
+    }
+#endif
     WiFi_HAL_UART_TxCpltCallback(UartHandleArg);
 }
 
@@ -279,6 +318,13 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *UartHandleArg)
 */
 void HAL_UART_ErrorCallback(UART_HandleTypeDef *UartHandle)
 {
+#ifdef gsm_dma_uart_rx
+    if (UartHandle == &UartGSMHandle)
+    {
+        gsmUartRxDmaError(UartHandle);
+        return;
+    }
+#endif
     WiFi_HAL_UART_ErrorCallback(UartHandle);
 }
 
@@ -311,5 +357,50 @@ void USARTx_PRINT_IRQHandler(void)										//USART2_IRQHandler
     HAL_UART_IRQHandler(&UartMsgHandle);
 }
 #endif
+
+#if defined(gsm_dma_uart_rx) || defined(gsm_dma_uart_tx)
+/**
+* @brief  This function handles the GSM UART Handler.
+*         Publishes the characters received by DMA once the line goes idle.
+* @param  None
+* @retval None
+*/
+void USART_GSM_IRQHandler(void)												//UART4_IRQHandler
+{
+#ifdef gsm_dma_uart_rx
+    if (__HAL_UART_GET_FLAG(&UartGSMHandle, UART_FLAG_IDLE) != RESET)
+    {
+        __HAL_UART_CLEAR_IDLEFLAG(&UartGSMHandle);
+        gsmUartRxPublish(&UartGSMHandle);
+    }
+#endif
+    HAL_UART_IRQHandler(&UartGSMHandle);
+}
+#endif
+
+#ifdef gsm_dma_uart_rx
+
+/**
+* @brief  This function handles the GSM UART Rx DMA Handler.
+* @param  None
+* @retval None
+*/
+void USART_GSM_RX_DMA_IRQHandler(void)										//DMA2_Channel5_IRQHandler
+{
+    HAL_DMA_IRQHandler(UartGSMHandle.hdmarx);
+}
+#endif
+
+#ifdef gsm_dma_uart_tx
+/**
+* @brief  This function handles the GSM UART Tx DMA Handler.
+* @param  None
+* @retval None
+*/
+void USART_GSM_TX_DMA_IRQHandler(void)										//DMA2_Channel3_IRQHandler
+{
+    HAL_DMA_IRQHandler(UartGSMHandle.hdmatx);
+}
+#endif
 /* USER CODE END 1 */
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/